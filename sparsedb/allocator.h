@@ -0,0 +1,282 @@
+#pragma once
+
+#include <cstddef>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+namespace sparsedb
+{
+// Memory accounting for an allocator policy. reserved is what has been
+// obtained from the system and used is what is currently handed out.
+struct AllocatorStats
+{
+    std::size_t reserved = 0;
+    std::size_t used = 0;
+};
+
+// Allocator policies hand out arrays of n values of T, aligned to at least
+// 8 bytes. They are stateless from the caller's point of view, so that a
+// SparseVector only has to store a pointer, and callers must pass back the
+// same n when freeing. allocate_batch and deallocate_batch handle several
+// arrays of the same size at once, for callers that cache arrays.
+
+// Allocates each array separately from the system allocator.
+template <class T>
+class MallocAllocator
+{
+    static std::atomic<std::size_t> &used()
+    {
+        static std::atomic<std::size_t> used{0};
+        return used;
+    }
+
+   public:
+    static T *allocate(std::size_t const n)
+    {
+        return reallocate(nullptr, 0, n);
+    }
+
+    static T *reallocate(T *p, std::size_t const oldSize,
+                         std::size_t const newSize)
+    {
+        if (!newSize)
+        {
+            deallocate(p, oldSize);
+            return nullptr;
+        }
+        void *mem = std::realloc(p, newSize * sizeof(T));
+        if (!mem)
+            throw std::bad_alloc();
+        used() += (newSize - oldSize) * sizeof(T);
+        return static_cast<T *>(mem);
+    }
+
+    static void deallocate(T *p, std::size_t const n)
+    {
+        std::free(p);
+        used() -= n * sizeof(T);
+    }
+
+    static void allocate_batch(std::size_t const n, T **out,
+                               std::size_t const count)
+    {
+        for (std::size_t i = 0; i < count; i++) out[i] = allocate(n);
+    }
+
+    static void deallocate_batch(T *const *p, std::size_t const n,
+                                 std::size_t const count)
+    {
+        for (std::size_t i = 0; i < count; i++) deallocate(p[i], n);
+    }
+
+    static AllocatorStats stats()
+    {
+        AllocatorStats s;
+        s.reserved = s.used = used();
+        return s;
+    }
+};
+
+// Hands out arrays of an even number of values, up to MAX_VALUES, from large
+// arenas with one size class per even size. Freed arrays are kept on a free
+// list per size class and reused; arena memory is never returned to the
+// system. Larger arrays fall back to the system allocator.
+template <class T, std::size_t MAX_VALUES = 64>
+class SlabAllocator
+{
+    static_assert(MAX_VALUES % 2 == 0, "MAX_VALUES must be even");
+
+    enum : std::size_t
+    {
+        NUM_CLASSES = MAX_VALUES / 2,
+        ARENA_SIZE = 256 * 1024,
+        ALIGNMENT = alignof(T) > 8 ? alignof(T) : 8
+    };
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    struct SizeClass
+    {
+        std::mutex mutex;
+        FreeBlock *free = nullptr;
+        char *arena = nullptr;
+        std::size_t remaining = 0;
+        std::size_t reserved = 0;
+        std::size_t used = 0;
+    };
+
+    struct State
+    {
+        SizeClass classes[NUM_CLASSES];
+        std::atomic<std::size_t> large{0};
+    };
+
+    // Deliberately leaked so that it outlives any static SparseVector.
+    static State &state()
+    {
+        static State *state = new State();
+        return *state;
+    }
+
+    static std::size_t block_size(std::size_t const n)
+    {
+        auto bytes = std::max(n * sizeof(T), sizeof(FreeBlock));
+        return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    static std::size_t class_for_size(std::size_t const n)
+    {
+        assert(n % 2 == 0);
+        return n / 2 - 1;
+    }
+
+    static T *reallocate_large(T *p, std::size_t const oldSize,
+                               std::size_t const newSize)
+    {
+        if (!newSize)
+        {
+            std::free(p);
+            state().large -= oldSize * sizeof(T);
+            return nullptr;
+        }
+        void *mem = std::realloc(p, newSize * sizeof(T));
+        if (!mem)
+            throw std::bad_alloc();
+        state().large += (newSize - oldSize) * sizeof(T);
+        return static_cast<T *>(mem);
+    }
+
+    // Takes a block from the free list or the arena. Called under the size
+    // class's lock.
+    static T *take(SizeClass &c, std::size_t const bytes)
+    {
+        if (c.free)
+        {
+            auto block = c.free;
+            c.free = block->next;
+            c.used += bytes;
+            return reinterpret_cast<T *>(block);
+        }
+        if (c.remaining < bytes)
+        {
+            c.arena = static_cast<char *>(std::malloc(ARENA_SIZE));
+            if (!c.arena)
+                throw std::bad_alloc();
+            c.remaining = ARENA_SIZE;
+            c.reserved += ARENA_SIZE;
+        }
+        auto block = c.arena;
+        c.arena += bytes;
+        c.remaining -= bytes;
+        c.used += bytes;
+        return reinterpret_cast<T *>(block);
+    }
+
+    // Puts a block on the free list. Called under the size class's lock.
+    static void give(SizeClass &c, T *p, std::size_t const bytes)
+    {
+        auto block = reinterpret_cast<FreeBlock *>(p);
+        block->next = c.free;
+        c.free = block;
+        c.used -= bytes;
+    }
+
+   public:
+    static T *allocate(std::size_t const n)
+    {
+        assert(n > 0);
+        if (n > MAX_VALUES)
+            return reallocate_large(nullptr, 0, n);
+        auto &c = state().classes[class_for_size(n)];
+        std::lock_guard<std::mutex> lock(c.mutex);
+        return take(c, block_size(n));
+    }
+
+    // Allocates count arrays of n values into out, taking the size class's
+    // lock once.
+    static void allocate_batch(std::size_t const n, T **out,
+                               std::size_t const count)
+    {
+        assert(n > 0);
+        if (n > MAX_VALUES)
+        {
+            for (std::size_t i = 0; i < count; i++) out[i] = allocate(n);
+            return;
+        }
+        auto const bytes = block_size(n);
+        auto &c = state().classes[class_for_size(n)];
+        std::lock_guard<std::mutex> lock(c.mutex);
+        for (std::size_t i = 0; i < count; i++) out[i] = take(c, bytes);
+    }
+
+    static T *reallocate(T *p, std::size_t const oldSize,
+                         std::size_t const newSize)
+    {
+        if (oldSize == newSize)
+            return p;
+        if (oldSize > MAX_VALUES && newSize > MAX_VALUES)
+            return reallocate_large(p, oldSize, newSize);
+        T *mem = newSize ? allocate(newSize) : nullptr;
+        if (p && mem)
+            std::memcpy(mem, p, std::min(oldSize, newSize) * sizeof(T));
+        deallocate(p, oldSize);
+        return mem;
+    }
+
+    static void deallocate(T *p, std::size_t const n)
+    {
+        if (!p || !n)
+            return;
+        if (n > MAX_VALUES)
+        {
+            reallocate_large(p, n, 0);
+            return;
+        }
+        auto &c = state().classes[class_for_size(n)];
+        std::lock_guard<std::mutex> lock(c.mutex);
+        give(c, p, block_size(n));
+    }
+
+    // Frees count arrays of n values, taking the size class's lock once.
+    static void deallocate_batch(T *const *p, std::size_t const n,
+                                 std::size_t const count)
+    {
+        if (!n)
+            return;
+        if (n > MAX_VALUES)
+        {
+            for (std::size_t i = 0; i < count; i++) deallocate(p[i], n);
+            return;
+        }
+        auto const bytes = block_size(n);
+        auto &c = state().classes[class_for_size(n)];
+        std::lock_guard<std::mutex> lock(c.mutex);
+        for (std::size_t i = 0; i < count; i++)
+        {
+            if (p[i])
+                give(c, p[i], bytes);
+        }
+    }
+
+    static AllocatorStats stats()
+    {
+        AllocatorStats s;
+        s.reserved = s.used = state().large;
+        for (auto &c : state().classes)
+        {
+            std::lock_guard<std::mutex> lock(c.mutex);
+            s.reserved += c.reserved;
+            s.used += c.used;
+        }
+        return s;
+    }
+};
+}  // namespace sparsedb
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+#ifdef __MSC_VER
+#include <nmmintrin.h>
+#define __builtin_popcountll _mm_popcnt_u64
+#endif
+
+namespace sparsedb
+{
+// Occupancy bitmaps for groups of more than 64 positions, stored as WORDS
+// 64 bit words with position 0 in the lowest bit of the first word.
+template <std::size_t WORDS>
+struct MultiBitmap
+{
+    static_assert(WORDS > 1, "use std::uint64_t for a single word");
+    std::uint64_t words[WORDS];
+
+    MultiBitmap() : words() {}
+
+    bool operator==(MultiBitmap const &rhs) const
+    {
+        for (std::size_t i = 0; i < WORDS; i++)
+            if (words[i] != rhs.words[i])
+                return false;
+        return true;
+    }
+
+    bool operator!=(MultiBitmap const &rhs) const { return !(*this == rhs); }
+};
+
+// The bitmap type for a group of BITS positions, a plain std::uint64_t for
+// the common 64 position group.
+template <std::size_t BITS>
+struct BitmapFor
+{
+    static_assert(BITS % 64 == 0, "group sizes must be a multiple of 64");
+    using type = MultiBitmap<BITS / 64>;
+};
+
+template <>
+struct BitmapFor<64>
+{
+    using type = std::uint64_t;
+};
+
+// Operations shared by single and multi word bitmaps, so that the groups
+// and indexes can be written once for any group width.
+
+// The words of a bitmap, lowest positions first.
+inline std::uint64_t *bitmap_words(std::uint64_t &bitmap) { return &bitmap; }
+
+inline const std::uint64_t *bitmap_words(std::uint64_t const &bitmap)
+{
+    return &bitmap;
+}
+
+inline bool bitmap_any(std::uint64_t const bitmap) { return bitmap != 0; }
+
+inline std::size_t bitmap_count(std::uint64_t const bitmap)
+{
+    return __builtin_popcountll(bitmap);
+}
+
+inline bool bitmap_test(std::uint64_t const bitmap, std::size_t const pos)
+{
+    assert(pos < 64);
+    return bitmap & (1ULL << pos);
+}
+
+inline void bitmap_set(std::uint64_t &bitmap, std::size_t const pos)
+{
+    assert(pos < 64);
+    bitmap |= 1ULL << pos;
+}
+
+inline void bitmap_reset(std::uint64_t &bitmap, std::size_t const pos)
+{
+    assert(pos < 64);
+    bitmap &= ~(1ULL << pos);
+}
+
+// Number of set bits below pos.
+inline std::size_t bitmap_rank(std::uint64_t const bitmap,
+                               std::size_t const pos)
+{
+    assert(pos < 64);
+    return __builtin_popcountll(bitmap & ((1ULL << pos) - 1ULL));
+}
+
+// Position of the lowest set bit. The bitmap must not be empty.
+inline std::size_t bitmap_first(std::uint64_t const bitmap)
+{
+    assert(bitmap);
+    return __builtin_ctzll(bitmap);
+}
+
+inline void bitmap_clear_first(std::uint64_t &bitmap)
+{
+    bitmap &= bitmap - 1;
+}
+
+// Position of the k'th set bit, counting from zero.
+inline std::size_t bitmap_select(std::uint64_t bitmap, std::size_t k)
+{
+    assert(k < bitmap_count(bitmap));
+    for (; k; k--) bitmap &= bitmap - 1;
+    return __builtin_ctzll(bitmap);
+}
+
+// Clears every bit outside [lo, hi).
+inline void bitmap_mask(std::uint64_t &bitmap, std::size_t const lo,
+                        std::size_t const hi)
+{
+    assert(lo <= hi && hi <= 64);
+    if (lo == 64)
+    {
+        bitmap = 0;
+        return;
+    }
+    if (hi < 64)
+        bitmap &= (1ULL << hi) - 1ULL;
+    bitmap &= ~((1ULL << lo) - 1ULL);
+}
+
+template <std::size_t WORDS>
+std::uint64_t *bitmap_words(MultiBitmap<WORDS> &bitmap)
+{
+    return bitmap.words;
+}
+
+template <std::size_t WORDS>
+const std::uint64_t *bitmap_words(MultiBitmap<WORDS> const &bitmap)
+{
+    return bitmap.words;
+}
+
+template <std::size_t WORDS>
+bool bitmap_any(MultiBitmap<WORDS> const &bitmap)
+{
+    std::uint64_t any = 0;
+    for (auto const w : bitmap.words) any |= w;
+    return any != 0;
+}
+
+template <std::size_t WORDS>
+std::size_t bitmap_count(MultiBitmap<WORDS> const &bitmap)
+{
+    std::size_t count = 0;
+    for (auto const w : bitmap.words) count += __builtin_popcountll(w);
+    return count;
+}
+
+template <std::size_t WORDS>
+bool bitmap_test(MultiBitmap<WORDS> const &bitmap, std::size_t const pos)
+{
+    assert(pos < 64 * WORDS);
+    return bitmap_test(bitmap.words[pos / 64], pos % 64);
+}
+
+template <std::size_t WORDS>
+void bitmap_set(MultiBitmap<WORDS> &bitmap, std::size_t const pos)
+{
+    assert(pos < 64 * WORDS);
+    bitmap_set(bitmap.words[pos / 64], pos % 64);
+}
+
+template <std::size_t WORDS>
+void bitmap_reset(MultiBitmap<WORDS> &bitmap, std::size_t const pos)
+{
+    assert(pos < 64 * WORDS);
+    bitmap_reset(bitmap.words[pos / 64], pos % 64);
+}
+
+// Sums the popcount of every word masked to the bits below pos. The loop
+// has a fixed trip count and no branches, so it unrolls into WORDS popcnt
+// instructions over a single cache line.
+template <std::size_t WORDS>
+std::size_t bitmap_rank(MultiBitmap<WORDS> const &bitmap,
+                        std::size_t const pos)
+{
+    assert(pos < 64 * WORDS);
+    auto const word = pos / 64;
+    auto const partial = (1ULL << (pos % 64)) - 1ULL;
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < WORDS; i++)
+    {
+        auto const mask = i < word ? ~0ULL : i == word ? partial : 0ULL;
+        count += __builtin_popcountll(bitmap.words[i] & mask);
+    }
+    return count;
+}
+
+template <std::size_t WORDS>
+std::size_t bitmap_first(MultiBitmap<WORDS> const &bitmap)
+{
+    std::size_t i = 0;
+    while (!bitmap.words[i]) i++;
+    assert(i < WORDS);
+    return i * 64 + __builtin_ctzll(bitmap.words[i]);
+}
+
+template <std::size_t WORDS>
+void bitmap_clear_first(MultiBitmap<WORDS> &bitmap)
+{
+    std::size_t i = 0;
+    while (!bitmap.words[i]) i++;
+    assert(i < WORDS);
+    bitmap_clear_first(bitmap.words[i]);
+}
+
+template <std::size_t WORDS>
+std::size_t bitmap_select(MultiBitmap<WORDS> const &bitmap, std::size_t k)
+{
+    assert(k < bitmap_count(bitmap));
+    std::size_t i = 0;
+    for (;; i++)
+    {
+        std::size_t const count = __builtin_popcountll(bitmap.words[i]);
+        if (k < count)
+            break;
+        k -= count;
+    }
+    return i * 64 + bitmap_select(bitmap.words[i], k);
+}
+
+template <std::size_t WORDS>
+void bitmap_mask(MultiBitmap<WORDS> &bitmap, std::size_t const lo,
+                 std::size_t const hi)
+{
+    assert(lo <= hi && hi <= 64 * WORDS);
+    for (std::size_t i = 0; i < WORDS; i++)
+    {
+        auto const first = i * 64;
+        if (hi <= first || lo >= first + 64)
+            bitmap.words[i] = 0;
+        else
+            bitmap_mask(bitmap.words[i], lo > first ? lo - first : 0,
+                        hi < first + 64 ? hi - first : 64);
+    }
+}
+}  // namespace sparsedb
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+
+namespace sparsedb
+{
+// Set operations applied word by word to arrays of bitmap words.
+enum class SetOp
+{
+    INTERSECT,
+    UNITE,
+    SUBTRACT
+};
+
+namespace detail
+{
+template <SetOp OP>
+inline std::uint64_t combine_word(std::uint64_t const a, std::uint64_t const b)
+{
+    return OP == SetOp::INTERSECT ? a & b : OP == SetOp::UNITE ? a | b : a & ~b;
+}
+
+template <SetOp OP>
+std::size_t combine_scalar(const std::uint64_t *a, const std::uint64_t *b,
+                           std::uint64_t *out, std::size_t const words)
+{
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < words; i++)
+    {
+        auto const w = combine_word<OP>(a[i], b[i]);
+        if (out)
+            out[i] = w;
+        count += __builtin_popcountll(w);
+    }
+    return count;
+}
+
+// Four words at a time, counting bits with the nibble lookup table method
+// of Mula, Kurz and Lemire as AVX2 has no vector popcount.
+template <SetOp OP>
+__attribute__((target("avx2"))) std::size_t combine_avx2(
+    const std::uint64_t *a, const std::uint64_t *b, std::uint64_t *out,
+    std::size_t const words)
+{
+    auto const lookup =
+        _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                         1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    auto const nibble = _mm256_set1_epi8(0x0F);
+    auto total = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 4 <= words; i += 4)
+    {
+        auto const va =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        auto const vb =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        auto const w = OP == SetOp::INTERSECT ? _mm256_and_si256(va, vb)
+                       : OP == SetOp::UNITE   ? _mm256_or_si256(va, vb)
+                                              : _mm256_andnot_si256(vb, va);
+        if (out)
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), w);
+        auto const lo = _mm256_and_si256(w, nibble);
+        auto const hi = _mm256_and_si256(_mm256_srli_epi16(w, 4), nibble);
+        auto const bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                           _mm256_shuffle_epi8(lookup, hi));
+        total = _mm256_add_epi64(
+            total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    std::size_t count = _mm256_extract_epi64(total, 0) +
+                        _mm256_extract_epi64(total, 1) +
+                        _mm256_extract_epi64(total, 2) +
+                        _mm256_extract_epi64(total, 3);
+    return count + combine_scalar<OP>(a + i, b + i, out ? out + i : nullptr,
+                                      words - i);
+}
+
+inline bool has_avx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+}  // namespace detail
+
+// Sets out[i] to a[i] op b[i] for each of the words, unless out is null,
+// and returns the number of bits set in the result. Uses AVX2 where the
+// CPU has it.
+template <SetOp OP>
+std::size_t bitmap_combine(const std::uint64_t *a, const std::uint64_t *b,
+                           std::uint64_t *out, std::size_t const words)
+{
+    if (detail::has_avx2())
+        return detail::combine_avx2<OP>(a, b, out, words);
+    return detail::combine_scalar<OP>(a, b, out, words);
+}
+}  // namespace sparsedb
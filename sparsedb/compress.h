@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace sparsedb
+{
+// A byte oriented LZ77 codec in the manner of LZ4, for blocks of up to a
+// few megabytes. A block is a series of sequences, each a token whose high
+// nibble is the number of literals and low nibble the match length less
+// LZ_MIN_MATCH, either continued in bytes of 255 and a final smaller byte
+// when it is 15, then the literals, then a two byte little endian offset
+// back into the output and any continuation of the match length. The last
+// sequence has only literals. Matches are found through a hash table of
+// the last position of each four byte prefix, and the encoder skips ahead
+// faster the longer it goes without one so incompressible input stays
+// cheap.
+enum
+{
+    LZ_MIN_MATCH = 4,
+    LZ_HASH_BITS = 12,
+    LZ_MAX_OFFSET = 65535
+};
+
+namespace detail
+{
+inline std::uint32_t lz_load32(const std::uint8_t *p)
+{
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline std::uint32_t lz_hash(std::uint32_t const v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+inline std::uint8_t *lz_write_length(std::uint8_t *out, std::size_t length)
+{
+    for (; length >= 255; length -= 255) *out++ = 255;
+    *out++ = static_cast<std::uint8_t>(length);
+    return out;
+}
+
+inline bool lz_read_length(const std::uint8_t *&in, const std::uint8_t *end,
+                           std::size_t &length)
+{
+    std::uint8_t b;
+    do
+    {
+        if (in == end)
+            return false;
+        b = *in++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+inline std::uint8_t *lz_sequence(std::uint8_t *out,
+                                 const std::uint8_t *literals,
+                                 std::size_t const count,
+                                 std::size_t const offset,
+                                 std::size_t const length)
+{
+    auto const extra = length ? length - LZ_MIN_MATCH : 0;
+    *out++ = static_cast<std::uint8_t>((count < 15 ? count : 15) << 4 |
+                                       (extra < 15 ? extra : 15));
+    if (count >= 15)
+        out = lz_write_length(out, count - 15);
+    std::memcpy(out, literals, count);
+    out += count;
+    if (!length)
+        return out;
+    *out++ = static_cast<std::uint8_t>(offset);
+    *out++ = static_cast<std::uint8_t>(offset >> 8);
+    if (extra >= 15)
+        out = lz_write_length(out, extra - 15);
+    return out;
+}
+}  // namespace detail
+
+// Size of the buffer lz_compress needs for length bytes of input.
+inline std::size_t lz_bound(std::size_t const length)
+{
+    return length + length / 255 + 16;
+}
+
+// Compresses length bytes from src into dst, which must hold
+// lz_bound(length) bytes, and returns the compressed size.
+inline std::size_t lz_compress(const void *src, std::size_t const length,
+                               void *dst)
+{
+    auto const in = static_cast<const std::uint8_t *>(src);
+    auto out = static_cast<std::uint8_t *>(dst);
+    std::uint32_t table[1 << LZ_HASH_BITS] = {};
+    std::size_t anchor = 0;
+    std::size_t i = 0;
+    while (i + LZ_MIN_MATCH <= length)
+    {
+        auto const v = detail::lz_load32(in + i);
+        auto &slot = table[detail::lz_hash(v)];
+        std::size_t const candidate = slot;
+        slot = static_cast<std::uint32_t>(i);
+        if (candidate >= i || i - candidate > LZ_MAX_OFFSET ||
+            detail::lz_load32(in + candidate) != v)
+        {
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        std::size_t match = LZ_MIN_MATCH;
+        while (i + match < length && in[candidate + match] == in[i + match])
+            match++;
+        out = detail::lz_sequence(out, in + anchor, i - anchor, i - candidate,
+                                  match);
+        i += match;
+        anchor = i;
+    }
+    out = detail::lz_sequence(out, in + anchor, length - anchor, 0, 0);
+    return out - static_cast<std::uint8_t *>(dst);
+}
+
+// Decompresses the length bytes at src, which must expand to exactly
+// rawLength bytes, into dst. Returns false if they are not a valid block.
+inline bool lz_decompress(const void *src, std::size_t const length, void *dst,
+                          std::size_t const rawLength)
+{
+    auto in = static_cast<const std::uint8_t *>(src);
+    auto const end = in + length;
+    auto const begin = static_cast<std::uint8_t *>(dst);
+    auto out = begin;
+    auto const outEnd = begin + rawLength;
+    while (in < end)
+    {
+        auto const token = *in++;
+        std::size_t count = token >> 4;
+        if (count == 15 && !detail::lz_read_length(in, end, count))
+            return false;
+        if (count > std::size_t(end - in) || count > std::size_t(outEnd - out))
+            return false;
+        std::memcpy(out, in, count);
+        in += count;
+        out += count;
+        if (in == end)
+            return out == outEnd;
+        if (end - in < 2)
+            return false;
+        std::size_t const offset = in[0] | in[1] << 8;
+        in += 2;
+        std::size_t match = token & 15;
+        if (match == 15 && !detail::lz_read_length(in, end, match))
+            return false;
+        match += LZ_MIN_MATCH;
+        if (!offset || offset > std::size_t(out - begin) ||
+            match > std::size_t(outEnd - out))
+            return false;
+        auto const from = out - offset;
+        if (offset >= match)
+            std::memcpy(out, from, match);
+        else
+            for (std::size_t k = 0; k < match; k++) out[k] = from[k];
+        out += match;
+    }
+    // The last sequence must have been one of literals alone.
+    return false;
+}
+
+// Whether delta_encode applies to values of type V.
+template <class V>
+struct delta_codable
+    : std::integral_constant<bool, std::is_integral<V>::value &&
+                                       !std::is_same<V, bool>::value>
+{
+};
+
+// Most bytes delta_encode writes for count values of type V.
+template <class V>
+std::size_t delta_bound(std::size_t const count)
+{
+    return count * ((sizeof(V) * 8 + 6) / 7);
+}
+
+// Writes the difference of each value from the one before it, starting
+// from previous, zigzag encoded so small negative differences stay small
+// and then as a little endian base 128 varint. Returns the end of the
+// output and leaves the last value in previous, so that a sequence can be
+// encoded in parts.
+template <class V>
+std::uint8_t *delta_encode(const V *values, std::size_t const count,
+                           V &previous, std::uint8_t *out)
+{
+    using U = typename std::make_unsigned<V>::type;
+    using S = typename std::make_signed<V>::type;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        auto const delta = static_cast<S>(static_cast<U>(
+            static_cast<U>(values[i]) - static_cast<U>(previous)));
+        U zigzag = static_cast<U>(static_cast<U>(delta) << 1) ^
+                      static_cast<U>(delta >> (sizeof(V) * 8 - 1));
+        for (; zigzag >= 0x80; zigzag >>= 7)
+            *out++ = static_cast<std::uint8_t>(zigzag | 0x80);
+        *out++ = static_cast<std::uint8_t>(zigzag);
+        previous = values[i];
+    }
+    return out;
+}
+
+// Reverses delta_encode, reading count values from [in, end). Returns the
+// end of the input read, or null if it is not a valid encoding.
+template <class V>
+const std::uint8_t *delta_decode(const std::uint8_t *in,
+                                 const std::uint8_t *end, V *values,
+                                 std::size_t const count, V &previous)
+{
+    using U = typename std::make_unsigned<V>::type;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        U zigzag = 0;
+        for (unsigned shift = 0;; shift += 7)
+        {
+            if (in == end || shift >= sizeof(V) * 8)
+                return nullptr;
+            auto const b = *in++;
+            zigzag |= static_cast<U>(static_cast<U>(b & 0x7F) << shift);
+            if (!(b & 0x80))
+                break;
+        }
+        auto const delta = static_cast<U>((zigzag >> 1) ^ (0 - (zigzag & 1)));
+        previous = static_cast<V>(static_cast<U>(previous) + delta);
+        values[i] = previous;
+    }
+    return in;
+}
+}  // namespace sparsedb
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <cstddef>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "allocator.h"
+#include "epoch.h"
+
+namespace sparsedb
+{
+// A SparseIndex that can be shared between threads. Writers take a lock on
+// the stripe owning the group they modify. Readers never block: each group
+// is a bitmap and a pointer to an immutable payload, read consistently
+// under the stripe's sequence lock. Writers publish a new payload on every
+// change and retire the old one to be freed once no reader can see it.
+//
+// Each stripe caches the payloads it frees, by size, and refills and
+// drains its cache CACHE_BATCH payloads at a time, so that writers of
+// different stripes rarely meet on the allocator's locks. The cached
+// payloads count as used in allocator_stats().
+//
+// T is the group type of the equivalent SparseIndex, e.g. SparseVector,
+// from which the value, bitmap, allocator and group size are taken.
+template <class T>
+class ConcurrentSparseIndex
+{
+    // Groups are published with a single word atomic bitmap.
+    static_assert(T::SIZE == 64, "groups must be 64 positions wide");
+
+   public:
+    using return_type = typename T::return_type;
+    using value_type = typename T::value_type;
+    using bitmap_type = typename T::bitmap_type;
+    using allocator_type = typename T::allocator_type;
+
+    enum
+    {
+        NUM_STRIPES = 1024,
+        // Lookups between a prefetch and its use in get_batch.
+        PREFETCH_DISTANCE = 16,
+        // Retired payloads a stripe accumulates before trying to free them.
+        COLLECT_THRESHOLD = 64,
+        // Payloads of each size a stripe keeps for reuse, and moves to or
+        // from the allocator at a time.
+        CACHE_BLOCKS = 16,
+        CACHE_BATCH = 8,
+        // Cached sizes, one for each even number of values.
+        CACHE_CLASSES = T::SIZE / 2
+    };
+
+   private:
+    struct Group
+    {
+        std::atomic<bitmap_type> bitmap{0};
+        std::atomic<value_type *> p{nullptr};
+    };
+
+    struct Deallocate
+    {
+        void operator()(value_type *p, std::size_t const size) const
+        {
+            allocator_type::deallocate(p, size);
+        }
+    };
+
+    // Free payloads of one size, linked through their first word.
+    struct Cache
+    {
+        value_type *head = nullptr;
+        std::size_t count = 0;
+    };
+
+    struct alignas(EpochManager::CACHE_LINE) Stripe
+    {
+        std::mutex mutex;
+        // Odd while a writer is updating a group in the stripe.
+        std::atomic<std::uint64_t> seq{0};
+        RetireList<value_type, Deallocate> retired;
+        Cache cache[CACHE_CLASSES];
+    };
+
+    // Frees retired payloads into their stripe's cache.
+    struct Release
+    {
+        Stripe &stripe;
+        void operator()(value_type *p, std::size_t const size) const
+        {
+            release(stripe, p, size);
+        }
+    };
+
+    std::size_t size_;
+    std::vector<Group> groups_;
+    std::vector<Stripe> stripes_;
+    mutable EpochManager epochs_;
+
+   public:
+    explicit ConcurrentSparseIndex(std::size_t const size)
+        : size_(size),
+          groups_((size + T::SIZE - 1) / T::SIZE),
+          stripes_(NUM_STRIPES)
+    {
+    }
+
+    ConcurrentSparseIndex(const ConcurrentSparseIndex &) = delete;
+    ConcurrentSparseIndex &operator=(const ConcurrentSparseIndex &) = delete;
+
+    ~ConcurrentSparseIndex()
+    {
+        for (auto &g : groups_)
+            allocator_type::deallocate(g.p.load(),
+                                       capacity(g.bitmap.load()));
+        for (auto &stripe : stripes_)
+        {
+            stripe.retired.clear();
+            for (std::size_t c = 0; c < CACHE_CLASSES; c++)
+            {
+                auto &cache = stripe.cache[c];
+                while (cache.count)
+                    allocator_type::deallocate(pop(cache), 2 * (c + 1));
+            }
+        }
+    }
+
+    return_type insert(std::size_t const pos, value_type const value)
+    {
+        auto const group = group_for_pos(pos);
+        auto const bit = bit_for_pos(pos);
+        auto &g = groups_[group];
+        auto &stripe = stripe_for_group(group);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto const bitmap = g.bitmap.load(std::memory_order_relaxed);
+        auto const p = g.p.load(std::memory_order_relaxed);
+        auto const count = popcount(bitmap);
+        auto const offset = popcount(bitmap & (bit - 1));
+        auto const exists = (bitmap & bit) != 0;
+        auto const newCount = exists ? count : count + 1;
+        return_type previous{exists ? p[offset] : 0, exists};
+        auto q = allocate(stripe, round_size(newCount));
+        std::copy(p, p + offset, q);
+        q[offset] = value;
+        std::copy(p + offset + exists, p + count, q + offset + 1);
+        publish(stripe, g, bitmap | bit, q);
+        retire(stripe, p, capacity(bitmap));
+        return previous;
+    }
+
+    return_type get(std::size_t const pos) const
+    {
+        auto const group = group_for_pos(pos);
+        auto const bit = bit_for_pos(pos);
+        auto const &g = groups_[group];
+        auto const &stripe = stripe_for_group(group);
+        EpochGuard guard(epochs_);
+        for (;;)
+        {
+            auto const seq = stripe.seq.load(std::memory_order_acquire);
+            if (seq & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            auto const bitmap = g.bitmap.load(std::memory_order_relaxed);
+            auto const p = g.p.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (stripe.seq.load(std::memory_order_relaxed) != seq)
+                continue;
+            // The payload is immutable and pinned by the epoch guard.
+            if (!(bitmap & bit))
+                return return_type{0, false};
+            return return_type{p[popcount(bitmap & (bit - 1))], true};
+        }
+    }
+
+    // Replaces the value at pos with desired if it is currently expected.
+    // Returns true if it was replaced.
+    bool compare_and_set(std::size_t const pos, value_type const expected,
+                         value_type const desired)
+    {
+        auto const group = group_for_pos(pos);
+        auto const bit = bit_for_pos(pos);
+        auto &g = groups_[group];
+        auto &stripe = stripe_for_group(group);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto const bitmap = g.bitmap.load(std::memory_order_relaxed);
+        auto const p = g.p.load(std::memory_order_relaxed);
+        auto const count = popcount(bitmap);
+        auto const offset = popcount(bitmap & (bit - 1));
+        if (!(bitmap & bit) || p[offset] != expected)
+            return false;
+        auto q = allocate(stripe, round_size(count));
+        std::copy(p, p + count, q);
+        q[offset] = desired;
+        publish(stripe, g, bitmap, q);
+        retire(stripe, p, capacity(bitmap));
+        return true;
+    }
+
+    // Looks up count positions, writing one result per position to out.
+    // The group of each position is prefetched PREFETCH_DISTANCE lookups
+    // ahead so that neighbouring cache misses overlap.
+    void get_batch(const std::size_t *positions, std::size_t const count,
+                   return_type *out) const
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            if (i + PREFETCH_DISTANCE < count)
+                __builtin_prefetch(
+                    &groups_[group_for_pos(positions[i + PREFETCH_DISTANCE])]);
+            out[i] = get(positions[i]);
+        }
+    }
+
+    bool has(std::size_t const pos) const
+    {
+        return groups_[group_for_pos(pos)].bitmap.load(
+                   std::memory_order_acquire) &
+               bit_for_pos(pos);
+    }
+
+    // Not linearizable with concurrent writers.
+    std::size_t num_nonempty() const
+    {
+        std::size_t count = 0;
+        for (auto const &g : groups_)
+            count += popcount(g.bitmap.load(std::memory_order_relaxed));
+        return count;
+    }
+
+    void clear()
+    {
+        for (std::size_t i = 0; i < groups_.size(); i++)
+        {
+            auto &g = groups_[i];
+            auto &stripe = stripe_for_group(i);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+            auto const bitmap = g.bitmap.load(std::memory_order_relaxed);
+            if (!bitmap)
+                continue;
+            auto const p = g.p.load(std::memory_order_relaxed);
+            publish(stripe, g, 0, nullptr);
+            retire(stripe, p, capacity(bitmap));
+        }
+    }
+
+    std::size_t size() const { return size_; }
+
+    AllocatorStats allocator_stats() const { return allocator_type::stats(); }
+
+   private:
+    void publish(Stripe &stripe, Group &g, bitmap_type const bitmap,
+                 value_type *p)
+    {
+        auto const seq = stripe.seq.load(std::memory_order_relaxed);
+        stripe.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        g.bitmap.store(bitmap, std::memory_order_relaxed);
+        g.p.store(p, std::memory_order_relaxed);
+        stripe.seq.store(seq + 2, std::memory_order_release);
+    }
+
+    void retire(Stripe &stripe, value_type *p, std::size_t const size)
+    {
+        stripe.retired.retire(epochs_, p, size);
+        if (stripe.retired.size() >= COLLECT_THRESHOLD)
+            stripe.retired.collect(epochs_, Release{stripe});
+    }
+
+    // Payloads too small to hold the cache's link, or larger than a group,
+    // bypass the cache.
+    static bool cacheable(std::size_t const size)
+    {
+        return size <= T::SIZE && size * sizeof(value_type) >= sizeof(void *);
+    }
+
+    // Allocates a payload of size values. Called under the stripe's lock.
+    static value_type *allocate(Stripe &stripe, std::size_t const size)
+    {
+        if (!cacheable(size))
+            return allocator_type::allocate(size);
+        auto &cache = stripe.cache[size / 2 - 1];
+        if (!cache.count)
+        {
+            value_type *batch[CACHE_BATCH];
+            allocator_type::allocate_batch(size, batch, CACHE_BATCH);
+            for (auto const p : batch) push(cache, p);
+        }
+        return pop(cache);
+    }
+
+    // Frees a payload of size values. Called under the stripe's lock.
+    static void release(Stripe &stripe, value_type *p, std::size_t const size)
+    {
+        if (!p)
+            return;
+        if (!cacheable(size))
+        {
+            allocator_type::deallocate(p, size);
+            return;
+        }
+        auto &cache = stripe.cache[size / 2 - 1];
+        if (cache.count == CACHE_BLOCKS)
+        {
+            value_type *batch[CACHE_BATCH];
+            for (auto &q : batch) q = pop(cache);
+            allocator_type::deallocate_batch(batch, size, CACHE_BATCH);
+        }
+        push(cache, p);
+    }
+
+    static void push(Cache &cache, value_type *p)
+    {
+        std::memcpy(p, &cache.head, sizeof(cache.head));
+        cache.head = p;
+        cache.count++;
+    }
+
+    static value_type *pop(Cache &cache)
+    {
+        auto const p = cache.head;
+        std::memcpy(&cache.head, p, sizeof(cache.head));
+        cache.count--;
+        return p;
+    }
+
+    Stripe &stripe_for_group(std::size_t const group)
+    {
+        return stripes_[group % NUM_STRIPES];
+    }
+
+    Stripe const &stripe_for_group(std::size_t const group) const
+    {
+        return stripes_[group % NUM_STRIPES];
+    }
+
+    static std::size_t popcount(bitmap_type const bitmap)
+    {
+        return __builtin_popcountll(bitmap);
+    }
+
+    static std::size_t round_size(std::size_t const size)
+    {
+        return (size % 2 == 0) ? size : size + 1;
+    }
+
+    static std::size_t capacity(bitmap_type const bitmap)
+    {
+        return round_size(popcount(bitmap));
+    }
+
+    std::size_t group_for_pos(std::size_t const pos) const
+    {
+        assert(pos < size_);
+        return pos / T::SIZE;
+    }
+
+    bitmap_type bit_for_pos(std::size_t const pos) const
+    {
+        assert(pos < size_);
+        return bitmap_type(1) << (pos % T::SIZE);
+    }
+};
+}  // namespace sparsedb
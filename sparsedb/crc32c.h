@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <nmmintrin.h>
+
+namespace sparsedb
+{
+namespace detail
+{
+// CRC-32C eight bytes at a time with the slicing-by-8 method, from eight
+// 256 entry tables.
+inline std::uint32_t crc32c_sw(const std::uint8_t *p, std::size_t length,
+                               std::uint32_t crc)
+{
+    struct Tables
+    {
+        std::uint32_t entries[8][256];
+        Tables()
+        {
+            for (std::uint32_t i = 0; i < 256; i++)
+            {
+                auto c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c >> 1) ^ (c & 1 ? 0x82F63B78U : 0);
+                entries[0][i] = c;
+            }
+            for (std::uint32_t i = 0; i < 256; i++)
+            {
+                for (int t = 1; t < 8; t++)
+                    entries[t][i] = (entries[t - 1][i] >> 8) ^
+                                    entries[0][entries[t - 1][i] & 0xFF];
+            }
+        }
+    };
+    static const Tables tables;
+    auto const &t = tables.entries;
+    for (; length >= 8; length -= 8, p += 8)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, p, sizeof(w));
+        w ^= crc;
+        crc = t[7][w & 0xFF] ^ t[6][(w >> 8) & 0xFF] ^
+              t[5][(w >> 16) & 0xFF] ^ t[4][(w >> 24) & 0xFF] ^
+              t[3][(w >> 32) & 0xFF] ^ t[2][(w >> 40) & 0xFF] ^
+              t[1][(w >> 48) & 0xFF] ^ t[0][w >> 56];
+    }
+    for (; length; length--, p++)
+        crc = t[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+// CRC-32C with the SSE4.2 crc32 instruction, eight bytes at a time.
+__attribute__((target("sse4.2"))) inline std::uint32_t crc32c_hw(
+    const std::uint8_t *p, std::size_t length, std::uint32_t crc)
+{
+    std::uint64_t c = crc;
+    for (; length >= 8; length -= 8, p += 8)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = static_cast<std::uint32_t>(c);
+    for (; length; length--, p++) crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+inline bool has_sse42()
+{
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    return sse42;
+}
+}  // namespace detail
+
+// CRC-32C (Castagnoli), as used by iSCSI and ext4, computed with the SSE4.2
+// crc32 instruction where the CPU has it and by slicing-by-8 otherwise.
+// Both are little endian only. Pass the result of a previous call as crc to
+// continue a checksum over several buffers.
+inline std::uint32_t crc32c(const void *data, std::size_t const length,
+                            std::uint32_t const crc = 0)
+{
+    auto p = static_cast<const std::uint8_t *>(data);
+    if (detail::has_sse42())
+        return ~detail::crc32c_hw(p, length, ~crc);
+    return ~detail::crc32c_sw(p, length, ~crc);
+}
+}  // namespace sparsedb
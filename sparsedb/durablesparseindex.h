@@ -0,0 +1,284 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <utility>
+#include "file.h"
+#include "sparseindex.h"
+#include "writeaheadlog.h"
+
+namespace sparsedb
+{
+// A SparseIndex whose mutations survive a crash. The index is stored as a
+// base checkpoint written by SparseIndex::write followed by a chain of up
+// to maxDeltas delta files written by SparseIndex::write_delta, named by
+// appending .1, .2 and so on to the checkpoint filename. Every mutation
+// since the last of them is recorded in a WriteAheadLog. open() reads the
+// base, applies the deltas in order and replays the log on top.
+//
+// Mutations are durable once commit() has written them and the log has
+// synced them, see WriteAheadLog for the syncEvery policy. They show in
+// the index straight away, and are undone again if the log fails to write
+// their batch, so that a checkpoint never holds a mutation the log lost.
+// checkpoint() writes only the groups modified since the previous
+// checkpoint, so that its cost follows the churn rather than the size of
+// the index, and compact() folds the chain into a new base.
+template <class T>
+class DurableSparseIndex
+{
+    static_assert(std::is_integral<typename T::value_type>::value &&
+                      sizeof(typename T::value_type) <= sizeof(std::uint64_t),
+                  "values must be integers of at most 64 bits");
+
+   public:
+    using return_type = typename T::return_type;
+    using value_type = typename T::value_type;
+
+   private:
+    SparseIndex<T> index_;
+    std::string checkpointFile_;
+    WriteAheadLog log_;
+    std::size_t maxDeltas_;
+    // Delta files in the chain.
+    std::size_t deltas_ = 0;
+    // One bit for each group modified since the last checkpoint.
+    std::vector<std::uint64_t> dirty_;
+    // Each position mutated since the last commit and its state before.
+    std::vector<std::pair<std::size_t, return_type>> undo_;
+
+   public:
+    DurableSparseIndex(std::size_t const size,
+                       std::string const &checkpointFile,
+                       std::string const &logFile,
+                       std::size_t const syncEvery = 1,
+                       std::size_t const maxDeltas = 8)
+        : index_(size),
+          checkpointFile_(checkpointFile),
+          log_(logFile, syncEvery),
+          maxDeltas_(maxDeltas),
+          dirty_((size + 64 * T::SIZE - 1) / (64 * T::SIZE))
+    {
+    }
+
+    DurableSparseIndex(const DurableSparseIndex &) = delete;
+    DurableSparseIndex &operator=(const DurableSparseIndex &) = delete;
+
+    // Loads the base checkpoint and the deltas that exist, if any, and
+    // applies the committed batches of the log to them. A compaction cut
+    // short by a crash leaves the newest deltas of the old chain, which
+    // only repeat what the new base holds.
+    std::error_condition open()
+    {
+        File file(checkpointFile_);
+        if (auto err = file.Open())
+            return err;
+        std::uint64_t size;
+        if (auto err = file.Size(size))
+            return err;
+        auto const expected = index_.size();
+        if (size)
+        {
+            if (auto err = index_.read(file))
+                return err;
+            if (index_.size() != expected)
+                return make_error_condition(db_error::corrupt_file);
+        }
+        if (auto err = file.Close())
+            return err;
+        deltas_ = 0;
+        for (std::size_t i = 1; i <= maxDeltas_; i++)
+        {
+            File delta(delta_file(i));
+            if (!delta.Exists())
+                continue;
+            if (auto err = delta.Open())
+                return err;
+            if (auto err = index_.read_delta(delta))
+                return err;
+            if (auto err = delta.Close())
+                return err;
+            deltas_ = i;
+        }
+        std::fill(dirty_.begin(), dirty_.end(), 0);
+        undo_.clear();
+        if (auto err = log_.Open())
+            return err;
+        return log_.Replay(
+            [this](WriteAheadLog::Op const op, std::uint64_t const pos,
+                   std::uint64_t const value)
+            {
+                mark_dirty(pos);
+                if (op == WriteAheadLog::INSERT)
+                    index_.insert(pos, static_cast<value_type>(value));
+                else
+                    index_.erase(pos);
+            });
+    }
+
+    // Commits any pending mutations and closes the log.
+    std::error_condition close()
+    {
+        if (auto err = commit())
+            return err;
+        return log_.Close();
+    }
+
+    return_type insert(std::size_t const pos, const value_type value)
+    {
+        log_.Insert(pos, static_cast<std::uint64_t>(value));
+        mark_dirty(pos);
+        auto const result = index_.insert(pos, value);
+        undo_.emplace_back(pos, result);
+        return result;
+    }
+
+    return_type erase(std::size_t const pos)
+    {
+        log_.Erase(pos);
+        auto result = index_.erase(pos);
+        if (result.second)
+        {
+            mark_dirty(pos);
+            undo_.emplace_back(pos, result);
+        }
+        return result;
+    }
+
+    return_type get(std::size_t const pos) const { return index_.get(pos); }
+    bool has(std::size_t const pos) const { return index_.has(pos); }
+    std::size_t size() const { return index_.size(); }
+    std::size_t num_nonempty() const { return index_.num_nonempty(); }
+
+    // Mutations made since the last commit.
+    std::size_t pending() const { return log_.Pending(); }
+
+    SparseIndex<T> const &index() const { return index_; }
+
+    // Delta files written since the last compaction.
+    std::size_t num_deltas() const { return deltas_; }
+
+    // Groups modified since the last checkpoint.
+    std::size_t dirty_groups() const
+    {
+        std::size_t count = 0;
+        for (auto const w : dirty_) count += bitmap_count(w);
+        return count;
+    }
+
+    // Writes the mutations made since the last commit to the log as one
+    // batch. If the log drops the batch, they are undone in the index.
+    std::error_condition commit()
+    {
+        auto const batches = log_.Batches();
+        auto const err = log_.Commit();
+        if (err && log_.Batches() == batches)
+            undo();
+        undo_.clear();
+        return err;
+    }
+
+    // Makes every committed mutation durable.
+    std::error_condition sync() { return log_.Sync(); }
+
+    // Writes the groups modified since the last checkpoint to the next
+    // delta file and empties the log. Compacts instead once the chain holds
+    // maxDeltas files. A crash before the delta is renamed into place
+    // leaves the full log, and a crash after it replays the log onto the
+    // delta, which is harmless as each record sets an absolute state.
+    std::error_condition checkpoint()
+    {
+        if (deltas_ >= maxDeltas_)
+            return compact();
+        if (auto err = sync_log())
+            return err;
+        std::vector<std::uint64_t> groups;
+        for (std::size_t i = 0; i < dirty_.size(); i++)
+        {
+            for (auto w = dirty_[i]; w; bitmap_clear_first(w))
+                groups.push_back(i * 64 + bitmap_first(w));
+        }
+        File file(delta_file(deltas_ + 1) + ".tmp");
+        if (auto err = file.Open(true))
+            return err;
+        if (auto err = index_.write_delta(file, groups))
+            return err;
+        if (auto err = file.Close())
+            return err;
+        if (auto err = file.Rename(delta_file(deltas_ + 1)))
+            return err;
+        deltas_++;
+        return truncate_log();
+    }
+
+    // Writes the whole index to a new base checkpoint, then deletes the
+    // deltas oldest first and empties the log. Deleting in that order
+    // means that any deltas left by a crash are the newest of the chain,
+    // which open() can apply to the new base without undoing anything.
+    std::error_condition compact()
+    {
+        if (auto err = sync_log())
+            return err;
+        File file(checkpointFile_ + ".tmp");
+        if (auto err = file.Open(true))
+            return err;
+        if (auto err = index_.write(file))
+            return err;
+        if (auto err = file.Close())
+            return err;
+        if (auto err = file.Rename(checkpointFile_))
+            return err;
+        for (std::size_t i = 1; i <= deltas_; i++)
+        {
+            File delta(delta_file(i));
+            if (!delta.Exists())
+                continue;
+            if (auto err = delta.Delete())
+                return err;
+        }
+        deltas_ = 0;
+        return truncate_log();
+    }
+
+   private:
+    std::string delta_file(std::size_t const i) const
+    {
+        return checkpointFile_ + "." + std::to_string(i);
+    }
+
+    void mark_dirty(std::size_t const pos)
+    {
+        auto const group = pos / T::SIZE;
+        dirty_[group / 64] |= 1ULL << (group % 64);
+    }
+
+    // Restores the positions mutated since the last commit, newest first.
+    void undo()
+    {
+        for (auto it = undo_.rbegin(); it != undo_.rend(); ++it)
+        {
+            if (it->second.second)
+                index_.insert(it->first, it->second.first);
+            else
+                index_.erase(it->first);
+        }
+    }
+
+    std::error_condition sync_log()
+    {
+        if (auto err = commit())
+            return err;
+        return log_.Sync();
+    }
+
+    // Called once the checkpoint holds every mutation in the log.
+    std::error_condition truncate_log()
+    {
+        std::fill(dirty_.begin(), dirty_.end(), 0);
+        return log_.Truncate();
+    }
+};
+}  // namespace sparsedb
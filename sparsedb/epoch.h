@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sparsedb
+{
+// Epoch based reclamation. Readers pin the current epoch for the duration of
+// an operation with an EpochGuard. Memory unlinked by a writer is retired
+// with the epoch at which it was unlinked and may only be freed once the
+// global epoch has moved two steps on, at which point no reader can still
+// hold a reference to it.
+class EpochManager
+{
+   public:
+    enum
+    {
+        MAX_SLOTS = 256,
+        CACHE_LINE = 64
+    };
+
+   private:
+    // A slot is 0 when free, otherwise the pinned epoch shifted left by one
+    // with the low bit set.
+    struct alignas(CACHE_LINE) Slot
+    {
+        std::atomic<std::uint64_t> state{0};
+    };
+
+    alignas(CACHE_LINE) std::atomic<std::uint64_t> epoch_{0};
+    Slot slots_[MAX_SLOTS];
+
+   public:
+    EpochManager() = default;
+    EpochManager(const EpochManager &) = delete;
+    EpochManager &operator=(const EpochManager &) = delete;
+
+    std::uint64_t epoch() const { return epoch_.load(); }
+
+    // Claims a free slot and pins the current epoch in it.
+    std::size_t enter()
+    {
+        static thread_local std::size_t const hint =
+            std::hash<std::thread::id>()(std::this_thread::get_id());
+        for (std::size_t i = hint;; i++)
+        {
+            auto &slot = slots_[i % MAX_SLOTS];
+            std::uint64_t expected = 0;
+            if (slot.state.load(std::memory_order_relaxed) == 0 &&
+                slot.state.compare_exchange_strong(expected,
+                                                   (epoch_.load() << 1) | 1))
+                return i % MAX_SLOTS;
+            if (i - hint >= MAX_SLOTS)
+                std::this_thread::yield();
+        }
+    }
+
+    void exit(std::size_t const slot)
+    {
+        slots_[slot].state.store(0, std::memory_order_release);
+    }
+
+    // Advances the global epoch if every pinned slot has observed it.
+    // Returns the resulting epoch.
+    std::uint64_t try_advance()
+    {
+        auto e = epoch_.load();
+        for (auto const &slot : slots_)
+        {
+            auto state = slot.state.load();
+            if (state && (state >> 1) != e)
+                return e;
+        }
+        epoch_.compare_exchange_strong(e, e + 1);
+        return epoch_.load();
+    }
+};
+
+// Pins the current epoch for the lifetime of the guard.
+class EpochGuard
+{
+    EpochManager &manager_;
+    std::size_t slot_;
+
+   public:
+    explicit EpochGuard(EpochManager &manager)
+        : manager_(manager), slot_(manager.enter())
+    {
+    }
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard &operator=(const EpochGuard &) = delete;
+    ~EpochGuard() { manager_.exit(slot_); }
+};
+
+// Memory retired by a single writer, or by writers serialised by a common
+// lock. Deleter is called with each pointer and size once it is safe to
+// free.
+template <class T, class Deleter>
+class RetireList
+{
+    struct Entry
+    {
+        std::uint64_t epoch;
+        T *ptr;
+        std::size_t size;
+    };
+    std::vector<Entry> entries_;
+
+   public:
+    RetireList() = default;
+    RetireList(const RetireList &) = delete;
+    RetireList &operator=(const RetireList &) = delete;
+    ~RetireList() { clear(); }
+
+    std::size_t size() const { return entries_.size(); }
+
+    void retire(EpochManager &manager, T *ptr, std::size_t const size)
+    {
+        if (ptr)
+            entries_.push_back(Entry{manager.epoch(), ptr, size});
+    }
+
+    // Frees every entry retired at least two epochs ago, through free.
+    template <class F = Deleter>
+    void collect(EpochManager &manager, F free = F())
+    {
+        auto const epoch = manager.try_advance();
+        auto keep = entries_.begin();
+        for (auto &e : entries_)
+        {
+            if (e.epoch + 2 <= epoch)
+                free(e.ptr, e.size);
+            else
+                *keep++ = e;
+        }
+        entries_.erase(keep, entries_.end());
+    }
+
+    // Frees everything. Only safe when no readers remain.
+    void clear()
+    {
+        for (auto &e : entries_) Deleter()(e.ptr, e.size);
+        entries_.clear();
+    }
+};
+}  // namespace sparsedb
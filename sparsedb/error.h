@@ -15,6 +15,10 @@ enum db_error
     short_read,
     short_write,
     bad_commit,
+    corrupt_file,
+    index_full,
+    bad_version,
+    log_full,
 };
 
 class db_category : public std::error_category
@@ -41,6 +45,14 @@ class db_category : public std::error_category
             return "Short Write";
         case db_error::bad_commit:
             return "Bad Commit";
+        case db_error::corrupt_file:
+            return "Corrupt File";
+        case db_error::index_full:
+            return "Index Full";
+        case db_error::bad_version:
+            return "Bad Version";
+        case db_error::log_full:
+            return "Log Full";
         default:
             return "Unknown error";
         }
@@ -4,8 +4,10 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <cstddef>
+#include <cstdio>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -37,7 +39,7 @@ std::ostream& operator<<(std::ostream& os, std::vector<T> vec)
 
 class File
 {
-   private:
+   protected:
     std::int32_t fd_ = -1;
     std::string filename_;
 
@@ -69,6 +71,8 @@ class File
         return std::error_condition();
     }
 
+    bool Exists() const { return ::access(filename_.c_str(), F_OK) == 0; }
+
     std::error_condition Delete()
     {
         if (auto err = checkError(::unlink(filename_.c_str())))
@@ -79,9 +83,28 @@ class File
 
     std::error_condition Sync() const { return checkError(::fsync(fd_)); };
 
-    std::error_condition Truncate() const
+    std::error_condition Truncate(std::uint64_t const length = 0) const
+    {
+        return checkError(::ftruncate(fd_, length));
+    }
+
+    // Atomically replaces any file called filename with this one, then
+    // syncs the directory so that the rename survives a crash.
+    std::error_condition Rename(std::string const& filename)
     {
-        return checkError(::ftruncate(fd_, 0));
+        if (auto err =
+                checkError(::rename(filename_.c_str(), filename.c_str())))
+            return err;
+        filename_ = filename;
+        auto const slash = filename_.rfind('/');
+        auto const dir =
+            slash == std::string::npos ? "." : filename_.substr(0, slash + 1);
+        auto const fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (auto err = checkError(fd))
+            return err;
+        auto err = checkError(::fsync(fd));
+        ::close(fd);
+        return err;
     }
 
     template <class T>
@@ -113,6 +136,18 @@ class File
             sumLength(v), db_error::short_read);
     }
 
+    // Reads into at most IOV_MAX vectors starting at pos, leaving the file
+    // offset unchanged.
+    std::error_condition ReadVectorAt(std::uint64_t const pos,
+                                      std::vector<FileVector> const& v) const
+    {
+        if (!v.size())
+            return std::error_condition();
+        auto iov = reinterpret_cast<const iovec*>(v.data());
+        return checkIOError(::preadv(fd_, iov, v.size(), pos), sumLength(v),
+                            db_error::short_read);
+    }
+
     template <class T>
     std::error_condition Write(std::vector<T> const& v) const
     {
@@ -138,7 +173,19 @@ class File
             return std::error_condition();
         return checkIOError(
             ::writev(fd_, reinterpret_cast<const iovec*>(v.data()), v.size()),
-            sumLength(v), db_error::short_read);
+            sumLength(v), db_error::short_write);
+    }
+
+    // Writes at most IOV_MAX vectors starting at pos, leaving the file
+    // offset unchanged.
+    std::error_condition WriteVectorAt(std::uint64_t const pos,
+                                       std::vector<FileVector> const& v) const
+    {
+        if (!v.size())
+            return std::error_condition();
+        auto iov = reinterpret_cast<const iovec*>(v.data());
+        return checkIOError(::pwritev(fd_, iov, v.size(), pos), sumLength(v),
+                            db_error::short_write);
     }
 
     std::error_condition Size(std::uint64_t& size) const
@@ -150,6 +197,24 @@ class File
         return std::error_condition();
     }
 
+    // Maps the first length bytes of the file read-only into memory.
+    std::error_condition Map(std::size_t const length, const void*& data) const
+    {
+        void* mem = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd_, 0);
+        if (mem == MAP_FAILED)
+            return std::generic_category().default_error_condition(errno);
+        data = mem;
+        return std::error_condition();
+    }
+
+    static std::error_condition Unmap(const void* data,
+                                      std::size_t const length)
+    {
+        if (::munmap(const_cast<void*>(data), length) < 0)
+            return std::generic_category().default_error_condition(errno);
+        return std::error_condition();
+    }
+
    private:
     std::error_condition open(std::int32_t const flags)
     {
@@ -171,7 +236,7 @@ class File
         if (ret < 0)
             return std::generic_category().default_error_condition(errno);
         if (ret != expectedLength)
-            make_error_condition(err);
+            return make_error_condition(err);
         return std::error_condition();
     }
 
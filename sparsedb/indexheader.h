@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "crc32c.h"
+#include "error.h"
+
+namespace sparsedb
+{
+// Header of the files written by SparseIndex::write, and read by
+// MappedSparseIndex and IndexMerger. It is followed by the bitmaps of every
+// group, their payloads and then one checksum for each chunk of
+// CHUNK_GROUPS groups. That is the CRC-32C of the CRC-32Cs of the chunk's
+// groups, each taken over the group's bitmap and then its payload.
+// Checksumming a group's bitmap and payload together lets a chunk be
+// checked as soon as its groups are in hand, whether they were read by one
+// thread, by several or as a stream, and checksumming groups separately
+// lets the CPU overlap their CRC computations, which would otherwise form
+// one long dependency chain.
+//
+// With the LZ_BLOCKS flag the header is instead followed by a BlockEntry
+// for each chunk and then the chunks' blocks, and there is no table of
+// checksums at the end.
+//
+// With the GROUP_DIRECTORY flag the plain format is followed by a
+// directory, of the file offset of the payload of the first group of each
+// block of directoryGroups groups and then the CRC-32C of those offsets.
+// The payload of any group can then be found from its directory entry and
+// the bitmaps of the groups before it in its block.
+//
+// With the GROUP_DELTA flag, written by SparseIndex::write_delta, the file
+// holds only some of the index's groups. The header is followed by their
+// number, their group numbers in ascending order and the CRC-32C of the
+// number and the group numbers, then the plain format's bitmaps, payloads
+// and chunk checksums for just those groups.
+struct IndexHeader
+{
+    enum : std::uint32_t
+    {
+        // "SPDX" in a little endian file.
+        MAGIC = 0x58445053
+    };
+
+    enum : std::uint16_t
+    {
+        // The groups are stored as compressed blocks, see BlockEntry.
+        LZ_BLOCKS = 1,
+        // Integer payloads are delta encoded before compression, see
+        // delta_encode.
+        DELTA_VALUES = 2,
+        // A directory of payload offsets follows the checksums.
+        GROUP_DIRECTORY = 4,
+        // The file lists only some groups, to apply on top of an index.
+        GROUP_DELTA = 8
+    };
+
+    enum
+    {
+        VERSION = 1,
+        CHUNK_GROUPS = 4096
+    };
+
+    std::uint32_t magic;
+    std::uint16_t version;
+    std::uint16_t flags;
+    // Bytes in each bitmap, which follows from the group width.
+    std::uint32_t bitmapBytes;
+    std::uint32_t chunkGroups;
+    std::uint64_t size;
+    std::uint64_t groups;
+    // Groups for each directory entry, with GROUP_DIRECTORY.
+    std::uint32_t directoryGroups;
+    // CRC-32C of the fields above.
+    std::uint32_t crc;
+
+    static IndexHeader make(std::uint64_t const size,
+                            std::uint64_t const groups,
+                            std::size_t const bitmapBytes,
+                            std::uint16_t const flags = 0,
+                            std::uint32_t const directoryGroups = 0)
+    {
+        IndexHeader h{MAGIC,
+                      VERSION,
+                      flags,
+                      static_cast<std::uint32_t>(bitmapBytes),
+                      CHUNK_GROUPS,
+                      size,
+                      groups,
+                      directoryGroups,
+                      0};
+        h.crc = h.checksum();
+        return h;
+    }
+
+    // Fails with corrupt_file unless this is an intact header for groups of
+    // bitmapBytes byte bitmaps, and with bad_version if it was written by a
+    // later version or uses flags other than those in knownFlags, which the
+    // reader can handle.
+    std::error_condition check(std::size_t const bitmapBytes,
+                               std::uint16_t const knownFlags = 0) const
+    {
+        if (magic != MAGIC || crc != checksum())
+            return make_error_condition(db_error::corrupt_file);
+        if (version > VERSION || (flags & ~knownFlags))
+            return make_error_condition(db_error::bad_version);
+        if (this->bitmapBytes != bitmapBytes || chunkGroups != CHUNK_GROUPS ||
+            !(flags & GROUP_DIRECTORY) != !directoryGroups)
+            return make_error_condition(db_error::corrupt_file);
+        return std::error_condition();
+    }
+
+    std::uint64_t num_chunks() const { return num_chunks(groups); }
+
+    static std::uint64_t num_chunks(std::uint64_t const groups)
+    {
+        return (groups + CHUNK_GROUPS - 1) / CHUNK_GROUPS;
+    }
+
+    std::uint64_t directory_entries() const
+    {
+        if (!(flags & GROUP_DIRECTORY))
+            return 0;
+        return (groups + directoryGroups - 1) / directoryGroups;
+    }
+
+    // Bytes of the directory and its checksum.
+    std::uint64_t directory_bytes() const
+    {
+        if (!(flags & GROUP_DIRECTORY))
+            return 0;
+        return directory_entries() * sizeof(std::uint64_t) +
+               sizeof(std::uint32_t);
+    }
+
+    static std::uint32_t group_checksum(const void *bitmap,
+                                        std::size_t const bitmapBytes,
+                                        const void *payload,
+                                        std::size_t const payloadBytes)
+    {
+        return crc32c(payload, payloadBytes, crc32c(bitmap, bitmapBytes));
+    }
+
+    // Adds the checksum of the next group to that of its chunk, which
+    // starts at zero.
+    static std::uint32_t add_group(std::uint32_t const chunk,
+                                   std::uint32_t const group)
+    {
+        return crc32c(&group, sizeof(group), chunk);
+    }
+
+    std::uint32_t checksum() const
+    {
+        return crc32c(this, offsetof(IndexHeader, crc));
+    }
+};
+static_assert(sizeof(IndexHeader) == 40, "IndexHeader must not be padded");
+
+// Locates the block of a chunk in a file with the LZ_BLOCKS flag. A block
+// holds the chunk's bitmaps and then its payloads, each compressed with
+// lz_compress unless that would not make them smaller, in which case they
+// are stored as they are. Each block can be read and decompressed on its
+// own.
+struct BlockEntry
+{
+    std::uint64_t offset;
+    // Stored bytes of the bitmaps and of the payloads.
+    std::uint32_t bitmapBytes;
+    std::uint32_t payloadBytes;
+    // Bytes of the payloads before compression, after any delta encoding.
+    std::uint32_t encodedBytes;
+    // Checksum of the chunk's groups, as in the table of the plain format.
+    std::uint32_t crc;
+};
+static_assert(sizeof(BlockEntry) == 24, "BlockEntry must not be padded");
+}  // namespace sparsedb
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "file.h"
+#include "bitmap.h"
+#include "indexheader.h"
+#include "sparseindex.h"
+
+namespace sparsedb
+{
+// Merges index files written by SparseIndex::write into one file in the
+// same format, without loading any of them. Each input is read as three
+// sequential streams, through its bitmaps, its payloads and its checksums,
+// and the output bitmaps and payloads are written the same way, each
+// stream through a buffer of chunkBytes. Memory use is therefore about
+// (3 * inputs + 2) * chunkBytes whatever the size of the files, plus the
+// output checksums at four bytes for each IndexHeader::CHUNK_GROUPS groups.
+// Each chunk of an input is checked against its checksum as it streams
+// past.
+//
+// Positions held by several inputs get the value merge(earlier, later),
+// folded over the inputs in order, so KeepLast gives last writer wins. T
+// must store its values as a plain array, as for SparseIndex::read and
+// write, and every input must have the same size.
+template <class T>
+class IndexMerger
+{
+   public:
+    using value_type = typename T::value_type;
+    using bitmap_type = typename T::bitmap_type;
+
+   private:
+    enum
+    {
+        HEADER = sizeof(IndexHeader)
+    };
+
+    // A section of a file read in order through a buffer.
+    class Reader
+    {
+        File const *file_;
+        std::uint64_t offset_;
+        std::uint64_t end_;
+        std::vector<char> buffer_;
+        std::size_t next_ = 0;
+
+       public:
+        Reader(File const &file, std::uint64_t const offset,
+               std::uint64_t const end, std::size_t const chunkBytes)
+            : file_(&file), offset_(offset), end_(end)
+        {
+            buffer_.reserve(chunkBytes);
+        }
+
+        std::error_condition read(void *data, std::size_t length)
+        {
+            auto out = static_cast<char *>(data);
+            while (length)
+            {
+                if (next_ == buffer_.size())
+                {
+                    if (offset_ == end_)
+                        return make_error_condition(db_error::short_read);
+                    buffer_.resize(std::min<std::uint64_t>(
+                        buffer_.capacity(), end_ - offset_));
+                    if (auto err = file_->ReadAt(offset_, buffer_.data(),
+                                                 buffer_.size()))
+                        return err;
+                    offset_ += buffer_.size();
+                    next_ = 0;
+                }
+                auto const n = std::min(length, buffer_.size() - next_);
+                std::memcpy(out, buffer_.data() + next_, n);
+                next_ += n;
+                out += n;
+                length -= n;
+            }
+            return std::error_condition();
+        }
+    };
+
+    // A section of a file written in order through a buffer.
+    class Writer
+    {
+        File const *file_;
+        std::uint64_t offset_;
+        std::vector<char> buffer_;
+
+       public:
+        Writer(File const &file, std::uint64_t const offset,
+               std::size_t const chunkBytes)
+            : file_(&file), offset_(offset)
+        {
+            buffer_.reserve(chunkBytes);
+        }
+
+        std::error_condition write(const void *data, std::size_t length)
+        {
+            auto in = static_cast<const char *>(data);
+            while (length)
+            {
+                auto const n =
+                    std::min(length, buffer_.capacity() - buffer_.size());
+                buffer_.insert(buffer_.end(), in, in + n);
+                in += n;
+                length -= n;
+                if (buffer_.size() == buffer_.capacity())
+                {
+                    if (auto err = flush())
+                        return err;
+                }
+            }
+            return std::error_condition();
+        }
+
+        std::error_condition flush()
+        {
+            if (buffer_.empty())
+                return std::error_condition();
+            if (auto err = file_->WriteAt(offset_, buffer_.data(),
+                                          buffer_.size()))
+                return err;
+            offset_ += buffer_.size();
+            buffer_.clear();
+            return std::error_condition();
+        }
+
+        // End of the data flushed so far.
+        std::uint64_t offset() const { return offset_; }
+    };
+
+    std::size_t chunkBytes_;
+
+   public:
+    explicit IndexMerger(std::size_t const chunkBytes = 1 << 20)
+        : chunkBytes_(chunkBytes)
+    {
+        assert(chunkBytes > 0);
+    }
+
+    // Writes the merge of the inputs, which must be open, to output, which
+    // must be open and is truncated first. The output is synced before
+    // merge returns, so the inputs can be deleted once it succeeds. Fails
+    // with corrupt_file if the inputs differ in size or a chunk of an input
+    // does not match its checksum.
+    template <class Merge = KeepLast>
+    std::error_condition merge(std::vector<File *> const &inputs,
+                               File &output, Merge merge = Merge()) const
+    {
+        std::size_t size = 0;
+        std::size_t groups = 0;
+        std::vector<Reader> bitmaps;
+        std::vector<Reader> payloads;
+        std::vector<Reader> checksums;
+        for (auto const input : inputs)
+        {
+            IndexHeader header;
+            if (auto err = input->ReadAt(0, &header, sizeof(header)))
+                return err;
+            if (auto err = header.check(sizeof(bitmap_type),
+                                        IndexHeader::GROUP_DIRECTORY))
+                return err;
+            if (!bitmaps.empty() &&
+                (header.size != size || header.groups != groups))
+                return make_error_condition(db_error::corrupt_file);
+            size = header.size;
+            groups = header.groups;
+            std::uint64_t fileSize;
+            if (auto err = input->Size(fileSize))
+                return err;
+            auto const payloadOffset = HEADER + groups * sizeof(bitmap_type);
+            auto const checksumBytes =
+                header.num_chunks() * sizeof(std::uint32_t);
+            auto const trailer = checksumBytes + header.directory_bytes();
+            if (fileSize < payloadOffset + trailer)
+                return make_error_condition(db_error::corrupt_file);
+            auto const payloadEnd = fileSize - trailer;
+            bitmaps.emplace_back(*input, HEADER, payloadOffset, chunkBytes_);
+            payloads.emplace_back(*input, payloadOffset, payloadEnd,
+                                  chunkBytes_);
+            checksums.emplace_back(*input, payloadEnd,
+                                   payloadEnd + checksumBytes, chunkBytes_);
+        }
+        if (auto err = output.Truncate())
+            return err;
+        auto const header =
+            IndexHeader::make(size, groups, sizeof(bitmap_type));
+        if (auto err = output.WriteAt(0, &header, sizeof(header)))
+            return err;
+        Writer bitmapOut(output, HEADER, chunkBytes_);
+        Writer payloadOut(output, HEADER + groups * sizeof(bitmap_type),
+                          chunkBytes_);
+        // The group's values by position, valid where merged is set.
+        value_type dense[T::SIZE];
+        value_type values[T::SIZE];
+        // Checksums of the current chunk of each input and of the output.
+        std::vector<std::uint32_t> crcs(inputs.size());
+        std::uint32_t crc = 0;
+        std::vector<std::uint32_t> outputChecksums;
+        outputChecksums.reserve(header.num_chunks());
+        for (std::size_t g = 0; g < groups; g++)
+        {
+            auto const chunkEnd = (g + 1) % IndexHeader::CHUNK_GROUPS == 0 ||
+                                  g + 1 == groups;
+            auto merged = bitmap_type();
+            for (std::size_t i = 0; i < inputs.size(); i++)
+            {
+                bitmap_type bits;
+                if (auto err = bitmaps[i].read(&bits, sizeof(bits)))
+                    return err;
+                auto const count = bitmap_count(bits);
+                if (auto err = payloads[i].read(values,
+                                                count * sizeof(value_type)))
+                    return err;
+                crcs[i] = IndexHeader::add_group(
+                    crcs[i],
+                    IndexHeader::group_checksum(&bits, sizeof(bits), values,
+                                                count * sizeof(value_type)));
+                if (chunkEnd)
+                {
+                    std::uint32_t expected;
+                    if (auto err = checksums[i].read(&expected,
+                                                     sizeof(expected)))
+                        return err;
+                    if (crcs[i] != expected)
+                        return make_error_condition(db_error::corrupt_file);
+                    crcs[i] = 0;
+                }
+                std::size_t k = 0;
+                for (; bitmap_any(bits); bitmap_clear_first(bits))
+                {
+                    auto const pos = bitmap_first(bits);
+                    dense[pos] = bitmap_test(merged, pos)
+                                     ? merge(dense[pos], values[k])
+                                     : values[k];
+                    bitmap_set(merged, pos);
+                    k++;
+                }
+            }
+            if (auto err = bitmapOut.write(&merged, sizeof(merged)))
+                return err;
+            std::size_t k = 0;
+            for (auto bits = merged; bitmap_any(bits);
+                 bitmap_clear_first(bits))
+                values[k++] = dense[bitmap_first(bits)];
+            if (auto err = payloadOut.write(values, k * sizeof(value_type)))
+                return err;
+            crc = IndexHeader::add_group(
+                crc, IndexHeader::group_checksum(&merged, sizeof(merged),
+                                                 values,
+                                                 k * sizeof(value_type)));
+            if (chunkEnd)
+            {
+                outputChecksums.push_back(crc);
+                crc = 0;
+            }
+        }
+        if (auto err = bitmapOut.flush())
+            return err;
+        if (auto err = payloadOut.flush())
+            return err;
+        if (auto err = output.WriteAt(
+                payloadOut.offset(), outputChecksums.data(),
+                outputChecksums.size() * sizeof(std::uint32_t)))
+            return err;
+        return output.Sync();
+    }
+};
+}  // namespace sparsedb
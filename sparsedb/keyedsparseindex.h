@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include "sparseindex.h"
+#include "sparsevector.h"
+
+namespace sparsedb
+{
+// Accepts every candidate, for callers that treat a fingerprint match as a
+// key match.
+struct AnyMatch
+{
+    bool operator()(std::uint64_t) const { return true; }
+};
+
+// Maps fixed length keys, such as hashes, onto a SparseIndex used as an
+// open addressing hash table, in place of a separate hash map in front of
+// it. The first prefixBits bits of a key give its home position and the
+// next FINGERPRINT_BITS bits a fingerprint. Each entry packs the
+// fingerprint and its distance from home above the value. A key that finds
+// its home taken goes to the next free position, so that probes walk
+// neighbouring positions within the same group.
+//
+// Keys must be uniformly distributed in their first bytes, so hash other
+// keys first. Keys that agree on prefix and fingerprint are told apart by
+// the match function taken by get, insert and erase, which is called with
+// each candidate value and should check it against the full key, for
+// example one stored with the value. Without it, two such keys share an
+// entry, which for a given key happens with probability of about the
+// probe length over 2^FINGERPRINT_BITS.
+template <class T = SparseVector<std::uint64_t>>
+class KeyedSparseIndex
+{
+    static_assert(std::is_same<typename T::value_type, std::uint64_t>::value,
+                  "entries are 64 bit words");
+
+   public:
+    using return_type = std::pair<std::uint64_t, bool>;
+
+    enum
+    {
+        FINGERPRINT_BITS = 16,
+        DISTANCE_BITS = 8,
+        VALUE_BITS = 64 - FINGERPRINT_BITS - DISTANCE_BITS,
+        // Furthest a key may be placed from its home position.
+        MAX_DISTANCE = (1 << DISTANCE_BITS) - 1,
+        // Bytes of the key read for the prefix and the fingerprint.
+        KEY_BYTES = 8
+    };
+
+    static constexpr std::uint64_t MAX_VALUE = (1ULL << VALUE_BITS) - 1;
+
+   private:
+    SparseIndex<T> index_;
+    std::size_t keyLength_;
+    std::size_t prefixBits_;
+    std::size_t maxDistance_ = 0;
+
+   public:
+    KeyedSparseIndex(std::size_t const prefixBits,
+                     std::size_t const keyLength)
+        : index_(std::size_t(1) << prefixBits),
+          keyLength_(keyLength),
+          prefixBits_(prefixBits)
+    {
+        assert(prefixBits > 0 && prefixBits + FINGERPRINT_BITS <= 64);
+        assert(keyLength >= KEY_BYTES);
+    }
+
+    std::size_t size() const { return index_.size(); }
+    std::size_t num_nonempty() const { return index_.num_nonempty(); }
+
+    // Longest distance from home of any key inserted so far.
+    std::size_t max_distance() const { return maxDistance_; }
+
+    SparseIndex<T> const &index() const { return index_; }
+
+    template <class Match = AnyMatch>
+    return_type get(std::string const &key, Match match = Match()) const
+    {
+        assert(key.size() == keyLength_);
+        std::size_t pos;
+        if (!find(key, match, pos))
+            return return_type{0, false};
+        return return_type{index_.get(pos).first & MAX_VALUE, true};
+    }
+
+    // Sets the value of key. Sets previous to the value it replaced and
+    // true if it had one. Fails with index_full if no position is free
+    // within MAX_DISTANCE of the key's home.
+    template <class Match = AnyMatch>
+    std::error_condition insert(std::string const &key,
+                                std::uint64_t const value,
+                                return_type &previous,
+                                Match match = Match())
+    {
+        if (key.size() != keyLength_)
+            return make_error_condition(db_error::key_wrong_length);
+        if (value > MAX_VALUE)
+            return make_error_condition(db_error::value_too_long);
+        std::size_t pos;
+        if (find(key, match, pos))
+        {
+            auto const old = index_.get(pos).first;
+            index_.insert(pos, (old & ~MAX_VALUE) | value);
+            previous = return_type{old & MAX_VALUE, true};
+            return std::error_condition();
+        }
+        auto const home = home_of(key);
+        std::size_t distance = 0;
+        for (; index_.has(slot(home, distance)); distance++)
+        {
+            if (distance == MAX_DISTANCE ||
+                distance + 1 == index_.size())
+                return make_error_condition(db_error::index_full);
+        }
+        index_.insert(slot(home, distance),
+                      entry(fingerprint_of(key), distance, value));
+        maxDistance_ = std::max(maxDistance_, distance);
+        previous = return_type{0, false};
+        return std::error_condition();
+    }
+
+    // Removes key. Returns its value and true if it was present. Keys up to
+    // the next empty position whose probe passed through the freed position
+    // are moved back into it, so that no probe has to pass an empty
+    // position.
+    template <class Match = AnyMatch>
+    return_type erase(std::string const &key, Match match = Match())
+    {
+        assert(key.size() == keyLength_);
+        std::size_t pos;
+        if (!find(key, match, pos))
+            return return_type{0, false};
+        auto const old = index_.erase(pos).first;
+        for (auto next = advance(pos); index_.has(next);
+             next = advance(next))
+        {
+            auto const e = index_.get(next).first;
+            auto const gap = slot(next - pos, 0);
+            // Keys whose home lies after the free position stay put.
+            if (distance_of(e) < gap)
+                continue;
+            index_.erase(next);
+            index_.insert(pos, e - (std::uint64_t(gap) << VALUE_BITS));
+            pos = next;
+        }
+        return return_type{old & MAX_VALUE, true};
+    }
+
+   private:
+    // Finds the position of key, walking from its home until an empty
+    // position. Candidates must have the key's fingerprint, be at the
+    // key's distance from home and satisfy match.
+    template <class Match>
+    bool find(std::string const &key, Match &match, std::size_t &pos) const
+    {
+        auto const home = home_of(key);
+        auto const fingerprint = fingerprint_of(key);
+        for (std::size_t distance = 0; distance <= maxDistance_; distance++)
+        {
+            pos = slot(home, distance);
+            auto const e = index_.get(pos);
+            if (!e.second)
+                return false;
+            if (distance_of(e.first) == distance &&
+                (e.first >> (64 - FINGERPRINT_BITS)) == fingerprint &&
+                match(e.first & MAX_VALUE))
+                return true;
+        }
+        return false;
+    }
+
+    // The first KEY_BYTES bytes of key as a big endian integer.
+    static std::uint64_t prefix(std::string const &key)
+    {
+        std::uint64_t k = 0;
+        for (std::size_t i = 0; i < KEY_BYTES; i++)
+            k = (k << 8) | static_cast<std::uint8_t>(key[i]);
+        return k;
+    }
+
+    std::size_t home_of(std::string const &key) const
+    {
+        return prefix(key) >> (64 - prefixBits_);
+    }
+
+    std::uint64_t fingerprint_of(std::string const &key) const
+    {
+        return (prefix(key) >> (64 - prefixBits_ - FINGERPRINT_BITS)) &
+               ((1ULL << FINGERPRINT_BITS) - 1);
+    }
+
+    std::size_t slot(std::size_t const home, std::size_t const distance) const
+    {
+        return (home + distance) & (index_.size() - 1);
+    }
+
+    std::size_t advance(std::size_t const pos) const { return slot(pos, 1); }
+
+    static std::size_t distance_of(std::uint64_t const e)
+    {
+        return (e >> VALUE_BITS) & MAX_DISTANCE;
+    }
+
+    static std::uint64_t entry(std::uint64_t const fingerprint,
+                               std::size_t const distance,
+                               std::uint64_t const value)
+    {
+        return (fingerprint << (64 - FINGERPRINT_BITS)) |
+               (std::uint64_t(distance) << VALUE_BITS) | value;
+    }
+};
+
+template <class T>
+constexpr std::uint64_t KeyedSparseIndex<T>::MAX_VALUE;
+}  // namespace sparsedb
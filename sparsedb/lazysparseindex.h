@@ -0,0 +1,243 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "file.h"
+#include "bitmap.h"
+#include "crc32c.h"
+#include "indexheader.h"
+
+namespace sparsedb
+{
+// Counters for the group cache of a LazySparseIndex.
+struct LazyStats
+{
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t evictions = 0;
+    std::size_t reads = 0;
+};
+
+// Read-only view of a file written by SparseIndex::write_with_directory
+// that answers lookups without loading the file. open() reads only the
+// header and the directory. A lookup then reads the bitmaps from the start
+// of its group's directory block up to the group, which give the payload
+// offset, and then the value, so that a cold lookup takes at most two
+// small ReadAt calls and one of an empty position takes one.
+//
+// With cacheGroups > 0 the whole payload of each group looked up is read
+// instead of the one value, and up to cacheGroups groups are kept, chosen
+// for eviction by the CLOCK algorithm, so that lookups of hot groups need
+// no reads at all. Lookups do not check the chunk checksums, which cover
+// whole chunks, but open() checks those of the header and the directory.
+//
+// Not thread safe. T must store its values as a plain array, as for
+// SparseIndex::read and write.
+template <class T>
+class LazySparseIndex
+{
+   public:
+    using return_type = typename T::return_type;
+    using value_type = typename T::value_type;
+    using bitmap_type = typename T::bitmap_type;
+
+   private:
+    struct Frame
+    {
+        std::size_t group = NO_GROUP;
+        bool referenced = false;
+        T values;
+    };
+
+    static constexpr std::size_t NO_GROUP = ~std::size_t(0);
+
+    File const *file_ = nullptr;
+    IndexHeader header_ = IndexHeader();
+    std::vector<std::uint64_t> directory_;
+    std::vector<bitmap_type> bitmaps_;
+    // The frame holding each cached group.
+    std::unordered_map<std::size_t, std::size_t> frameOf_;
+    std::vector<Frame> frames_;
+    std::size_t hand_ = 0;
+    LazyStats stats_;
+
+   public:
+    explicit LazySparseIndex(std::size_t const cacheGroups = 0)
+        : frames_(cacheGroups)
+    {
+    }
+
+    LazySparseIndex(const LazySparseIndex &) = delete;
+    LazySparseIndex &operator=(const LazySparseIndex &) = delete;
+
+    // Opens an index written to file, which must be open and outlive the
+    // index or the next open, by SparseIndex::write_with_directory. Fails
+    // with bad_version if the file has no directory.
+    std::error_condition open(File const &file)
+    {
+        close();
+        if (auto err = file.ReadAt(0, &header_, sizeof(header_)))
+            return err;
+        if (auto err = header_.check(sizeof(bitmap_type),
+                                     IndexHeader::GROUP_DIRECTORY))
+            return err;
+        if (!(header_.flags & IndexHeader::GROUP_DIRECTORY))
+            return make_error_condition(db_error::bad_version);
+        std::uint64_t length;
+        if (auto err = file.Size(length))
+            return err;
+        auto const bytes = header_.directory_bytes();
+        if (length < payload_offset() + bytes)
+            return make_error_condition(db_error::corrupt_file);
+        directory_.resize(header_.directory_entries());
+        auto const at = length - bytes;
+        std::uint32_t crc;
+        if (auto err = file.ReadAt(at, directory_.data(),
+                                   directory_.size() * sizeof(std::uint64_t)))
+            return err;
+        if (auto err = file.ReadAt(length - sizeof(crc), &crc, sizeof(crc)))
+            return err;
+        // The offsets must ascend through the payloads, which end before
+        // the chunk checksums.
+        auto const end = at - header_.num_chunks() * sizeof(std::uint32_t);
+        if (crc != crc32c(directory_.data(),
+                          directory_.size() * sizeof(std::uint64_t)) ||
+            (!directory_.empty() && directory_.front() != payload_offset()) ||
+            !std::is_sorted(directory_.begin(), directory_.end()) ||
+            (!directory_.empty() && directory_.back() > end))
+        {
+            directory_.clear();
+            return make_error_condition(db_error::corrupt_file);
+        }
+        bitmaps_.resize(header_.directoryGroups);
+        file_ = &file;
+        return std::error_condition();
+    }
+
+    void close()
+    {
+        file_ = nullptr;
+        header_ = IndexHeader();
+        directory_.clear();
+        frameOf_.clear();
+        for (auto &f : frames_) evict(f);
+        hand_ = 0;
+        stats_ = LazyStats();
+    }
+
+    std::size_t size() const { return header_.size; }
+    LazyStats const &stats() const { return stats_; }
+
+    // Sets result to the value and true if pos is occupied, otherwise to 0
+    // and false.
+    std::error_condition get(std::size_t const pos, return_type &result)
+    {
+        assert(file_ && pos < size());
+        auto const group = pos / T::SIZE;
+        auto const bit = pos % T::SIZE;
+        auto const cached = frameOf_.find(group);
+        if (cached != frameOf_.end())
+        {
+            stats_.hits++;
+            auto &f = frames_[cached->second];
+            f.referenced = true;
+            result = f.values.get(bit);
+            return std::error_condition();
+        }
+        stats_.misses++;
+        auto const block = group / header_.directoryGroups;
+        auto const first = block * header_.directoryGroups;
+        auto const count = group - first + 1;
+        if (auto err = file_->ReadAt(
+                sizeof(IndexHeader) + first * sizeof(bitmap_type),
+                bitmaps_.data(), count * sizeof(bitmap_type)))
+            return err;
+        stats_.reads++;
+        auto offset = directory_[block];
+        for (std::size_t i = 0; i + 1 < count; i++)
+            offset += bitmap_count(bitmaps_[i]) * sizeof(value_type);
+        auto const &bitmap = bitmaps_[count - 1];
+        if (!frames_.empty())
+            return read_group(group, bitmap, offset, bit, result);
+        result = return_type{0, false};
+        if (!bitmap_test(bitmap, bit))
+            return std::error_condition();
+        offset += bitmap_rank(bitmap, bit) * sizeof(value_type);
+        if (auto err = file_->ReadAt(offset, &result.first, sizeof(value_type)))
+            return err;
+        stats_.reads++;
+        result.second = true;
+        return std::error_condition();
+    }
+
+   private:
+    std::uint64_t payload_offset() const
+    {
+        return sizeof(IndexHeader) + header_.groups * sizeof(bitmap_type);
+    }
+
+    // Reads the payload of the group at offset into a frame and looks up
+    // bit in it.
+    std::error_condition read_group(std::size_t const group,
+                                    bitmap_type const &bitmap,
+                                    std::uint64_t const offset,
+                                    std::size_t const bit, return_type &result)
+    {
+        auto const i = victim();
+        auto &f = frames_[i];
+        if (f.group != NO_GROUP)
+        {
+            stats_.evictions++;
+            evict(f);
+        }
+        f.values.reset(bitmap);
+        if (f.values.size())
+        {
+            if (auto err = file_->ReadAt(offset, f.values.ptr(),
+                                         f.values.size()))
+            {
+                f.values.clear();
+                return err;
+            }
+            stats_.reads++;
+        }
+        f.group = group;
+        f.referenced = true;
+        frameOf_[group] = i;
+        result = f.values.get(bit);
+        return std::error_condition();
+    }
+
+    // Advances the clock hand past referenced frames, clearing their bit,
+    // to the first frame that is free or was not used since the last pass.
+    std::size_t victim()
+    {
+        for (;;)
+        {
+            auto &f = frames_[hand_];
+            auto const i = hand_;
+            hand_ = (hand_ + 1) % frames_.size();
+            if (f.group == NO_GROUP || !f.referenced)
+                return i;
+            f.referenced = false;
+        }
+    }
+
+    void evict(Frame &f)
+    {
+        if (f.group == NO_GROUP)
+            return;
+        f.values.clear();
+        frameOf_.erase(f.group);
+        f.group = NO_GROUP;
+        f.referenced = false;
+    }
+};
+
+template <class T>
+constexpr std::size_t LazySparseIndex<T>::NO_GROUP;
+}  // namespace sparsedb
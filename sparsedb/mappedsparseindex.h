@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include "file.h"
+#include "bitmap.h"
+#include "indexheader.h"
+
+namespace sparsedb
+{
+// Read-only view of a file produced by SparseIndex::write. The file is
+// mapped into memory and lookups are served directly from the mapping, so
+// opening only costs one popcount per group to build the payload offsets.
+// open() checks the header but not the chunk checksums, which would touch
+// every page, see verify().
+template <class T>
+class MappedSparseIndex
+{
+   public:
+    using return_type = typename T::return_type;
+    using value_type = typename T::value_type;
+    using bitmap_type = typename T::bitmap_type;
+
+   private:
+    const void *data_ = nullptr;
+    std::size_t length_ = 0;
+    std::size_t size_ = 0;
+    std::size_t groupSize_ = 0;
+    const bitmap_type *bitmaps_ = nullptr;
+    const value_type *values_ = nullptr;
+    const std::uint32_t *checksums_ = nullptr;
+    // Index into values_ of the first value of each group.
+    std::vector<std::uint64_t> offsets_;
+
+   public:
+    MappedSparseIndex() = default;
+    MappedSparseIndex(const MappedSparseIndex &) = delete;
+    MappedSparseIndex &operator=(const MappedSparseIndex &) = delete;
+
+    ~MappedSparseIndex() { close(); }
+
+    std::error_condition open(File const &file)
+    {
+        close();
+        std::uint64_t length;
+        if (auto err = file.Size(length))
+            return err;
+        const std::size_t header = sizeof(IndexHeader);
+        if (length < header)
+            return make_error_condition(db_error::short_read);
+        if (auto err = file.Map(length, data_))
+            return err;
+        length_ = length;
+        auto base = static_cast<const char *>(data_);
+        IndexHeader h;
+        std::memcpy(&h, base, sizeof(h));
+        if (auto err = h.check(sizeof(bitmap_type),
+                               IndexHeader::GROUP_DIRECTORY))
+            return err;
+        size_ = h.size;
+        groupSize_ = h.groups;
+        if (length < header + groupSize_ * sizeof(bitmap_type))
+            return make_error_condition(db_error::short_read);
+        bitmaps_ = reinterpret_cast<const bitmap_type *>(base + header);
+        values_ = reinterpret_cast<const value_type *>(bitmaps_ + groupSize_);
+        offsets_.resize(groupSize_);
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < groupSize_; i++)
+        {
+            offsets_[i] = total;
+            total += bitmap_count(bitmaps_[i]);
+        }
+        auto const end = header + groupSize_ * sizeof(bitmap_type) +
+                         total * sizeof(value_type);
+        if (length < end + h.num_chunks() * sizeof(std::uint32_t))
+            return make_error_condition(db_error::short_read);
+        checksums_ = reinterpret_cast<const std::uint32_t *>(base + end);
+        return std::error_condition();
+    }
+
+    // Fails with corrupt_file if any chunk of groups does not match its
+    // checksum.
+    std::error_condition verify() const
+    {
+        for (std::size_t c = 0; c < IndexHeader::num_chunks(groupSize_); c++)
+        {
+            auto const first = c * IndexHeader::CHUNK_GROUPS;
+            auto const last = std::min<std::size_t>(
+                first + IndexHeader::CHUNK_GROUPS, groupSize_);
+            std::uint32_t crc = 0;
+            for (auto i = first; i < last; i++)
+            {
+                crc = IndexHeader::add_group(
+                    crc, IndexHeader::group_checksum(
+                             &bitmaps_[i], sizeof(bitmap_type),
+                             values_ + offsets_[i],
+                             bitmap_count(bitmaps_[i]) * sizeof(value_type)));
+            }
+            if (crc != checksums_[c])
+                return make_error_condition(db_error::corrupt_file);
+        }
+        return std::error_condition();
+    }
+
+    std::error_condition close()
+    {
+        offsets_.clear();
+        offsets_.shrink_to_fit();
+        bitmaps_ = nullptr;
+        values_ = nullptr;
+        checksums_ = nullptr;
+        size_ = groupSize_ = 0;
+        if (!data_)
+            return std::error_condition();
+        auto err = File::Unmap(data_, length_);
+        data_ = nullptr;
+        length_ = 0;
+        return err;
+    }
+
+    bool has(std::size_t const pos) const
+    {
+        return bitmap_test(bitmaps_[group_for_pos(pos)], pos_in_group(pos));
+    }
+
+    return_type get(std::size_t const pos) const
+    {
+        auto const group = group_for_pos(pos);
+        auto const &bitmap = bitmaps_[group];
+        auto const bit = pos_in_group(pos);
+        if (!bitmap_test(bitmap, bit))
+            return return_type{0, false};
+        auto offset = offsets_[group] + bitmap_rank(bitmap, bit);
+        return return_type{values_[offset], true};
+    }
+
+    std::size_t num_nonempty() const
+    {
+        if (!groupSize_)
+            return 0;
+        return offsets_.back() + bitmap_count(bitmaps_[groupSize_ - 1]);
+    }
+
+    std::size_t size() const { return size_; }
+
+   private:
+    std::size_t group_for_pos(std::size_t const pos) const
+    {
+        assert(pos < size_);
+        return pos / T::SIZE;
+    }
+
+    std::size_t pos_in_group(std::size_t const pos) const
+    {
+        assert(pos < size_);
+        return pos % T::SIZE;
+    }
+};
+}  // namespace sparsedb
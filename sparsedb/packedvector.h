@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cstddef>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include "allocator.h"
+#include "bitmap.h"
+
+namespace sparsedb
+{
+// A group type for SparseIndex that stores its values frame of reference
+// encoded: each value is kept as its difference from the smallest value in
+// the group, bit packed at the width of the largest difference. Suits
+// values that are close together within a group, such as offsets that grow
+// with the position. A single value is decoded in constant time, while
+// insert and erase re-pack the whole group.
+//
+// The payload is one allocation of 64 bit words holding the base, the bit
+// width and then the packed differences.
+template <class T, std::size_t N = 64,
+          class Allocator = SlabAllocator<std::uint64_t, N + 2>>
+class PackedVector
+{
+    static_assert(std::is_integral<T>::value, "T must be an integer type");
+    static_assert(sizeof(T) <= sizeof(std::uint64_t),
+                  "T must fit in 64 bits");
+
+   public:
+    using return_type = std::pair<T, bool>;
+    using bitmap_type = typename BitmapFor<N>::type;
+    using value_type = T;
+    using allocator_type = Allocator;
+
+    enum
+    {
+        SIZE = N,
+        MAX_POS = SIZE - 1,
+        // Words ahead of the packed values, the base and the bit width.
+        HEADER_WORDS = 2
+    };
+
+    // Read access to the values in ascending order of position, indexed by
+    // offset among the occupied positions.
+    class values_type
+    {
+        const std::uint64_t *p_ = nullptr;
+
+       public:
+        values_type() = default;
+        explicit values_type(const std::uint64_t *p) : p_(p) {}
+
+        T operator[](std::size_t const offset) const
+        {
+            auto const width = p_[1];
+            if (!width)
+                return static_cast<T>(p_[0]);
+            auto const bit = offset * width;
+            auto const data = p_ + HEADER_WORDS + bit / 64;
+            auto const shift = bit % 64;
+            auto delta = data[0] >> shift;
+            if (shift + width > 64)
+                delta |= data[1] << (64 - shift);
+            if (width < 64)
+                delta &= (1ULL << width) - 1ULL;
+            return static_cast<T>(p_[0] + delta);
+        }
+    };
+
+   private:
+    bitmap_type bitmap_ = bitmap_type();
+    std::uint64_t *p_ = nullptr;
+
+   public:
+    PackedVector() = default;
+
+    // Shallow, as for SparseVector, so that groups can be held by value in
+    // a std::vector.
+    PackedVector(const PackedVector &pv)
+    {
+        bitmap_ = pv.bitmap_;
+        p_ = pv.p_;
+    }
+
+    PackedVector &operator=(const PackedVector &) = delete;
+
+    ~PackedVector()
+    {
+        Allocator::deallocate(p_, words());
+        p_ = nullptr;
+    }
+
+    std::size_t max_size() const { return SIZE; }
+    std::size_t num_nonempty() const { return bitmap_count(bitmap_); }
+    bitmap_type const &bitmap() const { return bitmap_; }
+    values_type values() const { return values_type(p_); }
+
+    // Bytes held by the payload, including its header.
+    std::size_t size() const { return words() * sizeof(std::uint64_t); }
+
+    // Bits stored for each value.
+    std::size_t width() const { return p_ ? p_[1] : 0; }
+
+    void clear() { assign(bitmap_type(), nullptr); }
+
+    // Replaces the contents with the values for the positions set in
+    // bitmap, in ascending order of position.
+    void assign(bitmap_type const &bitmap, T const *values)
+    {
+        auto const oldWords = words();
+        auto const count = bitmap_count(bitmap);
+        bitmap_ = bitmap;
+        if (!count)
+        {
+            Allocator::deallocate(p_, oldWords);
+            p_ = nullptr;
+            return;
+        }
+        auto const range = std::minmax_element(values, values + count);
+        auto const base = static_cast<std::uint64_t>(*range.first);
+        auto const span = static_cast<std::uint64_t>(*range.second) - base;
+        std::size_t const width = span ? 64 - __builtin_clzll(span) : 0;
+        auto const newWords = block_words(count, width);
+        if (newWords != oldWords)
+        {
+            Allocator::deallocate(p_, oldWords);
+            p_ = Allocator::allocate(newWords);
+        }
+        p_[0] = base;
+        p_[1] = width;
+        auto const data = p_ + HEADER_WORDS;
+        std::fill(data, p_ + newWords, 0);
+        if (!width)
+            return;
+        for (std::size_t i = 0; i < count; i++)
+        {
+            auto const delta = static_cast<std::uint64_t>(values[i]) - base;
+            auto const bit = i * width;
+            auto const shift = bit % 64;
+            data[bit / 64] |= delta << shift;
+            if (shift + width > 64)
+                data[bit / 64 + 1] |= delta >> (64 - shift);
+        }
+    }
+
+    // Forgets the payload without freeing it, leaving the group empty. For
+    // when the payload has been handed to a shallow copy of the group.
+    void release()
+    {
+        bitmap_ = bitmap_type();
+        p_ = nullptr;
+    }
+
+    bool has(std::size_t const pos) const
+    {
+        assert(pos <= MAX_POS);
+        return bitmap_test(bitmap_, pos);
+    }
+
+    // Inserts a new value at pos. Return the previous value and true if one
+    // exists. Position must be less than SIZE.
+    return_type insert(std::size_t const pos, T const value)
+    {
+        assert(pos <= MAX_POS);
+        T values[SIZE];
+        auto const count = unpack(values);
+        auto const offset = get_offset(pos);
+        auto const exists = has(pos);
+        T const previous = exists ? values[offset] : 0;
+        if (exists && previous == value)
+            return return_type{previous, true};
+        if (!exists)
+            std::copy_backward(values + offset, values + count,
+                               values + count + 1);
+        values[offset] = value;
+        auto bitmap = bitmap_;
+        bitmap_set(bitmap, pos);
+        assign(bitmap, values);
+        return return_type{previous, exists};
+    }
+
+    // Removes the value at pos. Return the previous value and true if one
+    // existed. Position must be less than SIZE.
+    return_type erase(std::size_t const pos)
+    {
+        assert(pos <= MAX_POS);
+        if (!has(pos))
+            return return_type{0, false};
+        auto const offset = get_offset(pos);
+        T const previous = this->values()[offset];
+        T values[SIZE];
+        auto const count = unpack(values);
+        std::copy(values + offset + 1, values + count, values + offset);
+        auto bitmap = bitmap_;
+        bitmap_reset(bitmap, pos);
+        assign(bitmap, values);
+        return return_type{previous, true};
+    }
+
+    // Hints the cache to load the payload header, if pos is occupied.
+    void prefetch(std::size_t const pos) const
+    {
+        assert(pos <= MAX_POS);
+        if (has(pos))
+            __builtin_prefetch(p_);
+    }
+
+    // If pos is occupied return value and true, otherwise return 0 and
+    // false. Position must be less than SIZE.
+    return_type get(std::size_t const pos) const
+    {
+        assert(pos <= MAX_POS);
+        if (has(pos))
+            return return_type{values()[get_offset(pos)], true};
+        return return_type{0, false};
+    }
+
+    // The encoding only depends on the values, so equal groups have equal
+    // payloads.
+    bool operator==(PackedVector const &rhs) const
+    {
+        return bitmap_ == rhs.bitmap_ && size() == rhs.size() &&
+               std::memcmp(p_, rhs.p_, size()) == 0;
+    }
+
+    std::string to_string() const
+    {
+        std::stringstream ss;
+        ss << std::setw(2) << num_nonempty() << "/" << std::setw(2) << size()
+           << " @" << std::setw(2) << width() << " : [";
+        for (std::size_t i = 0; i <= MAX_POS; i++)
+        {
+            if (has(i))
+                ss << std::to_string(values()[get_offset(i)]);
+            else
+                ss << "-";
+            if (i < MAX_POS)
+                ss << ",";
+        }
+        ss << "]";
+        return ss.str();
+    }
+
+   private:
+    // Decodes every value into values and returns how many there are.
+    std::size_t unpack(T *values) const
+    {
+        auto const count = num_nonempty();
+        auto const v = this->values();
+        for (std::size_t i = 0; i < count; i++) values[i] = v[i];
+        return count;
+    }
+
+    std::size_t words() const
+    {
+        return p_ ? block_words(num_nonempty(), p_[1]) : 0;
+    }
+
+    // Allocation size for count values of width bits, rounded up to an even
+    // number of words for the slab allocator.
+    static std::size_t block_words(std::size_t const count,
+                                   std::size_t const width)
+    {
+        auto const words = HEADER_WORDS + (count * width + 63) / 64;
+        return (words % 2 == 0) ? words : words + 1;
+    }
+
+    std::size_t get_offset(std::size_t const pos) const
+    {
+        return bitmap_rank(bitmap_, pos);
+    }
+};
+}  // namespace sparsedb
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "file.h"
+#include "bitmap.h"
+
+namespace sparsedb
+{
+// Counters for the buffer pool of a PagedSparseIndex. The nanosecond totals
+// divided by reads and writes give the mean I/O latency.
+struct PoolStats
+{
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t evictions = 0;
+    std::size_t reads = 0;
+    std::size_t writes = 0;
+    std::uint64_t readNanos = 0;
+    std::uint64_t writeNanos = 0;
+};
+
+// A SparseIndex that lives on disk, for indexes larger than memory. The
+// groups are stored in pages of PAGE_GROUPS groups, each page being its
+// bitmaps followed by their payloads. A page directory after the header
+// gives the offset, length and allocated capacity of every page. At most
+// poolPages pages are held in memory at a time, faulted in with a single
+// ReadAt and chosen for eviction by the CLOCK algorithm. Dirty pages are
+// written back when evicted and by flush(). A page that outgrows its
+// capacity moves to the end of the file, leaving its old space unused
+// until the file is rewritten.
+//
+// The file is only consistent after flush(). close(), and so open(),
+// create() and the destructor, flush before letting go of the file, but
+// the destructor can only drop an error, so call close() or flush() to see
+// whether the changes reached the file. Not thread safe. T must store its
+// values as a plain array, as for SparseIndex::read and write.
+template <class T>
+class PagedSparseIndex
+{
+   public:
+    using return_type = typename T::return_type;
+    using value_type = typename T::value_type;
+    using bitmap_type = typename T::bitmap_type;
+
+    enum
+    {
+        PAGE_GROUPS = 64,
+        // Pages are allocated in multiples of this many bytes, leaving room
+        // to grow in place.
+        PAGE_ALIGN = 4096
+    };
+
+   private:
+    struct PageEntry
+    {
+        std::uint64_t offset;
+        std::uint32_t length;
+        std::uint32_t capacity;
+    };
+
+    struct Frame
+    {
+        std::size_t page = NO_PAGE;
+        bool dirty = false;
+        bool referenced = false;
+        std::vector<T> groups;
+    };
+
+    enum
+    {
+        HEADER = 2 * sizeof(std::uint64_t),
+        // Bytes at the start of each page holding its bitmaps.
+        BITMAPS = PAGE_GROUPS * sizeof(bitmap_type)
+    };
+
+    static constexpr std::size_t NO_PAGE = ~std::size_t(0);
+
+    File *file_ = nullptr;
+    std::size_t size_ = 0;
+    std::vector<PageEntry> directory_;
+    // The frame holding each page, or NO_PAGE if it is not resident.
+    std::vector<std::size_t> frameOf_;
+    std::vector<Frame> frames_;
+    std::size_t hand_ = 0;
+    // End of the last page allocated in the file.
+    std::uint64_t end_ = 0;
+    std::vector<char> buffer_;
+    PoolStats stats_;
+
+   public:
+    explicit PagedSparseIndex(std::size_t const poolPages)
+        : frames_(poolPages)
+    {
+        assert(poolPages > 0);
+        for (auto &f : frames_) f.groups.resize(PAGE_GROUPS);
+    }
+
+    PagedSparseIndex(const PagedSparseIndex &) = delete;
+    PagedSparseIndex &operator=(const PagedSparseIndex &) = delete;
+
+    ~PagedSparseIndex() { close(); }
+
+    // Starts an empty index of size positions in file, which must be open
+    // and outlive the index or the next close.
+    std::error_condition create(File &file, std::size_t const size)
+    {
+        if (auto err = close())
+            return err;
+        reset(file, size);
+        if (auto err = file.Truncate())
+        {
+            file_ = nullptr;
+            return err;
+        }
+        return flush();
+    }
+
+    // Opens an index written to file, which must be open and outlive the
+    // index or the next close, by create and flush.
+    std::error_condition open(File &file)
+    {
+        if (auto err = close())
+            return err;
+        std::uint64_t header[2];
+        if (auto err = file.ReadAt(0, header, sizeof(header)))
+            return err;
+        reset(file, header[0]);
+        auto err = make_error_condition(db_error::corrupt_file);
+        if (header[1] == directory_.size())
+            err = file.ReadAt(HEADER, directory_.data(),
+                              directory_.size() * sizeof(PageEntry));
+        std::uint64_t length = 0;
+        if (!err)
+            err = file.Size(length);
+        for (auto const &e : directory_)
+        {
+            if (err)
+                break;
+            if (e.length > e.capacity || e.offset + e.length > length ||
+                (e.length && e.offset < HEADER + directory_.size() * sizeof(e)))
+                err = make_error_condition(db_error::corrupt_file);
+            end_ = std::max<std::uint64_t>(end_, e.offset + e.capacity);
+        }
+        if (err)
+        {
+            // Flushing this directory would overwrite the file's own.
+            file_ = nullptr;
+            return err;
+        }
+        return std::error_condition();
+    }
+
+    // Flushes and lets go of the file, if there is one. The index stays
+    // attached if the flush fails, so that it can be retried.
+    std::error_condition close()
+    {
+        if (!file_)
+            return std::error_condition();
+        if (auto err = flush())
+            return err;
+        for (auto &f : frames_) evict(f);
+        file_ = nullptr;
+        return std::error_condition();
+    }
+
+    // Writes back every dirty page and the directory and syncs the file.
+    std::error_condition flush()
+    {
+        for (auto &f : frames_)
+        {
+            if (auto err = write_back(f))
+                return err;
+        }
+        std::uint64_t header[2] = {size_, directory_.size()};
+        if (auto err = file_->WriteAt(0, header, sizeof(header)))
+            return err;
+        if (auto err = file_->WriteAt(HEADER, directory_.data(),
+                                      directory_.size() * sizeof(PageEntry)))
+            return err;
+        return file_->Sync();
+    }
+
+    std::size_t size() const { return size_; }
+    std::size_t num_pages() const { return directory_.size(); }
+    PoolStats const &stats() const { return stats_; }
+
+    // Sets result to the previous value and true if one exists.
+    std::error_condition insert(std::size_t const pos, value_type const value,
+                                return_type &result)
+    {
+        Frame *f;
+        if (auto err = fault(pos, f))
+            return err;
+        result = group(*f, pos).insert(pos_in_group(pos), value);
+        f->dirty = true;
+        return std::error_condition();
+    }
+
+    // Sets result to the previous value and true if one existed.
+    std::error_condition erase(std::size_t const pos, return_type &result)
+    {
+        Frame *f;
+        if (auto err = fault(pos, f))
+            return err;
+        result = group(*f, pos).erase(pos_in_group(pos));
+        f->dirty |= result.second;
+        return std::error_condition();
+    }
+
+    // Sets result to the value and true if pos is occupied, otherwise to 0
+    // and false.
+    std::error_condition get(std::size_t const pos, return_type &result)
+    {
+        Frame *f;
+        if (auto err = fault(pos, f))
+            return err;
+        result = group(*f, pos).get(pos_in_group(pos));
+        return std::error_condition();
+    }
+
+   private:
+    void reset(File &file, std::size_t const size)
+    {
+        assert(!file_);
+        file_ = &file;
+        size_ = size;
+        auto const groups = (size + T::SIZE - 1) / T::SIZE;
+        auto const pages = (groups + PAGE_GROUPS - 1) / PAGE_GROUPS;
+        directory_.assign(pages, PageEntry{0, 0, 0});
+        frameOf_.assign(pages, NO_PAGE);
+        end_ = align(HEADER + pages * sizeof(PageEntry));
+        hand_ = 0;
+        stats_ = PoolStats();
+    }
+
+    // Finds the frame holding the page of pos, reading it in if needed.
+    std::error_condition fault(std::size_t const pos, Frame *&frame)
+    {
+        assert(pos < size_);
+        auto const page = pos / (T::SIZE * PAGE_GROUPS);
+        if (frameOf_[page] != NO_PAGE)
+        {
+            stats_.hits++;
+            frame = &frames_[frameOf_[page]];
+            frame->referenced = true;
+            return std::error_condition();
+        }
+        stats_.misses++;
+        auto &f = frames_[victim()];
+        if (f.page != NO_PAGE)
+        {
+            stats_.evictions++;
+            if (auto err = write_back(f))
+                return err;
+            evict(f);
+        }
+        if (auto err = read_page(page, f))
+            return err;
+        frame = &f;
+        return std::error_condition();
+    }
+
+    // Advances the clock hand past referenced frames, clearing their bit,
+    // to the first frame that is free or was not used since the last pass.
+    std::size_t victim()
+    {
+        for (;;)
+        {
+            auto &f = frames_[hand_];
+            auto const i = hand_;
+            hand_ = (hand_ + 1) % frames_.size();
+            if (f.page == NO_PAGE || !f.referenced)
+                return i;
+            f.referenced = false;
+        }
+    }
+
+    std::error_condition read_page(std::size_t const page, Frame &f)
+    {
+        auto const &e = directory_[page];
+        f.page = page;
+        f.dirty = false;
+        f.referenced = true;
+        frameOf_[page] = &f - frames_.data();
+        if (!e.length)
+            return std::error_condition();
+        if (e.length < BITMAPS)
+        {
+            evict(f);
+            return make_error_condition(db_error::corrupt_file);
+        }
+        buffer_.resize(e.length);
+        auto const start = std::chrono::steady_clock::now();
+        if (auto err = file_->ReadAt(e.offset, buffer_.data(), e.length))
+        {
+            evict(f);
+            return err;
+        }
+        stats_.reads++;
+        stats_.readNanos += elapsed(start);
+        // The payloads the bitmaps describe must fill the rest of the page.
+        bitmap_type bitmaps[PAGE_GROUPS];
+        std::memcpy(bitmaps, buffer_.data(), BITMAPS);
+        std::size_t payload = 0;
+        for (auto const &b : bitmaps)
+            payload += bitmap_count(b) * sizeof(value_type);
+        if (payload != e.length - BITMAPS)
+        {
+            evict(f);
+            return make_error_condition(db_error::corrupt_file);
+        }
+        auto p = buffer_.data() + BITMAPS;
+        for (std::size_t i = 0; i < PAGE_GROUPS; i++)
+        {
+            auto &g = f.groups[i];
+            g.reset(bitmaps[i]);
+            std::memcpy(g.ptr(), p, g.size());
+            p += g.size();
+        }
+        return std::error_condition();
+    }
+
+    // Writes the frame's page if it is dirty, moving it to the end of the
+    // file if it no longer fits its capacity.
+    std::error_condition write_back(Frame &f)
+    {
+        if (f.page == NO_PAGE || !f.dirty)
+            return std::error_condition();
+        std::size_t length = BITMAPS;
+        for (auto const &g : f.groups) length += g.size();
+        buffer_.resize(length);
+        auto p = buffer_.data() + BITMAPS;
+        for (std::size_t i = 0; i < PAGE_GROUPS; i++)
+        {
+            auto const &g = f.groups[i];
+            auto const bitmap = g.bitmap();
+            std::memcpy(buffer_.data() + i * sizeof(bitmap), &bitmap,
+                        sizeof(bitmap));
+            std::memcpy(p, g.ptr(), g.size());
+            p += g.size();
+        }
+        auto &e = directory_[f.page];
+        if (length > e.capacity)
+        {
+            e.offset = end_;
+            e.capacity = align(length);
+            end_ += e.capacity;
+        }
+        e.length = length;
+        auto const start = std::chrono::steady_clock::now();
+        if (auto err = file_->WriteAt(e.offset, buffer_.data(), length))
+            return err;
+        stats_.writes++;
+        stats_.writeNanos += elapsed(start);
+        f.dirty = false;
+        return std::error_condition();
+    }
+
+    // Frees the frame's groups and detaches it from its page.
+    void evict(Frame &f)
+    {
+        if (f.page == NO_PAGE)
+            return;
+        for (auto &g : f.groups) g.clear();
+        frameOf_[f.page] = NO_PAGE;
+        f.page = NO_PAGE;
+        f.dirty = false;
+        f.referenced = false;
+    }
+
+    T &group(Frame &f, std::size_t const pos)
+    {
+        return f.groups[(pos / T::SIZE) % PAGE_GROUPS];
+    }
+
+    static std::size_t pos_in_group(std::size_t const pos)
+    {
+        return pos % T::SIZE;
+    }
+
+    static std::uint64_t align(std::uint64_t const length)
+    {
+        return (length + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+    }
+
+    static std::uint64_t elapsed(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+    }
+};
+
+template <class T>
+constexpr std::size_t PagedSparseIndex<T>::NO_PAGE;
+}  // namespace sparsedb
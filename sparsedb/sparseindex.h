@@ -2,24 +2,218 @@
 
 #include <cstddef>
 #include <cassert>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 #include "file.h"
+#include "allocator.h"
+#include "bitmap.h"
+#include "bitmapops.h"
+#include "compress.h"
+#include "indexheader.h"
+#include "threadpool.h"
+
+// The io_uring overloads of read and write need the Linux kernel headers.
+// Define SPARSEDB_URING to 0 to leave them out anyway.
+#ifndef SPARSEDB_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SPARSEDB_URING 1
+#endif
+#endif
+#endif
+#ifndef SPARSEDB_URING
+#define SPARSEDB_URING 0
+#endif
+#if SPARSEDB_URING
+#include "uringfile.h"
+#endif
 
 namespace sparsedb
 {
+// Merge function for the set operations of SparseIndex that keeps the value
+// from the first index.
+struct KeepFirst
+{
+    template <class V>
+    V operator()(V const a, V const) const
+    {
+        return a;
+    }
+};
+
+// Merge function that keeps the value from the second index, for last
+// writer wins.
+struct KeepLast
+{
+    template <class V>
+    V operator()(V const, V const b) const
+    {
+        return b;
+    }
+};
+
 // Simple wrapper around a group of a Vector class, such as SparseVector.
-// Implements serialization for the group.
+// Implements serialization for the group. Groups that do not store their
+// values as a plain array, such as PackedVector, support everything but
+// the read and write functions.
 template <class T>
 class SparseIndex
 {
-   private:
+   public:
     using return_type = typename T::return_type;
     using value_type = typename T::value_type;
+
+    enum
+    {
+        // Number of positions between prefetch stages in get_batch.
+        PREFETCH_DISTANCE = 16,
+        // Ranges of groups handed to each thread by the parallel read/write.
+        RANGES_PER_THREAD = 4,
+        // Groups covered by each entry of the rank directory.
+        RANK_GROUPS = 8,
+        // Groups whose bitmaps are combined at a time by the set operations.
+        SET_BLOCK_GROUPS = 64,
+        // Default groups for each entry of the directory written by
+        // write_with_directory.
+        DIRECTORY_GROUPS = 64
+    };
+
+   private:
+    using bitmap_type = typename T::bitmap_type;
+    using Vectors = std::vector<FileVector>;
+
+    enum : std::uint16_t
+    {
+        // Header flags of the formats that read understands.
+        FORMAT_FLAGS = IndexHeader::LZ_BLOCKS | IndexHeader::DELTA_VALUES |
+                       IndexHeader::GROUP_DIRECTORY
+    };
+
+    // Shared by an index and its latest snapshot to agree on who frees each
+    // payload.
+    struct SnapshotState
+    {
+        std::mutex mutex;
+        // Groups whose payload is still shared. Once the index unshares a
+        // group, the snapshot owns the old payload.
+        std::vector<bool> shared;
+        // Set once the snapshot is destroyed.
+        bool released = false;
+    };
+
+    // A contiguous range of groups and the file offset of its payloads.
+    struct Range
+    {
+        std::size_t first;
+        std::size_t last;
+        std::uint64_t offset;
+    };
+
+    // Default for callbacks that are not needed.
+    struct NoOp
+    {
+        void operator()(std::size_t, std::size_t) const {}
+    };
+
     std::size_t size_;
     std::vector<T> groups_;
+    // Number of occupied positions before each block of RANK_GROUPS groups,
+    // followed by the total. Rebuilt on demand once the occupancy changes.
+    mutable std::vector<std::uint64_t> rank_;
+    mutable bool rankValid_ = false;
+    std::shared_ptr<SnapshotState> snapshot_;
+    // True for a snapshot, false for the index it was taken from.
+    bool view_ = false;
 
    public:
+    // Forward iterator over the occupied positions in ascending order,
+    // yielding (position, value) pairs. Empty groups are skipped and set
+    // bits are visited by finding and clearing the lowest set bit, so
+    // iteration cost follows the number of occupied positions.
+    class const_iterator
+    {
+        friend class SparseIndex;
+
+        const SparseIndex *index_ = nullptr;
+        std::size_t group_ = 0;
+        // Bits of the current group still to be visited.
+        bitmap_type bits_ = bitmap_type();
+        // Values of the current group and the offset of the value of the
+        // lowest bit in bits_.
+        typename T::values_type values_ = typename T::values_type();
+        std::size_t slot_ = 0;
+
+        const_iterator(const SparseIndex *index, std::size_t const group,
+                       bitmap_type const bits,
+                       typename T::values_type const values,
+                       std::size_t const slot)
+            : index_(index),
+              group_(group),
+              bits_(bits),
+              values_(values),
+              slot_(slot)
+        {
+            if (!bitmap_any(bits_) && group_ < index_->groups_.size())
+                skip_empty();
+        }
+
+        void skip_empty()
+        {
+            auto const &groups = index_->groups_;
+            while (!bitmap_any(bits_) && ++group_ < groups.size())
+            {
+                bits_ = groups[group_].bitmap();
+                values_ = groups[group_].values();
+                slot_ = 0;
+            }
+        }
+
+       public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<std::size_t, typename T::value_type>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type *;
+        using reference = value_type;
+
+        const_iterator() = default;
+
+        value_type operator*() const
+        {
+            return value_type{group_ * T::SIZE + bitmap_first(bits_),
+                              values_[slot_]};
+        }
+
+        const_iterator &operator++()
+        {
+            bitmap_clear_first(bits_);
+            ++slot_;
+            if (!bitmap_any(bits_))
+                skip_empty();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const_iterator const &rhs) const
+        {
+            return group_ == rhs.group_ && bits_ == rhs.bits_;
+        }
+
+        bool operator!=(const_iterator const &rhs) const
+        {
+            return !(*this == rhs);
+        }
+    };
+
     explicit SparseIndex(std::size_t const size)
         : size_(size), groups_((size + T::SIZE - 1) / T::SIZE)
     {
@@ -28,9 +222,33 @@ class SparseIndex
     SparseIndex(const SparseIndex &) = delete;
     SparseIndex &operator=(const SparseIndex &) = delete;
 
+    ~SparseIndex()
+    {
+        if (view_)
+            release_view();
+        else
+            detach();
+    }
+
     return_type insert(std::size_t const pos, const value_type value)
     {
-        return groups_[group_for_pos(pos)].insert(pos_in_group(pos), value);
+        unshare(group_for_pos(pos));
+        auto result =
+            groups_[group_for_pos(pos)].insert(pos_in_group(pos), value);
+        if (!result.second)
+            rankValid_ = false;
+        return result;
+    }
+
+    return_type erase(std::size_t const pos)
+    {
+        if (!has(pos))
+            return return_type{0, false};
+        unshare(group_for_pos(pos));
+        auto result = groups_[group_for_pos(pos)].erase(pos_in_group(pos));
+        if (result.second)
+            rankValid_ = false;
+        return result;
     }
 
     return_type get(std::size_t const pos) const
@@ -43,34 +261,305 @@ class SparseIndex
         return groups_[group_for_pos(pos)].has(pos_in_group(pos));
     }
 
+    // Looks up count positions, writing one result per position to out.
+    // The batch is walked as a three stage pipeline: the group header for
+    // position i is prefetched, then the value slot for position i -
+    // PREFETCH_DISTANCE and finally position i - 2 * PREFETCH_DISTANCE is
+    // resolved, so that the cache misses of neighbouring lookups overlap.
+    void get_batch(const std::size_t *positions, std::size_t const count,
+                   return_type *out) const
+    {
+        const std::size_t D = PREFETCH_DISTANCE;
+        for (std::size_t i = 0; i < count + 2 * D; i++)
+        {
+            if (i < count)
+                __builtin_prefetch(&groups_[group_for_pos(positions[i])]);
+            if (i >= D && i - D < count)
+            {
+                auto const pos = positions[i - D];
+                groups_[group_for_pos(pos)].prefetch(pos_in_group(pos));
+            }
+            if (i >= 2 * D)
+                out[i - 2 * D] = get(positions[i - 2 * D]);
+        }
+    }
+
+    void get_batch(std::vector<std::size_t> const &positions,
+                   std::vector<return_type> &out) const
+    {
+        out.resize(positions.size());
+        get_batch(positions.data(), positions.size(), out.data());
+    }
+
+    const_iterator begin() const { return lower_bound(0); }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, groups_.size(), bitmap_type(),
+                              typename T::values_type(), 0);
+    }
+
+    // Returns an iterator to the first occupied position not less than pos.
+    const_iterator lower_bound(std::size_t const pos) const
+    {
+        if (pos >= size_)
+            return end();
+        auto const group = group_for_pos(pos);
+        auto const offset = pos_in_group(pos);
+        auto const &g = groups_[group];
+        auto bits = g.bitmap();
+        bitmap_mask(bits, offset, T::SIZE);
+        return const_iterator(this, group, bits, g.values(),
+                              bitmap_rank(g.bitmap(), offset));
+    }
+
+    // Calls fn(position, value) for each occupied position in [lo, hi) in
+    // ascending order.
+    template <class Fn>
+    void for_each_in_range(std::size_t const lo, std::size_t hi, Fn fn) const
+    {
+        hi = std::min(hi, size_);
+        if (lo >= hi)
+            return;
+        auto const last = group_for_pos(hi - 1);
+        for (auto group = group_for_pos(lo); group <= last; group++)
+        {
+            auto const &g = groups_[group];
+            auto bits = g.bitmap();
+            if (!bitmap_any(bits))
+                continue;
+            std::size_t from = 0, to = T::SIZE;
+            if (group == group_for_pos(lo))
+                from = pos_in_group(lo);
+            if (group == last)
+                to = pos_in_group(hi - 1) + 1;
+            auto const values = g.values();
+            auto slot = bitmap_rank(bits, from);
+            bitmap_mask(bits, from, to);
+            for (; bitmap_any(bits); bitmap_clear_first(bits))
+                fn(group * T::SIZE + bitmap_first(bits), values[slot++]);
+        }
+    }
+
     void clear()
     {
+        detach();
         for (auto &g : groups_) g.clear();
+        rankValid_ = false;
+    }
+
+    // Returns an immutable point in time view of the index that shares the
+    // group payloads with it. The index copies a group's payload the first
+    // time it modifies the group after the snapshot, so taking a snapshot
+    // only copies the group headers. The snapshot may be read, for example
+    // written to a file, on another thread while the index is modified,
+    // and may outlive the index.
+    //
+    // Taking a snapshot while an earlier one is still alive first copies
+    // the payloads still shared with the earlier one.
+    std::shared_ptr<const SparseIndex> snapshot()
+    {
+        if (snapshot_)
+        {
+            for (std::size_t i = 0; i < groups_.size(); i++) unshare(i);
+            snapshot_.reset();
+        }
+        auto state = std::make_shared<SnapshotState>();
+        state->shared.assign(groups_.size(), true);
+        std::shared_ptr<SparseIndex> view(new SparseIndex(size_, groups_));
+        view->snapshot_ = state;
+        view->view_ = true;
+        snapshot_ = state;
+        return view;
+    }
+
+    // Replaces the contents of the index with the (position, value) pairs in
+    // [first, last), which must be sorted by position. Each group's payload
+    // is allocated exactly once. Where a position repeats the last value
+    // wins, as it would with insert.
+    template <class ForwardIt>
+    void bulk_load(ForwardIt first, ForwardIt last)
+    {
+        clear();
+        while (first != last) first = load_group(first, last);
+    }
+
+    // As bulk_load(first, last), with the input split at group boundaries
+    // into ranges that are built concurrently by pool.
+    template <class RandomIt>
+    void bulk_load(RandomIt first, RandomIt last, ThreadPool &pool)
+    {
+        clear();
+        auto const parts =
+            static_cast<std::ptrdiff_t>(pool.size() * RANGES_PER_THREAD);
+        auto const length =
+            std::max<std::ptrdiff_t>((last - first + parts - 1) / parts, 1);
+        std::vector<RandomIt> bounds(1, first);
+        while (last - bounds.back() > length)
+        {
+            // Move the split forward to the start of the next group.
+            auto const group = group_for_pos((bounds.back() + length)->first);
+            bounds.push_back(std::partition_point(
+                bounds.back() + length, last,
+                [&](typename std::iterator_traits<RandomIt>::value_type const
+                        &v)
+                {
+                    return group_for_pos(v.first) == group;
+                }));
+        }
+        bounds.push_back(last);
+        pool.run_all(bounds.size() - 1, [&](std::size_t i)
+                     {
+            for (auto it = bounds[i]; it != bounds[i + 1];)
+                it = load_group(it, bounds[i + 1]);
+            return std::error_condition();
+        });
     }
 
     std::size_t num_nonempty() const
     {
+        if (rankValid_ && !rank_.empty())
+            return rank_.back();
         std::size_t count = 0;
         for (auto const &g : groups_) count += g.num_nonempty();
         return count;
     }
 
-    bool operator==(const SparseIndex<T> &rhs)
+    // Number of occupied positions less than pos. The rank directory is
+    // rebuilt first if the occupancy has changed since it was last used, so
+    // concurrent calls must be serialised unless build_rank() was called.
+    std::size_t rank(std::size_t const pos) const
+    {
+        build_rank();
+        if (pos >= size_)
+            return rank_.back();
+        auto const group = group_for_pos(pos);
+        std::size_t count = rank_[group / RANK_GROUPS];
+        for (auto i = group - group % RANK_GROUPS; i < group; i++)
+            count += groups_[i].num_nonempty();
+        return count + bitmap_rank(groups_[group].bitmap(), pos_in_group(pos));
+    }
+
+    // Returns the k'th occupied position, counting from zero, or size() if
+    // there are no more than k. See rank() regarding concurrent calls.
+    std::size_t select(std::size_t k) const
+    {
+        build_rank();
+        if (k >= rank_.back())
+            return size_;
+        std::size_t const block =
+            std::upper_bound(rank_.cbegin(), rank_.cend(), k) -
+            rank_.cbegin() - 1;
+        k -= rank_[block];
+        auto group = block * RANK_GROUPS;
+        for (; k >= groups_[group].num_nonempty(); group++)
+            k -= groups_[group].num_nonempty();
+        return group * T::SIZE + bitmap_select(groups_[group].bitmap(), k);
+    }
+
+    // Brings the rank directory up to date.
+    void build_rank() const
+    {
+        if (rankValid_)
+            return;
+        auto const blocks = (groups_.size() + RANK_GROUPS - 1) / RANK_GROUPS;
+        rank_.resize(blocks + 1);
+        std::uint64_t count = 0;
+        for (std::size_t i = 0; i < groups_.size(); i++)
+        {
+            if (i % RANK_GROUPS == 0)
+                rank_[i / RANK_GROUPS] = count;
+            count += groups_[i].num_nonempty();
+        }
+        rank_[blocks] = count;
+        rankValid_ = true;
+    }
+
+    // Sets this index to the positions occupied in both a and b, with the
+    // value merge(value in a, value in b). a, b and this index must have the
+    // same size, and this index may be a or b. The bitmaps are combined a
+    // block of groups at a time with bitmap_combine, and payloads are only
+    // read for groups where the result is not empty.
+    template <class Merge = KeepFirst>
+    void intersect(SparseIndex const &a, SparseIndex const &b,
+                   Merge merge = Merge())
+    {
+        combine<SetOp::INTERSECT>(a, b, merge);
+    }
+
+    // Sets this index to the positions occupied in a or b, with the value
+    // from whichever has it or merge(value in a, value in b) if both do. See
+    // intersect.
+    template <class Merge = KeepFirst>
+    void unite(SparseIndex const &a, SparseIndex const &b,
+               Merge merge = Merge())
+    {
+        combine<SetOp::UNITE>(a, b, merge);
+    }
+
+    // Sets this index to the positions occupied in a but not in b, with the
+    // values from a. See intersect.
+    void subtract(SparseIndex const &a, SparseIndex const &b)
+    {
+        combine<SetOp::SUBTRACT>(a, b, KeepFirst());
+    }
+
+    // Number of positions occupied in both a and b, counted from the
+    // bitmaps alone.
+    static std::size_t intersect_count(SparseIndex const &a,
+                                       SparseIndex const &b)
+    {
+        return combine_count<SetOp::INTERSECT>(a, b);
+    }
+
+    // Number of positions occupied in a or b.
+    static std::size_t unite_count(SparseIndex const &a, SparseIndex const &b)
+    {
+        return combine_count<SetOp::UNITE>(a, b);
+    }
+
+    // Number of positions occupied in a but not in b.
+    static std::size_t subtract_count(SparseIndex const &a,
+                                      SparseIndex const &b)
+    {
+        return combine_count<SetOp::SUBTRACT>(a, b);
+    }
+
+    // Memory held by the group allocator. Allocator policies are shared by
+    // every group of the same type, so this covers all such indexes.
+    AllocatorStats allocator_stats() const
+    {
+        return T::allocator_type::stats();
+    }
+
+    bool operator==(const SparseIndex<T> &rhs) const
     {
         return size() == rhs.size() &&
                std::equal(groups_.cbegin(), groups_.cend(),
                           rhs.groups_.cbegin(), rhs.groups_.cend());
     }
 
+    // Reads the format written by write(file) or write_compressed(file), see
+    // IndexHeader. Fails with corrupt_file if any chunk of groups does not
+    // match its checksum.
     std::error_condition read(File &file)
     {
-        if (auto err = file.Read(&size_, sizeof(size_)))
+        IndexHeader header;
+        if (auto err = file.Read(&header, sizeof(header)))
             return err;
-        std::size_t groupSize;
-        if (auto err = file.Read(&groupSize, sizeof(groupSize)))
+        if (auto err = header.check(sizeof(bitmap_type), FORMAT_FLAGS))
             return err;
-        groups_.reserve(groupSize);
+        if (header.flags & IndexHeader::LZ_BLOCKS)
+        {
+            reset_groups(header);
+            return read_compressed(file, header);
+        }
+        size_ = header.size;
+        std::size_t const groupSize = header.groups;
+        detach();
         groups_.resize(0);
+        groups_.reserve(groupSize);
+        rankValid_ = false;
         std::vector<typename T::bitmap_type> v;
         v.reserve(1024 * 1024);
         for (std::size_t i = 0; i < groupSize; i += v.size())
@@ -80,27 +569,490 @@ class SparseIndex
                 return err;
             for (auto const &bitmap : v) groups_.emplace_back(bitmap);
         }
+        // Each batch of payloads is checksummed straight after it is read,
+        // while it is still in cache.
+        std::vector<std::uint32_t> actual(header.num_chunks());
         std::vector<FileVector> fv;
         fv.reserve(1024);
-        for (const auto &g : groups_)
+        std::size_t batch = 0;
+        for (std::size_t i = 0; i < groups_.size(); i++)
         {
-            fv.emplace_back(g.ptr(), g.size());
+            fv.emplace_back(groups_[i].ptr(), groups_[i].size());
             if (fv.size() == fv.capacity())
             {
                 if (auto err = file.ReadVector(fv))
                     return err;
+                add_checksums(batch, i + 1, actual);
+                batch = i + 1;
                 fv.resize(0);
             }
         }
-        return file.ReadVector(fv);
+        if (auto err = file.ReadVector(fv))
+            return err;
+        add_checksums(batch, groups_.size(), actual);
+        std::vector<std::uint32_t> checksums(header.num_chunks());
+        if (auto err = file.Read(checksums))
+            return err;
+        return verify(Range{0, groups_.size(), 0}, checksums, actual);
     }
 
+    // Writes the header, the bitmaps, the payloads and the checksums of
+    // each chunk of groups, see IndexHeader.
     std::error_condition write(File &file) const
     {
-        if (auto err = file.Write(&size_, sizeof(size_)))
+        auto const header = IndexHeader::make(size_, groups_.size(),
+                                              sizeof(bitmap_type));
+        return write_sequential(file, header);
+    }
+
+    // Writes the format of write(file) followed by a directory of the
+    // payload offset of every directoryGroups'th group, see IndexHeader, so
+    // that LazySparseIndex can look up any position with two small reads.
+    // read and MappedSparseIndex skip the directory.
+    std::error_condition write_with_directory(
+        File &file, std::size_t const directoryGroups = DIRECTORY_GROUPS) const
+    {
+        assert(directoryGroups > 0);
+        auto const header = IndexHeader::make(
+            size_, groups_.size(), sizeof(bitmap_type),
+            IndexHeader::GROUP_DIRECTORY,
+            static_cast<std::uint32_t>(directoryGroups));
+        if (auto err = write_sequential(file, header))
+            return err;
+        std::vector<std::uint64_t> directory;
+        directory.reserve(header.directory_entries());
+        auto offset = bitmap_offset(groups_.size());
+        for (std::size_t i = 0; i < groups_.size(); i++)
+        {
+            if (i % directoryGroups == 0)
+                directory.push_back(offset);
+            offset += groups_[i].size();
+        }
+        auto const crc = crc32c(directory.data(),
+                                directory.size() * sizeof(std::uint64_t));
+        if (auto err = file.Write(directory))
+            return err;
+        return file.Write(&crc, sizeof(crc));
+    }
+
+    // Writes only the listed groups, which must ascend, in the format of
+    // IndexHeader with the GROUP_DELTA flag. Applied by read_delta on top
+    // of an index read from an earlier checkpoint.
+    std::error_condition write_delta(
+        File &file, std::vector<std::uint64_t> const &groups) const
+    {
+        auto const header =
+            IndexHeader::make(size_, groups_.size(), sizeof(bitmap_type),
+                              IndexHeader::GROUP_DELTA);
+        if (auto err = file.Write(&header, sizeof(header)))
+            return err;
+        std::uint64_t const count = groups.size();
+        auto const crc = list_checksum(count, groups);
+        if (auto err = file.Write(&count, sizeof(count)))
+            return err;
+        if (auto err = file.Write(groups))
+            return err;
+        if (auto err = file.Write(&crc, sizeof(crc)))
+            return err;
+        std::vector<bitmap_type> v;
+        v.reserve(groups.size());
+        for (auto const group : groups) v.emplace_back(groups_[group].bitmap());
+        if (auto err = file.Write(v))
+            return err;
+        std::vector<std::uint32_t> checksums(IndexHeader::num_chunks(count));
+        Vectors fv;
+        fv.reserve(1024);
+        for (std::size_t i = 0; i < groups.size(); i++)
+        {
+            auto const &g = groups_[groups[i]];
+            auto &chunk = checksums[i / IndexHeader::CHUNK_GROUPS];
+            chunk = IndexHeader::add_group(chunk, group_checksum(groups[i]));
+            fv.emplace_back(g.ptr(), g.size());
+            if (fv.size() == fv.capacity())
+            {
+                if (auto err = file.WriteVector(fv))
+                    return err;
+                fv.resize(0);
+            }
+        }
+        if (auto err = file.WriteVector(fv))
+            return err;
+        return file.Write(checksums);
+    }
+
+    // Replaces the groups in a file written by write_delta. The index must
+    // have the size of the one that wrote it. The whole delta is checked
+    // before any group is replaced, so a damaged one fails with
+    // corrupt_file and leaves the index as it was, and a file that is not
+    // a delta fails with bad_version.
+    std::error_condition read_delta(File &file)
+    {
+        IndexHeader header;
+        if (auto err = file.Read(&header, sizeof(header)))
+            return err;
+        if (auto err = header.check(sizeof(bitmap_type),
+                                    IndexHeader::GROUP_DELTA))
+            return err;
+        if (!(header.flags & IndexHeader::GROUP_DELTA))
+            return make_error_condition(db_error::bad_version);
+        std::uint64_t count;
+        if (auto err = file.Read(&count, sizeof(count)))
+            return err;
+        if (header.size != size_ || header.groups != groups_.size() ||
+            count > groups_.size())
+            return make_error_condition(db_error::corrupt_file);
+        std::vector<std::uint64_t> groups(count);
+        if (auto err = file.Read(groups))
+            return err;
+        std::uint32_t crc;
+        if (auto err = file.Read(&crc, sizeof(crc)))
+            return err;
+        if (crc != list_checksum(count, groups) ||
+            !std::is_sorted(groups.begin(), groups.end()) ||
+            (count && groups.back() >= groups_.size()))
+            return make_error_condition(db_error::corrupt_file);
+        std::vector<bitmap_type> v(count);
+        if (auto err = file.Read(v))
+            return err;
+        std::size_t bytes = 0;
+        for (auto const &bitmap : v)
+            bytes += bitmap_count(bitmap) * sizeof(value_type);
+        std::vector<char> payloads(bytes);
+        if (auto err = file.Read(payloads))
+            return err;
+        std::vector<std::uint32_t> checksums(IndexHeader::num_chunks(count));
+        if (auto err = file.Read(checksums))
+            return err;
+        std::vector<std::uint32_t> actual(checksums.size());
+        auto p = payloads.data();
+        for (std::size_t i = 0; i < count; i++)
+        {
+            auto const length = bitmap_count(v[i]) * sizeof(value_type);
+            auto &chunk = actual[i / IndexHeader::CHUNK_GROUPS];
+            chunk = IndexHeader::add_group(
+                chunk, IndexHeader::group_checksum(&v[i], sizeof(bitmap_type),
+                                                   p, length));
+            p += length;
+        }
+        if (actual != checksums)
+            return make_error_condition(db_error::corrupt_file);
+        rankValid_ = false;
+        p = payloads.data();
+        for (std::size_t i = 0; i < count; i++)
+        {
+            unshare(groups[i]);
+            auto &g = groups_[groups[i]];
+            g.reset(v[i]);
+            std::memcpy(g.ptr(), p, g.size());
+            p += g.size();
+        }
+        return std::error_condition();
+    }
+
+    // Reads the format written by write(file) or write_compressed(file),
+    // with contiguous ranges of groups read concurrently by pool. Each thread
+    // checks the chunks of its ranges as it reads them.
+    std::error_condition read(File &file, ThreadPool &pool)
+    {
+        IndexHeader header;
+        if (auto err = read_header(file, header))
+            return err;
+        auto ranges = partition(pool.size() * RANGES_PER_THREAD);
+        if (header.flags & IndexHeader::LZ_BLOCKS)
+        {
+            std::vector<BlockEntry> entries;
+            if (auto err = read_entries(file, entries))
+                return err;
+            return pool.run_all(ranges.size(), [&](std::size_t i)
+                                {
+                return read_blocks(file, header, ranges[i], entries);
+            });
+        }
+        auto err = pool.run_all(ranges.size(), [&](std::size_t i)
+                                {
+            return read_bitmaps(file, ranges[i]);
+        });
+        if (err)
+            return err;
+        std::vector<std::uint32_t> checksums;
+        if (auto err = read_checksums(file, assign_offsets(ranges), checksums))
+            return err;
+        std::vector<std::uint32_t> actual(checksums.size());
+        auto read = [&](std::uint64_t pos, Vectors const &fv)
+        {
+            return file.ReadVectorAt(pos, fv);
+        };
+        auto added = [&](std::size_t first, std::size_t last)
+        {
+            add_checksums(first, last, actual);
+        };
+        return pool.run_all(ranges.size(), [&](std::size_t i)
+                            {
+            if (auto err = transfer_payloads(ranges[i], read, added))
+                return err;
+            return verify(ranges[i], checksums, actual);
+        });
+    }
+
+    // Writes the same format as write(file), with contiguous ranges of
+    // groups written concurrently by pool at offsets given by a prefix sum
+    // of the payload sizes.
+    std::error_condition write(File &file, ThreadPool &pool) const
+    {
+        if (auto err = write_header(file))
+            return err;
+        auto ranges = partition(pool.size() * RANGES_PER_THREAD);
+        std::vector<std::uint32_t> checksums(
+            IndexHeader::num_chunks(groups_.size()));
+        pool.run_all(ranges.size(), [&](std::size_t i)
+                     {
+            ranges[i].offset = payload_size(ranges[i]);
+            checksum(ranges[i], checksums);
+            return std::error_condition();
+        });
+        auto const end = assign_offsets(ranges);
+        auto write = [&](std::uint64_t pos, Vectors const &fv)
+        {
+            return file.WriteVectorAt(pos, fv);
+        };
+        auto err = pool.run_all(ranges.size(), [&](std::size_t i)
+                                {
+            if (auto err = write_bitmaps(file, ranges[i]))
+                return err;
+            return transfer_payloads(ranges[i], write);
+        });
+        if (err)
+            return err;
+        return file.WriteAt(end, checksums.data(),
+                            checksums.size() * sizeof(std::uint32_t));
+    }
+
+    // Writes the groups as a compressed block for each chunk of
+    // IndexHeader::CHUNK_GROUPS groups, see BlockEntry, which can be read
+    // back independently. Integer payloads are delta encoded first. read
+    // recognises either format.
+    std::error_condition write_compressed(File &file) const
+    {
+        auto const header = compressed_header();
+        if (auto err = file.WriteAt(0, &header, sizeof(header)))
+            return err;
+        std::vector<BlockEntry> entries(header.num_chunks());
+        auto offset = block_offset(entries.size());
+        BlockBuffers buffers;
+        for (std::size_t i = 0; i < groups_.size();
+             i += IndexHeader::CHUNK_GROUPS)
+        {
+            auto const last =
+                std::min<std::size_t>(i + IndexHeader::CHUNK_GROUPS,
+                                      groups_.size());
+            buffers.stored.clear();
+            compress_range(Range{i, last, 0}, offset, entries, buffers);
+            if (auto err = file.WriteAt(offset, buffers.stored.data(),
+                                        buffers.stored.size()))
+                return err;
+            offset += buffers.stored.size();
+        }
+        return write_entries(file, entries);
+    }
+
+    // As write_compressed(file), with contiguous ranges of groups compressed
+    // into memory concurrently by pool and then written concurrently at
+    // offsets given by a prefix sum of their sizes.
+    std::error_condition write_compressed(File &file, ThreadPool &pool) const
+    {
+        auto const header = compressed_header();
+        if (auto err = file.WriteAt(0, &header, sizeof(header)))
+            return err;
+        std::vector<BlockEntry> entries(header.num_chunks());
+        auto ranges = partition(pool.size() * RANGES_PER_THREAD);
+        std::vector<std::vector<std::uint8_t>> blocks(ranges.size());
+        pool.run_all(ranges.size(), [&](std::size_t i)
+                     {
+            BlockBuffers buffers;
+            compress_range(ranges[i], 0, entries, buffers);
+            blocks[i].swap(buffers.stored);
+            return std::error_condition();
+        });
+        auto offset = block_offset(entries.size());
+        for (std::size_t i = 0; i < ranges.size(); i++)
+        {
+            ranges[i].offset = offset;
+            for (auto c = ranges[i].first / IndexHeader::CHUNK_GROUPS;
+                 c < IndexHeader::num_chunks(ranges[i].last); c++)
+                entries[c].offset += offset;
+            offset += blocks[i].size();
+        }
+        auto err = pool.run_all(ranges.size(), [&](std::size_t i)
+                                {
+            return file.WriteAt(ranges[i].offset, blocks[i].data(),
+                                blocks[i].size());
+        });
+        if (err)
+            return err;
+        return write_entries(file, entries);
+    }
+
+#if SPARSEDB_URING
+    // Reads the format written by write(file). The payloads are queued on
+    // file's io_uring so that up to its queue depth of reads are in flight.
+    // A file from write_compressed is read synchronously.
+    std::error_condition read(UringFile &file)
+    {
+        IndexHeader header;
+        if (auto err = read_header(file, header))
+            return err;
+        if (header.flags & IndexHeader::LZ_BLOCKS)
+            return read_compressed(file, header);
+        std::vector<Range> ranges(1, Range{0, groups_.size(), 0});
+        if (auto err = read_bitmaps(file, ranges[0]))
+            return err;
+        std::vector<std::uint32_t> checksums;
+        if (auto err = read_checksums(file, assign_offsets(ranges), checksums))
+            return err;
+        auto err = transfer_payloads(ranges[0], [&](std::uint64_t pos,
+                                                    Vectors const &fv)
+                                     {
+            return file.SubmitReadVectorAt(pos, fv);
+        });
+        auto waitErr = file.Wait();
+        if (err || waitErr)
+            return err ? err : waitErr;
+        std::vector<std::uint32_t> actual(checksums.size());
+        checksum(ranges[0], actual);
+        return verify(ranges[0], checksums, actual);
+    }
+
+    // Writes the same format as write(file). The payloads are queued on
+    // file's io_uring so that up to its queue depth of writes are in flight.
+    std::error_condition write(UringFile &file) const
+    {
+        if (auto err = write_header(file))
+            return err;
+        std::vector<Range> ranges(1, Range{0, groups_.size(), 0});
+        if (auto err = write_bitmaps(file, ranges[0]))
             return err;
-        auto groupSize = groups_.size();
-        if (auto err = file.Write(&groupSize, sizeof(groupSize)))
+        ranges[0].offset = payload_size(ranges[0]);
+        auto const end = assign_offsets(ranges);
+        auto err = transfer_payloads(ranges[0], [&](std::uint64_t pos,
+                                                    Vectors const &fv)
+                                     {
+            return file.SubmitWriteVectorAt(pos, fv);
+        });
+        auto waitErr = file.Wait();
+        if (err || waitErr)
+            return err ? err : waitErr;
+        std::vector<std::uint32_t> checksums(
+            IndexHeader::num_chunks(groups_.size()));
+        checksum(ranges[0], checksums);
+        return file.WriteAt(end, checksums.data(),
+                            checksums.size() * sizeof(std::uint32_t));
+    }
+#endif
+
+    std::size_t size() const { return size_; }
+
+    friend std::ostream &operator<<(std::ostream &stream,
+                                    const SparseIndex &index)
+    {
+        for (auto const &g : index.groups_)
+            stream << g.to_string() << std::endl;
+        return stream;
+    }
+
+   private:
+    // Shallow copies the groups, for a snapshot.
+    SparseIndex(std::size_t const size, std::vector<T> const &groups)
+        : size_(size), groups_(groups)
+    {
+    }
+
+    // Called before modifying a group. If the group still shares its
+    // payload with the snapshot, the snapshot keeps the payload and the
+    // group takes a private copy. The copy is made under the lock, as a
+    // snapshot destroyed on another thread frees the payload as soon as the
+    // group is no longer marked shared.
+    void unshare(std::size_t const group)
+    {
+        if (!snapshot_)
+            return;
+        std::unique_lock<std::mutex> lock(snapshot_->mutex);
+        if (snapshot_->released)
+        {
+            lock.unlock();
+            snapshot_.reset();
+            return;
+        }
+        if (!snapshot_->shared[group])
+            return;
+        auto &g = groups_[group];
+        auto const bitmap = g.bitmap();
+        auto const values = g.values();
+        value_type copy[T::SIZE];
+        for (std::size_t i = 0; i < g.num_nonempty(); i++) copy[i] = values[i];
+        g.release();
+        g.assign(bitmap, copy);
+        snapshot_->shared[group] = false;
+    }
+
+    // Called before dropping every group. Hands the payloads still shared
+    // with the snapshot over to it.
+    void detach()
+    {
+        if (!snapshot_)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(snapshot_->mutex);
+            for (std::size_t i = 0; i < groups_.size(); i++)
+            {
+                if (!snapshot_->released && snapshot_->shared[i])
+                    groups_[i].release();
+                snapshot_->shared[i] = false;
+            }
+        }
+        snapshot_.reset();
+    }
+
+    // Called when a snapshot is destroyed. Forgets the payloads still owned
+    // by the index, so that only those the index has unshared are freed.
+    void release_view()
+    {
+        std::lock_guard<std::mutex> lock(snapshot_->mutex);
+        for (std::size_t i = 0; i < groups_.size(); i++)
+            if (snapshot_->shared[i])
+                groups_[i].release();
+        snapshot_->released = true;
+    }
+
+    // Builds the group of first's position from the run of pairs in that
+    // group and returns the end of the run.
+    template <class ForwardIt>
+    ForwardIt load_group(ForwardIt first, ForwardIt last)
+    {
+        auto const group = group_for_pos(first->first);
+        bitmap_type bitmap = bitmap_type();
+        auto end = first;
+        for (; end != last && group_for_pos(end->first) == group; ++end)
+            bitmap_set(bitmap, pos_in_group(end->first));
+        value_type values[T::SIZE];
+        auto p = values;
+        auto previous = first->first;
+        for (auto it = first; it != end; ++it)
+        {
+            assert(previous <= it->first);
+            if (it != first && it->first == previous)
+                --p;
+            *p++ = it->second;
+            previous = it->first;
+        }
+        groups_[group].assign(bitmap, values);
+        return end;
+    }
+
+    // Writes the plain format with the given header from the cursor on.
+    std::error_condition write_sequential(File &file,
+                                          IndexHeader const &header) const
+    {
+        if (auto err = file.Write(&header, sizeof(header)))
             return err;
         std::vector<typename T::bitmap_type> v;
         v.reserve(1024 * 1024);
@@ -128,20 +1080,547 @@ class SparseIndex
                 fv.resize(0);
             }
         }
-        return file.WriteVector(fv);
+        if (auto err = file.WriteVector(fv))
+            return err;
+        std::vector<std::uint32_t> checksums(header.num_chunks());
+        checksum(Range{0, groups_.size(), 0}, checksums);
+        return file.Write(checksums);
     }
 
-    std::size_t size() const { return size_; }
+    std::error_condition read_header(File const &file, IndexHeader &header)
+    {
+        if (auto err = file.ReadAt(0, &header, sizeof(header)))
+            return err;
+        if (auto err = header.check(sizeof(bitmap_type), FORMAT_FLAGS))
+            return err;
+        reset_groups(header);
+        return std::error_condition();
+    }
 
-    friend std::ostream &operator<<(std::ostream &stream,
-                                    const SparseIndex &index)
+    // Replaces the groups with the empty groups of the header's index.
+    void reset_groups(IndexHeader const &header)
     {
-        for (auto const &g : index.groups_)
-            stream << g.to_string() << std::endl;
-        return stream;
+        size_ = header.size;
+        detach();
+        groups_.clear();
+        groups_.resize(header.groups);
+        rankValid_ = false;
+    }
+
+    std::error_condition write_header(File const &file) const
+    {
+        auto const header = IndexHeader::make(size_, groups_.size(),
+                                              sizeof(bitmap_type));
+        return file.WriteAt(0, &header, sizeof(header));
+    }
+
+    static std::uint64_t bitmap_offset(std::size_t const group)
+    {
+        return sizeof(IndexHeader) + group * sizeof(bitmap_type);
+    }
+
+    // Reads the checksums of every chunk, which follow the payloads ending
+    // at end.
+    std::error_condition read_checksums(
+        File const &file, std::uint64_t const end,
+        std::vector<std::uint32_t> &checksums) const
+    {
+        checksums.resize(IndexHeader::num_chunks(groups_.size()));
+        return file.ReadAt(end, checksums.data(),
+                           checksums.size() * sizeof(std::uint32_t));
+    }
+
+    // Adds the groups from first to last to the checksums of their chunks,
+    // which must already hold any earlier groups of the same chunk.
+    void add_checksums(std::size_t const first, std::size_t const last,
+                       std::vector<std::uint32_t> &checksums) const
+    {
+        for (auto i = first; i < last; i++)
+        {
+            auto &crc = checksums[i / IndexHeader::CHUNK_GROUPS];
+            crc = IndexHeader::add_group(crc, group_checksum(i));
+        }
+    }
+
+    // Checksum of the number and list of groups in a delta.
+    static std::uint32_t list_checksum(
+        std::uint64_t const count, std::vector<std::uint64_t> const &groups)
+    {
+        return crc32c(groups.data(), groups.size() * sizeof(std::uint64_t),
+                      crc32c(&count, sizeof(count)));
+    }
+
+    std::uint32_t group_checksum(std::size_t const group) const
+    {
+        auto const &g = groups_[group];
+        return IndexHeader::group_checksum(&g.bitmap(), sizeof(bitmap_type),
+                                           g.ptr(), g.size());
+    }
+
+    // Sets the checksums of the chunks of the range, which must start on a
+    // chunk boundary.
+    void checksum(Range const &range,
+                  std::vector<std::uint32_t> &checksums) const
+    {
+        auto const first = range.first / IndexHeader::CHUNK_GROUPS;
+        auto const last = IndexHeader::num_chunks(range.last);
+        std::fill(checksums.begin() + first, checksums.begin() + last, 0);
+        add_checksums(range.first, range.last, checksums);
+    }
+
+    // Fails with corrupt_file if the actual checksums of the range's chunks
+    // differ from those expected.
+    static std::error_condition verify(
+        Range const &range, std::vector<std::uint32_t> const &expected,
+        std::vector<std::uint32_t> const &actual)
+    {
+        auto const first = range.first / IndexHeader::CHUNK_GROUPS;
+        auto const last = IndexHeader::num_chunks(range.last);
+        if (!std::equal(expected.begin() + first, expected.begin() + last,
+                        actual.begin() + first))
+            return make_error_condition(db_error::corrupt_file);
+        return std::error_condition();
+    }
+
+    // Splits the groups into at most parts ranges of similar length, each a
+    // whole number of checksum chunks.
+    std::vector<Range> partition(std::size_t const parts) const
+    {
+        std::vector<Range> ranges;
+        auto const chunks = IndexHeader::num_chunks(groups_.size());
+        auto const length =
+            std::max<std::size_t>((chunks + parts - 1) / parts, 1) *
+            IndexHeader::CHUNK_GROUPS;
+        for (std::size_t i = 0; i < groups_.size(); i += length)
+            ranges.push_back(
+                Range{i, std::min(i + length, groups_.size()), 0});
+        return ranges;
+    }
+
+    std::uint64_t payload_size(Range const &range) const
+    {
+        std::uint64_t size = 0;
+        for (auto i = range.first; i < range.last; i++)
+            size += groups_[i].size();
+        return size;
+    }
+
+    // Turns the payload size held in each range's offset into the file
+    // offset of its first payload. Returns the end of the payloads.
+    std::uint64_t assign_offsets(std::vector<Range> &ranges) const
+    {
+        auto offset = bitmap_offset(groups_.size());
+        for (auto &r : ranges)
+        {
+            auto const size = r.offset;
+            r.offset = offset;
+            offset += size;
+        }
+        return offset;
+    }
+
+    // Reads and allocates the range's groups, leaving its payload size in
+    // range.offset.
+    std::error_condition read_bitmaps(File const &file, Range &range)
+    {
+        std::vector<bitmap_type> v;
+        v.reserve(1024 * 1024);
+        range.offset = 0;
+        for (auto i = range.first; i < range.last; i += v.size())
+        {
+            v.resize(std::min(v.capacity(), range.last - i));
+            if (auto err = file.ReadAt(bitmap_offset(i), v.data(),
+                                       v.size() * sizeof(bitmap_type)))
+                return err;
+            for (std::size_t j = 0; j < v.size(); j++)
+            {
+                groups_[i + j].reset(v[j]);
+                range.offset += groups_[i + j].size();
+            }
+        }
+        return std::error_condition();
+    }
+
+    std::error_condition write_bitmaps(File const &file,
+                                       Range const &range) const
+    {
+        std::vector<bitmap_type> v;
+        v.reserve(1024 * 1024);
+        for (auto i = range.first; i < range.last; i += v.size())
+        {
+            v.resize(std::min(v.capacity(), range.last - i));
+            for (std::size_t j = 0; j < v.size(); j++)
+                v[j] = groups_[i + j].bitmap();
+            if (auto err = file.WriteAt(bitmap_offset(i), v.data(),
+                                        v.size() * sizeof(bitmap_type)))
+                return err;
+        }
+        return std::error_condition();
+    }
+
+    // Calls transfer(offset, vectors) for the payloads of the range, IOV_MAX
+    // groups at a time, then done(first, last) with the groups transferred.
+    template <class Transfer, class Done = NoOp>
+    std::error_condition transfer_payloads(Range const &range,
+                                           Transfer transfer,
+                                           Done done = Done()) const
+    {
+        std::vector<FileVector> fv;
+        fv.reserve(1024);
+        auto offset = range.offset;
+        std::uint64_t length = 0;
+        auto batch = range.first;
+        for (auto i = range.first; i < range.last; i++)
+        {
+            if (!groups_[i].size())
+                continue;
+            fv.emplace_back(groups_[i].ptr(), groups_[i].size());
+            length += groups_[i].size();
+            if (fv.size() == fv.capacity())
+            {
+                if (auto err = transfer(offset, fv))
+                    return err;
+                done(batch, i + 1);
+                batch = i + 1;
+                offset += length;
+                length = 0;
+                fv.resize(0);
+            }
+        }
+        if (auto err = transfer(offset, fv))
+            return err;
+        done(batch, range.last);
+        return std::error_condition();
+    }
+
+    IndexHeader compressed_header() const
+    {
+        return IndexHeader::make(
+            size_, groups_.size(), sizeof(bitmap_type),
+            IndexHeader::LZ_BLOCKS |
+                (delta_codable<value_type>::value ? IndexHeader::DELTA_VALUES
+                                                  : 0));
+    }
+
+    // Offset of the first block of a file with the given number of chunks.
+    static std::uint64_t block_offset(std::size_t const chunks)
+    {
+        return sizeof(IndexHeader) + chunks * sizeof(BlockEntry);
+    }
+
+    std::error_condition read_entries(File const &file,
+                                      std::vector<BlockEntry> &entries) const
+    {
+        entries.resize(IndexHeader::num_chunks(groups_.size()));
+        return file.ReadAt(sizeof(IndexHeader), entries.data(),
+                           entries.size() * sizeof(BlockEntry));
+    }
+
+    std::error_condition write_entries(
+        File const &file, std::vector<BlockEntry> const &entries) const
+    {
+        return file.WriteAt(sizeof(IndexHeader), entries.data(),
+                            entries.size() * sizeof(BlockEntry));
+    }
+
+    // Reads a file from write_compressed once its header has been read.
+    std::error_condition read_compressed(File const &file,
+                                         IndexHeader const &header)
+    {
+        std::vector<BlockEntry> entries;
+        if (auto err = read_entries(file, entries))
+            return err;
+        return read_blocks(file, header, Range{0, groups_.size(), 0},
+                           entries);
+    }
+
+    // Space for a block's bitmaps or payloads before compression and for
+    // the stored blocks, reused from one block to the next.
+    struct BlockBuffers
+    {
+        std::vector<std::uint8_t> plain;
+        std::vector<std::uint8_t> stored;
+    };
+
+    // Appends the blocks of the chunks of the range, which must start on a
+    // chunk boundary, to buffers.stored and fills in their entries, with
+    // offsets from base at the start of the buffer.
+    void compress_range(Range const &range, std::uint64_t const base,
+                        std::vector<BlockEntry> &entries,
+                        BlockBuffers &buffers) const
+    {
+        auto &plain = buffers.plain;
+        for (auto first = range.first; first < range.last;
+             first += IndexHeader::CHUNK_GROUPS)
+        {
+            auto const last = std::min<std::size_t>(
+                first + IndexHeader::CHUNK_GROUPS, range.last);
+            auto &entry = entries[first / IndexHeader::CHUNK_GROUPS];
+            entry.offset = base + buffers.stored.size();
+            plain.resize((last - first) * sizeof(bitmap_type));
+            for (auto i = first; i < last; i++)
+                std::memcpy(plain.data() + (i - first) * sizeof(bitmap_type),
+                            bitmap_words(groups_[i].bitmap()),
+                            sizeof(bitmap_type));
+            entry.bitmapBytes =
+                append_block(plain.data(), plain.size(), buffers.stored);
+            plain.resize(delta_bound<value_type>(
+                payload_size(Range{first, last, 0}) / sizeof(value_type)));
+            auto const end = encode_payloads(first, last, plain.data(),
+                                             delta_codable<value_type>());
+            entry.encodedBytes = static_cast<std::uint32_t>(end - plain.data());
+            entry.payloadBytes =
+                append_block(plain.data(), entry.encodedBytes, buffers.stored);
+            entry.crc = 0;
+            for (auto i = first; i < last; i++)
+                entry.crc =
+                    IndexHeader::add_group(entry.crc, group_checksum(i));
+        }
+    }
+
+    // Appends length bytes from data to stored, compressed if that makes
+    // them smaller, and returns the number of bytes appended.
+    static std::uint32_t append_block(const std::uint8_t *data,
+                                      std::size_t const length,
+                                      std::vector<std::uint8_t> &stored)
+    {
+        auto const at = stored.size();
+        stored.resize(at + lz_bound(length));
+        auto size = lz_compress(data, length, stored.data() + at);
+        if (size >= length)
+        {
+            std::memcpy(stored.data() + at, data, length);
+            size = length;
+        }
+        stored.resize(at + size);
+        return static_cast<std::uint32_t>(size);
+    }
+
+    // Returns the plainLength bytes that the length bytes at data hold,
+    // which are data itself when stored uncompressed, or null if they are
+    // not a valid block.
+    static const std::uint8_t *expand(const std::uint8_t *data,
+                                      std::size_t const length,
+                                      std::size_t const plainLength,
+                                      std::vector<std::uint8_t> &plain)
+    {
+        if (length == plainLength)
+            return data;
+        plain.resize(plainLength);
+        if (!lz_decompress(data, length, plain.data(), plainLength))
+            return nullptr;
+        return plain.data();
+    }
+
+    // Reads, decompresses and checks the blocks of the chunks of the range,
+    // which must start on a chunk boundary, into its groups.
+    std::error_condition read_blocks(File const &file,
+                                     IndexHeader const &header,
+                                     Range const &range,
+                                     std::vector<BlockEntry> const &entries)
+    {
+        auto const corrupt = make_error_condition(db_error::corrupt_file);
+        BlockBuffers buffers;
+        for (auto first = range.first; first < range.last;
+             first += IndexHeader::CHUNK_GROUPS)
+        {
+            auto const last = std::min<std::size_t>(
+                first + IndexHeader::CHUNK_GROUPS, range.last);
+            auto const &entry = entries[first / IndexHeader::CHUNK_GROUPS];
+            auto const bitmapBytes = (last - first) * sizeof(bitmap_type);
+            if (entry.bitmapBytes > bitmapBytes ||
+                entry.payloadBytes > entry.encodedBytes ||
+                entry.encodedBytes >
+                    delta_bound<value_type>((last - first) * T::SIZE))
+                return corrupt;
+            auto &stored = buffers.stored;
+            stored.resize(entry.bitmapBytes + entry.payloadBytes);
+            if (auto err =
+                    file.ReadAt(entry.offset, stored.data(), stored.size()))
+                return err;
+            auto const bitmaps = expand(stored.data(), entry.bitmapBytes,
+                                        bitmapBytes, buffers.plain);
+            if (!bitmaps)
+                return corrupt;
+            for (auto i = first; i < last; i++)
+            {
+                bitmap_type bitmap;
+                std::memcpy(bitmap_words(bitmap),
+                            bitmaps + (i - first) * sizeof(bitmap_type),
+                            sizeof(bitmap_type));
+                groups_[i].reset(bitmap);
+            }
+            auto const payloads =
+                expand(stored.data() + entry.bitmapBytes, entry.payloadBytes,
+                       entry.encodedBytes, buffers.plain);
+            if (!payloads ||
+                !decode_payloads(first, last, payloads,
+                                 payloads + entry.encodedBytes,
+                                 header.flags & IndexHeader::DELTA_VALUES))
+                return corrupt;
+            std::uint32_t crc = 0;
+            for (auto i = first; i < last; i++)
+                crc = IndexHeader::add_group(crc, group_checksum(i));
+            if (crc != entry.crc)
+                return corrupt;
+        }
+        return std::error_condition();
+    }
+
+    std::uint8_t *encode_payloads(std::size_t const first,
+                                  std::size_t const last, std::uint8_t *out,
+                                  std::true_type) const
+    {
+        auto previous = value_type();
+        for (auto i = first; i < last; i++)
+            out = delta_encode(groups_[i].ptr(), groups_[i].num_nonempty(),
+                               previous, out);
+        return out;
+    }
+
+    std::uint8_t *encode_payloads(std::size_t const first,
+                                  std::size_t const last, std::uint8_t *out,
+                                  std::false_type) const
+    {
+        for (auto i = first; i < last; i++)
+        {
+            std::memcpy(out, groups_[i].ptr(), groups_[i].size());
+            out += groups_[i].size();
+        }
+        return out;
+    }
+
+    // Fills in the payloads of the groups from first to last from [in,
+    // end), which must hold exactly those payloads. Returns false if not.
+    bool decode_payloads(std::size_t const first, std::size_t const last,
+                         const std::uint8_t *in, const std::uint8_t *end,
+                         bool const delta)
+    {
+        if (delta)
+            return decode_deltas(first, last, in, end,
+                                 delta_codable<value_type>());
+        for (auto i = first; i < last; i++)
+        {
+            auto const size = groups_[i].size();
+            if (size > std::size_t(end - in))
+                return false;
+            std::memcpy(groups_[i].ptr(), in, size);
+            in += size;
+        }
+        return in == end;
+    }
+
+    bool decode_deltas(std::size_t const first, std::size_t const last,
+                       const std::uint8_t *in, const std::uint8_t *end,
+                       std::true_type)
+    {
+        auto previous = value_type();
+        for (auto i = first; in && i < last; i++)
+            in = delta_decode(in, end, groups_[i].ptr(),
+                              groups_[i].num_nonempty(), previous);
+        return in == end;
+    }
+
+    // A file can only have delta encoded payloads of integers.
+    bool decode_deltas(std::size_t, std::size_t, const std::uint8_t *,
+                       const std::uint8_t *, std::false_type)
+    {
+        return false;
+    }
+
+    enum
+    {
+        BITMAP_WORDS = sizeof(bitmap_type) / sizeof(std::uint64_t)
+    };
+
+    // Copies the bitmaps of count groups from first into words.
+    void gather_bitmaps(std::size_t const first, std::size_t const count,
+                        std::uint64_t *words) const
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            auto const w = bitmap_words(groups_[first + i].bitmap());
+            std::copy(w, w + BITMAP_WORDS, words + i * BITMAP_WORDS);
+        }
+    }
+
+    template <SetOp OP>
+    static std::size_t combine_count(SparseIndex const &a,
+                                     SparseIndex const &b)
+    {
+        assert(a.size() == b.size());
+        std::uint64_t wa[SET_BLOCK_GROUPS * BITMAP_WORDS];
+        std::uint64_t wb[SET_BLOCK_GROUPS * BITMAP_WORDS];
+        std::size_t count = 0;
+        for (std::size_t first = 0; first < a.groups_.size();
+             first += SET_BLOCK_GROUPS)
+        {
+            auto const n = std::min<std::size_t>(SET_BLOCK_GROUPS,
+                                                 a.groups_.size() - first);
+            a.gather_bitmaps(first, n, wa);
+            b.gather_bitmaps(first, n, wb);
+            count += bitmap_combine<OP>(wa, wb, nullptr, n * BITMAP_WORDS);
+        }
+        return count;
+    }
+
+    template <SetOp OP, class Merge>
+    void combine(SparseIndex const &a, SparseIndex const &b, Merge merge)
+    {
+        assert(a.size() == size_ && b.size() == size_);
+        std::uint64_t wa[SET_BLOCK_GROUPS * BITMAP_WORDS];
+        std::uint64_t wb[SET_BLOCK_GROUPS * BITMAP_WORDS];
+        std::uint64_t wr[SET_BLOCK_GROUPS * BITMAP_WORDS];
+        value_type values[T::SIZE];
+        for (std::size_t first = 0; first < groups_.size();
+             first += SET_BLOCK_GROUPS)
+        {
+            auto const n = std::min<std::size_t>(SET_BLOCK_GROUPS,
+                                                 groups_.size() - first);
+            a.gather_bitmaps(first, n, wa);
+            b.gather_bitmaps(first, n, wb);
+            bitmap_combine<OP>(wa, wb, wr, n * BITMAP_WORDS);
+            for (std::size_t i = 0; i < n; i++)
+            {
+                auto const group = first + i;
+                bitmap_type bits;
+                std::copy(wr + i * BITMAP_WORDS, wr + (i + 1) * BITMAP_WORDS,
+                          bitmap_words(bits));
+                if (!bitmap_any(bits))
+                {
+                    if (bitmap_any(groups_[group].bitmap()))
+                    {
+                        unshare(group);
+                        groups_[group].clear();
+                    }
+                    continue;
+                }
+                // Built in a buffer first, as the group may be one of a and
+                // b.
+                auto const &ga = a.groups_[group];
+                auto const &gb = b.groups_[group];
+                auto const va = ga.values();
+                auto const vb = gb.values();
+                std::size_t k = 0;
+                for (auto rest = bits; bitmap_any(rest);
+                     bitmap_clear_first(rest))
+                {
+                    auto const pos = bitmap_first(rest);
+                    auto const inA = bitmap_test(ga.bitmap(), pos);
+                    auto const inB = bitmap_test(gb.bitmap(), pos);
+                    auto const ra = inA ? bitmap_rank(ga.bitmap(), pos) : 0;
+                    auto const rb = inB ? bitmap_rank(gb.bitmap(), pos) : 0;
+                    values[k++] = inA && inB ? merge(va[ra], vb[rb])
+                                  : inA      ? va[ra]
+                                             : vb[rb];
+                }
+                unshare(group);
+                groups_[group].assign(bits, values);
+            }
+        }
+        rankValid_ = false;
     }
 
-   private:
     std::size_t group_for_pos(std::size_t const pos) const
     {
         assert(pos < size_);
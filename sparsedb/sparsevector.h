@@ -3,44 +3,66 @@
 #include <cstddef>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
 #include <sstream>
 #include <system_error>
 #include <iostream>
 #include <iterator>
 #include <iomanip>
 #include "file.h"
+#include "allocator.h"
+#include "bitmap.h"
 
 #ifdef __MSC_VER
-#include <nmmintrin.h>
-#define __builtin_popcountll _mm_popcnt_u64
+#define __builtin_prefetch(p) \
+    _mm_prefetch(reinterpret_cast<const char *>(p), _MM_HINT_T0)
 #endif
 namespace sparsedb
 {
-// A simple append only vector that can contain up to 64 integral values and
-// that reallocates memory exactly as required.
-template <class T>
+// A simple vector that can contain up to N integral values and that
+// reallocates memory exactly as required on insert. Erase leaves a little
+// slack behind before shrinking, see erase(). Memory is obtained from the
+// Allocator policy, see allocator.h. Groups of up to INLINE_SIZE values
+// are stored in place of the pointer and allocate nothing.
+//
+// N is the group width, a multiple of 64. Wider groups amortise the pointer
+// over more positions at the cost of a longer bitmap to count through on
+// every access, see bitmap.h.
+template <class T, std::size_t N = 64, class Allocator = SlabAllocator<T, N>>
 class SparseVector
 {
     static_assert(std::is_integral<T>::value, "T must be an integer type");
 
-    std::uint64_t bitmap_ = 0;
-    T *p_ = nullptr;
-
    public:
     using return_type = std::pair<T, bool>;
-    using bitmap_type = std::uint64_t;
+    using bitmap_type = typename BitmapFor<N>::type;
     using value_type = T;
+    using values_type = const T *;
+    using allocator_type = Allocator;
 
     enum
     {
-        SIZE = 64,
-        MAX_POS = SIZE - 1
+        SIZE = N,
+        MAX_POS = SIZE - 1,
+        SLACK_MASK = 7,
+        // Values that fit in the space of the pointer.
+        INLINE_SIZE = sizeof(std::uintptr_t) / sizeof(T)
     };
 
-    SparseVector(const bitmap_type bitmap = 0) : bitmap_(bitmap)
+   private:
+    bitmap_type bitmap_ = bitmap_type();
+    // Holds the values themselves while there are no more than INLINE_SIZE,
+    // so that get() needs no second load. Otherwise points to the values.
+    // As allocations are at least 8 byte aligned, the low bits of the
+    // pointer hold the number of spare pairs of values left by erase.
+    union
     {
-        resize(num_nonempty());
-    }
+        std::uintptr_t p_ = 0;
+        T values_[INLINE_SIZE > 0 ? INLINE_SIZE : 1];
+    };
+
+   public:
+    SparseVector(const bitmap_type &bitmap = bitmap_type()) { reset(bitmap); }
 
     // TODO: Is this correct?
     SparseVector(const SparseVector &sv)
@@ -53,86 +75,185 @@ class SparseVector
 
     ~SparseVector()
     {
-        std::free(p_);
-        p_ = nullptr;
+        if (!is_inline())
+            Allocator::deallocate(heap_ptr(), capacity());
+        p_ = 0;
     }
 
     std::size_t max_size() const { return SIZE; }
-    std::size_t num_nonempty() const { return __builtin_popcountll(bitmap_); }
-    std::uint64_t bitmap() const { return bitmap_; }
-    T *ptr() const { return p_; }
+    std::size_t num_nonempty() const { return bitmap_count(bitmap_); }
+    bitmap_type const &bitmap() const { return bitmap_; }
+    T *ptr() const
+    {
+        return is_inline() ? const_cast<T *>(values_) : heap_ptr();
+    }
     std::size_t size() const { return num_nonempty() * sizeof(T); }
 
-    void clear()
+    // Number of values the current storage can hold.
+    std::size_t capacity() const
     {
-        resize(0);
-        bitmap_ = 0;
+        if (is_inline())
+            return INLINE_SIZE;
+        return round_size(num_nonempty()) + 2 * (p_ & SLACK_MASK);
     }
 
-    void resize(std::size_t const newSize)
+    // True if the values are stored in place of the pointer.
+    bool is_inline() const { return num_nonempty() <= INLINE_SIZE; }
+
+    void clear() { reset(bitmap_type()); }
+
+    // Replaces the bitmap and sizes the payload to match, leaving the values
+    // uninitialised so that they can be filled in through ptr().
+    void reset(bitmap_type const &bitmap)
     {
-        auto rounded = (newSize % 2 == 0) ? newSize : newSize + 1;
-        if (!rounded)
-        {
-            std::free(p_);
-            p_ = nullptr;
-        }
-        else
-        {
-            void *mem = std::realloc(p_, rounded * sizeof(T));
-            if (!mem)
-                throw std::bad_alloc();
-            p_ = static_cast<T *>(mem);
-        }
+        auto const count = bitmap_count(bitmap);
+        auto const capacity = count <= INLINE_SIZE ? 0 : round_size(count);
+        auto p = is_inline() ? nullptr : heap_ptr();
+        p = Allocator::reallocate(p, p ? this->capacity() : 0, capacity);
+        bitmap_ = bitmap;
+        p_ = 0;
+        if (p)
+            set_ptr(p, capacity);
+    }
+
+    // Replaces the contents with the values for the positions set in
+    // bitmap, in ascending order of position.
+    void assign(bitmap_type const &bitmap, T const *values)
+    {
+        reset(bitmap);
+        std::memcpy(ptr(), values, size());
+    }
+
+    // Read access to the values in ascending order of position, indexed by
+    // offset among the occupied positions.
+    values_type values() const { return ptr(); }
+
+    // Forgets the payload without freeing it, leaving the group empty. For
+    // when the payload has been handed to a shallow copy of the group.
+    void release()
+    {
+        bitmap_ = bitmap_type();
+        p_ = 0;
     }
 
     bool has(std::size_t const pos) const
     {
         assert(pos <= MAX_POS);
-        return bitmap_ & (1ULL << pos);
+        return bitmap_test(bitmap_, pos);
     }
 
     // Inserts a new value at pos. Return the previous value and true if one
-    // exists. Position must be less than 64.
+    // exists. Position must be less than SIZE.
     return_type insert(std::size_t const pos, T const value)
     {
         assert(pos <= MAX_POS);
         auto exists = has(pos);
         auto offset = get_offset(pos);
+        auto p = ptr();
         T previous = 0;
         if (exists)
         {
-            previous = p_[offset];
+            previous = p[offset];
         }
         else
         {
             auto count = num_nonempty();
-            if (count % 2 == 0)
-                resize(count + 2);
-            if (count > 0)
+            if (count < INLINE_SIZE)
+            {
+                std::memmove(p + offset + 1, p + offset,
+                             (count - offset) * sizeof(T));
+                set_pos(pos);
+            }
+            else if (count == INLINE_SIZE)
+            {
+                // Move the inline values out to the heap.
+                p = Allocator::allocate(round_size(count + 1));
+                std::memcpy(p, values_, offset * sizeof(T));
+                std::memcpy(p + offset + 1, values_ + offset,
+                            (count - offset) * sizeof(T));
+                set_pos(pos);
+                set_ptr(p, round_size(count + 1));
+            }
+            else
+            {
+                auto capacity = this->capacity();
+                if (count == capacity)
+                {
+                    capacity += 2;
+                    p = Allocator::reallocate(p, count, capacity);
+                }
                 // faster than
                 // std::copy_backward(p + offset, p + count, p + count + 1);
                 for (std::size_t i = count; i > offset; i--)
-                    std::memcpy(p_ + i, p_ + i - 1, sizeof(T));
-            set_pos(pos);
+                    std::memcpy(p + i, p + i - 1, sizeof(T));
+                set_pos(pos);
+                set_ptr(p, capacity);
+            }
         }
-        p_[offset] = value;
-        return return_type{exists, previous};
+        p[offset] = value;
+        return return_type{previous, exists};
+    }
+
+    // Removes the value at pos. Return the previous value and true if one
+    // existed. Position must be less than SIZE. The allocation is only
+    // shrunk once more than max(2, size / 4) slots are spare, so that
+    // alternating inserts and erases do not reallocate every time, unless
+    // the remaining values fit inline.
+    return_type erase(std::size_t const pos)
+    {
+        assert(pos <= MAX_POS);
+        if (!has(pos))
+            return return_type{0, false};
+        auto const offset = get_offset(pos);
+        auto const count = num_nonempty();
+        auto const capacity = this->capacity();
+        auto p = ptr();
+        T previous = p[offset];
+        std::memmove(p + offset, p + offset + 1,
+                     (count - offset - 1) * sizeof(T));
+        bitmap_reset(bitmap_, pos);
+        if (count <= INLINE_SIZE)
+            return return_type{previous, true};
+        if (count - 1 <= INLINE_SIZE)
+        {
+            // Move the remaining values back inline.
+            p_ = 0;
+            std::memcpy(values_, p, (count - 1) * sizeof(T));
+            Allocator::deallocate(p, capacity);
+            return return_type{previous, true};
+        }
+        auto const target = round_size(count - 1);
+        auto const spare = std::min<std::size_t>(
+            2 * SLACK_MASK, std::max<std::size_t>(2, target / 4));
+        if (capacity - target > spare)
+            set_ptr(Allocator::reallocate(p, capacity, target), target);
+        else
+            set_ptr(p, capacity);
+        return return_type{previous, true};
+    }
+
+    // Hints the cache to load the value slot for pos, if it is occupied.
+    void prefetch(std::size_t const pos) const
+    {
+        assert(pos <= MAX_POS);
+        // Inline values share the cache line of the bitmap.
+        if (has(pos) && !is_inline())
+            __builtin_prefetch(heap_ptr() + get_offset(pos));
     }
 
     // If pos is occupied return value and true, otherwise return 0 and
-    // false. Position must be less than 64.
+    // false. Position must be less than SIZE.
     return_type get(std::size_t const pos) const
     {
         assert(pos <= MAX_POS);
         if (has(pos))
-            return return_type{p_[get_offset(pos)], true};
+            return return_type{ptr()[get_offset(pos)], true};
         return return_type{0, false};
     }
 
-    bool operator==(SparseVector<T> const &rhs) const
+    bool operator==(SparseVector const &rhs) const
     {
-        return num_nonempty() == rhs.num_nonempty() && size() == rhs.size() &&
+        return bitmap_ == rhs.bitmap_ && size() == rhs.size() &&
                std::memcmp(ptr(), rhs.ptr(), size()) == 0;
     }
 
@@ -144,7 +265,7 @@ class SparseVector
         for (std::size_t i = 0; i <= MAX_POS; i++)
         {
             if (has(i))
-                ss << std::to_string(p_[get_offset(i)]);
+                ss << std::to_string(ptr()[get_offset(i)]);
             else
                 ss << "-";
             if (i < MAX_POS)
@@ -155,12 +276,34 @@ class SparseVector
     }
 
    private:
-    void set_pos(std::size_t const pos) { bitmap_ |= 1ULL << pos; }
+    void set_pos(std::size_t const pos) { bitmap_set(bitmap_, pos); }
+
+    T *heap_ptr() const
+    {
+        return reinterpret_cast<T *>(p_ & ~std::uintptr_t(SLACK_MASK));
+    }
+
+    // Stores p, which holds capacity values, along with the slack between
+    // capacity and the size the current bitmap needs.
+    void set_ptr(T *p, std::size_t const capacity)
+    {
+        auto const bits = reinterpret_cast<std::uintptr_t>(p);
+        assert(!(bits & SLACK_MASK));
+        if (!p)
+            p_ = 0;
+        else
+            p_ = bits | (capacity - round_size(num_nonempty())) / 2;
+        assert(!p || this->capacity() == capacity);
+    }
+
+    static std::size_t round_size(std::size_t const size)
+    {
+        return (size % 2 == 0) ? size : size + 1;
+    }
 
     std::size_t get_offset(std::size_t const pos) const
     {
-        std::uint64_t mask = (1ULL << pos) - 1ULL;
-        return __builtin_popcountll(bitmap_ & mask);
+        return bitmap_rank(bitmap_, pos);
     }
 };
 }  // namespace sparsedb
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "crc32c.h"
+#include "file.h"
+#include "sparseindex.h"
+#include "sparsevector.h"
+
+namespace sparsedb
+{
+// Maps fixed length keys to variable length values. Values are appended to
+// a log file and the index holds, for each key, where its latest value is
+// in the log, so that get() is one index lookup and one pread. A key of
+// keyLength bytes is read as a big endian integer to give its position in
+// the index, which therefore has 2^(8 * keyLength) positions.
+//
+// The index allocates a group header for every 64 positions up front, so
+// an empty store already takes index_bytes(keyLength) of memory: 16KiB
+// for two byte keys, 4MiB for three and 1GiB for four.
+//
+// Each log record is a header of a CRC-32C and the value length, then the
+// key and the value. A record with no value erases the key. open()
+// rebuilds the index by scanning the log, cutting off a torn record at the
+// end. A damaged record followed by a valid one is not a torn write, so
+// open() then fails with corrupt_file and leaves the log alone.
+// Overwritten values stay in the log, which can grow to 2^OFFSET_BITS
+// bytes before put() fails with log_full. If a failed write cannot be cut
+// off the log, every later put() and erase() fails with the truncate error
+// until the next open().
+class Store
+{
+   public:
+    using Group = SparseVector<std::uint64_t>;
+    using Index = SparseIndex<Group>;
+
+    enum
+    {
+        // Keys index every position, so their width bounds the index size,
+        // see index_bytes.
+        MAX_KEY_LENGTH = 4,
+        // Index entries pack the value's offset in the log above its length.
+        LENGTH_BITS = 24,
+        MAX_VALUE_LENGTH = (1 << LENGTH_BITS) - 1,
+        // Bits left for the offset.
+        OFFSET_BITS = 64 - LENGTH_BITS,
+        // Bytes read at a time by open().
+        SCAN_BYTES = 1 << 20
+    };
+
+   private:
+    struct Header
+    {
+        // CRC-32C of the length, the key and the value.
+        std::uint32_t crc;
+        std::uint32_t length;
+    };
+
+    File file_;
+    std::size_t keyLength_;
+    Index index_;
+    // End of the last complete record.
+    std::uint64_t end_ = 0;
+    // Set if a failed append could not be cut off, so that no later record
+    // follows the partial one.
+    std::error_condition failed_;
+    std::vector<char> buffer_;
+
+   public:
+    Store(std::string const &filename, std::size_t const keyLength)
+        : file_(filename),
+          keyLength_(keyLength),
+          index_(1ULL << (8 * keyLength))
+    {
+        assert(keyLength > 0 && keyLength <= MAX_KEY_LENGTH);
+    }
+
+    Store(const Store &) = delete;
+    Store &operator=(const Store &) = delete;
+
+    // Opens the log and rebuilds the index from it.
+    std::error_condition open()
+    {
+        if (auto err = file_.OpenAppend())
+            return err;
+        index_.clear();
+        end_ = 0;
+        failed_ = std::error_condition();
+        std::uint64_t size;
+        if (auto err = file_.Size(size))
+            return err;
+        std::vector<char> scan;
+        std::uint64_t scanOffset = 0;
+        for (;;)
+        {
+            const char *record;
+            if (auto err = fetch(scan, scanOffset, size, record))
+                return err;
+            if (!record)
+                break;
+            Header h;
+            std::memcpy(&h, record, sizeof(h));
+            auto const length = record_length(record);
+            if (h.length > MAX_VALUE_LENGTH || h.crc != checksum(record))
+            {
+                bool followed;
+                if (auto err = valid_record(end_ + length, size, followed))
+                    return err;
+                if (followed)
+                    return make_error_condition(db_error::corrupt_file);
+                break;
+            }
+            auto const pos = position(record + sizeof(Header));
+            if (h.length)
+                index_.insert(pos, entry(end_ + sizeof(Header) + keyLength_,
+                                         h.length));
+            else
+                index_.erase(pos);
+            end_ += length;
+        }
+        if (end_ != size)
+            return file_.Truncate(end_);
+        return std::error_condition();
+    }
+
+    std::error_condition close() { return file_.Close(); }
+
+    // Flushes every put and erase so far to disk.
+    std::error_condition sync() { return file_.Sync(); }
+
+    std::error_condition put(std::string const &key, std::string const &value)
+    {
+        if (key.size() != keyLength_)
+            return make_error_condition(db_error::key_wrong_length);
+        if (value.empty())
+            return make_error_condition(db_error::zero_length_value);
+        if (value.size() > MAX_VALUE_LENGTH)
+            return make_error_condition(db_error::value_too_long);
+        // The offset of every value must fit in its index entry.
+        if (end_ + sizeof(Header) + key.size() + value.size() >=
+            1ULL << OFFSET_BITS)
+            return make_error_condition(db_error::log_full);
+        if (auto err = append(key, value))
+            return err;
+        index_.insert(position(key.data()),
+                      entry(end_ - value.size(), value.size()));
+        return std::error_condition();
+    }
+
+    std::error_condition get(std::string const &key, std::string &value) const
+    {
+        if (key.size() != keyLength_)
+            return make_error_condition(db_error::key_wrong_length);
+        auto const result = index_.get(position(key.data()));
+        if (!result.second)
+            return make_error_condition(db_error::key_not_found);
+        value.resize(result.first & MAX_VALUE_LENGTH);
+        return file_.ReadAt(result.first >> LENGTH_BITS, &value[0],
+                            value.size());
+    }
+
+    std::error_condition erase(std::string const &key)
+    {
+        if (key.size() != keyLength_)
+            return make_error_condition(db_error::key_wrong_length);
+        auto const pos = position(key.data());
+        if (!index_.has(pos))
+            return make_error_condition(db_error::key_not_found);
+        if (auto err = append(key, std::string()))
+            return err;
+        index_.erase(pos);
+        return std::error_condition();
+    }
+
+    std::size_t num_keys() const { return index_.num_nonempty(); }
+
+    // Memory the index of an empty store takes for keys of keyLength bytes.
+    static std::uint64_t index_bytes(std::size_t const keyLength)
+    {
+        return (1ULL << (8 * keyLength)) / Group::SIZE * sizeof(Group);
+    }
+
+    // Bytes in the log, including overwritten values.
+    std::uint64_t log_size() const { return end_; }
+
+    Index const &index() const { return index_; }
+
+   private:
+    // Writes a record with a single write.
+    std::error_condition append(std::string const &key,
+                                std::string const &value)
+    {
+        if (failed_)
+            return failed_;
+        Header h{0, static_cast<std::uint32_t>(value.size())};
+        buffer_.resize(sizeof(Header) + key.size() + value.size());
+        auto p = buffer_.data();
+        std::memcpy(p, &h, sizeof(h));
+        std::memcpy(p + sizeof(Header), key.data(), key.size());
+        std::memcpy(p + sizeof(Header) + key.size(), value.data(),
+                    value.size());
+        h.crc = checksum(p);
+        std::memcpy(p, &h, sizeof(h));
+        if (auto err = file_.Write(buffer_))
+        {
+            // Leave no partial record for the next one to follow.
+            failed_ = file_.Truncate(end_);
+            return err;
+        }
+        end_ += buffer_.size();
+        return std::error_condition();
+    }
+
+    // Points record at the record at end_, reading the log from there into
+    // scan unless scan, which holds the log from scanOffset, already has
+    // all of it. Sets record to null if the log ends part way through it.
+    std::error_condition fetch(std::vector<char> &scan,
+                               std::uint64_t &scanOffset,
+                               std::uint64_t const size, const char *&record)
+    {
+        record = nullptr;
+        if (end_ + sizeof(Header) > size)
+            return std::error_condition();
+        auto const load = [&](std::size_t const length)
+        {
+            scan.resize(std::min<std::uint64_t>(length, size - end_));
+            scanOffset = end_;
+            return file_.ReadAt(end_, scan.data(), scan.size());
+        };
+        if (end_ + sizeof(Header) > scanOffset + scan.size())
+        {
+            if (auto err = load(SCAN_BYTES))
+                return err;
+        }
+        auto const length = record_length(scan.data() + (end_ - scanOffset));
+        if (end_ + length > size)
+            return std::error_condition();
+        if (end_ + length > scanOffset + scan.size())
+        {
+            if (auto err = load(std::max<std::size_t>(SCAN_BYTES, length)))
+                return err;
+        }
+        record = scan.data() + (end_ - scanOffset);
+        return std::error_condition();
+    }
+
+    // Sets valid to whether a whole record with a good checksum starts at
+    // offset in a log of size bytes.
+    std::error_condition valid_record(std::uint64_t const offset,
+                                      std::uint64_t const size, bool &valid)
+    {
+        valid = false;
+        if (offset + sizeof(Header) > size)
+            return std::error_condition();
+        buffer_.resize(sizeof(Header));
+        if (auto err = file_.ReadAt(offset, buffer_.data(), buffer_.size()))
+            return err;
+        Header h;
+        std::memcpy(&h, buffer_.data(), sizeof(h));
+        auto const length = record_length(buffer_.data());
+        if (h.length > MAX_VALUE_LENGTH || offset + length > size)
+            return std::error_condition();
+        buffer_.resize(length);
+        if (auto err = file_.ReadAt(offset, buffer_.data(), length))
+            return err;
+        valid = h.crc == checksum(buffer_.data());
+        return std::error_condition();
+    }
+
+    std::size_t record_length(const char *record) const
+    {
+        Header h;
+        std::memcpy(&h, record, sizeof(h));
+        return sizeof(Header) + keyLength_ + h.length;
+    }
+
+    // Checksum of a record from its length field on.
+    std::uint32_t checksum(const char *record) const
+    {
+        return crc32c(record + sizeof(std::uint32_t),
+                      record_length(record) - sizeof(std::uint32_t));
+    }
+
+    std::size_t position(const char *key) const
+    {
+        std::size_t pos = 0;
+        for (std::size_t i = 0; i < keyLength_; i++)
+            pos = (pos << 8) | static_cast<std::uint8_t>(key[i]);
+        return pos;
+    }
+
+    static std::uint64_t entry(std::uint64_t const offset,
+                               std::size_t const length)
+    {
+        return (offset << LENGTH_BITS) | length;
+    }
+};
+}  // namespace sparsedb
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace sparsedb
+{
+// A fixed set of worker threads that run submitted tasks in FIFO order.
+class ThreadPool
+{
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::size_t active_ = 0;
+    bool stop_ = false;
+
+   public:
+    explicit ThreadPool(std::size_t const threads)
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++)
+            threads_.emplace_back([this]()
+                                  {
+                run();
+            });
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &t : threads_) t.join();
+    }
+
+    std::size_t size() const { return threads_.size(); }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    // Blocks until every submitted task has finished.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]()
+                   {
+            return tasks_.empty() && !active_;
+        });
+    }
+
+    // Runs fn(i) for every i in [0, count) and waits for them all. Returns
+    // the first error reported by any call.
+    template <class Fn>
+    std::error_condition run_all(std::size_t const count, Fn fn)
+    {
+        std::mutex mutex;
+        std::error_condition first;
+        for (std::size_t i = 0; i < count; i++)
+            submit([&, i]()
+                   {
+                auto err = fn(i);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (err && !first)
+                    first = err;
+            });
+        wait();
+        return first;
+    }
+
+   private:
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this]()
+                           {
+                    return stop_ || !tasks_.empty();
+                });
+                if (tasks_.empty())
+                    return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+                active_++;
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                active_--;
+                if (tasks_.empty() && !active_)
+                    idle_.notify_all();
+            }
+        }
+    }
+};
+}  // namespace sparsedb
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "file.h"
+
+namespace sparsedb
+{
+// A File that can also queue vectored reads and writes at known offsets on
+// an io_uring, keeping up to queueDepth of them in flight. Submissions are
+// handed to the kernel in batches and complete asynchronously; Wait()
+// collects them all. The memory described by the vectors must stay valid
+// until Wait() returns.
+//
+// If io_uring is unavailable, or queueDepth is zero, the queued operations
+// fall back to synchronous preadv/pwritev.
+class UringFile : public File
+{
+    // Storage for the iovecs of an operation until it completes.
+    struct Slot
+    {
+        std::vector<FileVector> vectors;
+        std::size_t length = 0;
+        db_error error = db_error::short_read;
+    };
+
+    std::int32_t ringFd_ = -1;
+    std::size_t depth_ = 0;
+    std::size_t inFlight_ = 0;
+    std::size_t unsubmitted_ = 0;
+    std::vector<Slot> slots_;
+    std::vector<std::size_t> freeSlots_;
+    std::error_condition error_;
+
+    void *sqRing_ = nullptr;
+    std::size_t sqRingSize_ = 0;
+    void *cqRing_ = nullptr;
+    std::size_t cqRingSize_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    std::size_t sqesSize_ = 0;
+
+    unsigned *sqTail_ = nullptr;
+    unsigned *sqMask_ = nullptr;
+    unsigned *sqArray_ = nullptr;
+    unsigned *cqHead_ = nullptr;
+    unsigned *cqTail_ = nullptr;
+    unsigned *cqMask_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+
+   public:
+    explicit UringFile(std::string const &filename,
+                       std::size_t const queueDepth = 64)
+        : File(filename)
+    {
+        if (queueDepth)
+            setup(queueDepth);
+    }
+
+    ~UringFile()
+    {
+        Wait();
+        teardown();
+    }
+
+    // True if operations are queued on an io_uring rather than executed
+    // synchronously.
+    bool Async() const { return ringFd_ >= 0; }
+
+    std::size_t QueueDepth() const { return depth_; }
+
+    std::error_condition SubmitReadVectorAt(std::uint64_t const pos,
+                                            std::vector<FileVector> const &v)
+    {
+        if (!Async())
+            return record(ReadVectorAt(pos, v));
+        return queue(IORING_OP_READV, pos, v, db_error::short_read);
+    }
+
+    std::error_condition SubmitWriteVectorAt(std::uint64_t const pos,
+                                             std::vector<FileVector> const &v)
+    {
+        if (!Async())
+            return record(WriteVectorAt(pos, v));
+        return queue(IORING_OP_WRITEV, pos, v, db_error::short_write);
+    }
+
+    // Waits for every queued operation and returns the first error seen by
+    // any of them since the previous Wait().
+    std::error_condition Wait()
+    {
+        while (Async() && inFlight_)
+        {
+            if (auto err = enter(1))
+            {
+                record(err);
+                break;
+            }
+        }
+        auto err = error_;
+        error_ = std::error_condition();
+        return err;
+    }
+
+   private:
+    std::error_condition setup(std::size_t const queueDepth)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        auto fd = ::syscall(__NR_io_uring_setup, queueDepth, &params);
+        if (fd < 0)
+            return std::generic_category().default_error_condition(errno);
+        ringFd_ = fd;
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        sqRing_ = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+        if (sqRing_ == MAP_FAILED)
+            return fail();
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cqRing_ = sqRing_;
+        else
+            cqRing_ =
+                ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED)
+            return fail();
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        auto sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return fail();
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+        auto sq = static_cast<char *>(sqRing_);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        auto cq = static_cast<char *>(cqRing_);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        depth_ = params.sq_entries;
+        slots_.resize(depth_);
+        for (std::size_t i = 0; i < depth_; i++) freeSlots_.push_back(i);
+        return std::error_condition();
+    }
+
+    std::error_condition fail()
+    {
+        auto err = std::generic_category().default_error_condition(errno);
+        teardown();
+        return err;
+    }
+
+    void teardown()
+    {
+        if (sqes_)
+            ::munmap(sqes_, sqesSize_);
+        if (cqRing_ && cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+            ::munmap(cqRing_, cqRingSize_);
+        if (sqRing_ && sqRing_ != MAP_FAILED)
+            ::munmap(sqRing_, sqRingSize_);
+        if (ringFd_ >= 0)
+            ::close(ringFd_);
+        sqes_ = nullptr;
+        sqRing_ = cqRing_ = nullptr;
+        ringFd_ = -1;
+        depth_ = 0;
+        slots_.clear();
+        freeSlots_.clear();
+    }
+
+    std::error_condition queue(std::uint8_t const opcode,
+                               std::uint64_t const pos,
+                               std::vector<FileVector> const &v,
+                               db_error const error)
+    {
+        if (!v.size())
+            return std::error_condition();
+        while (freeSlots_.empty())
+            if (auto err = enter(1))
+                return record(err);
+        auto const index = freeSlots_.back();
+        freeSlots_.pop_back();
+        auto &slot = slots_[index];
+        slot.vectors = v;
+        slot.length = 0;
+        for (auto const &fv : v) slot.length += fv.length;
+        slot.error = error;
+
+        auto const tail = *sqTail_;
+        auto const entry = tail & *sqMask_;
+        auto &sqe = sqes_[entry];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd_;
+        sqe.addr = reinterpret_cast<std::uint64_t>(slot.vectors.data());
+        sqe.len = slot.vectors.size();
+        sqe.off = pos;
+        sqe.user_data = index;
+        sqArray_[entry] = entry;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        inFlight_++;
+        unsubmitted_++;
+        // Hand the queue to the kernel once half of it has built up.
+        if (unsubmitted_ >= (depth_ + 1) / 2)
+            return record(enter(0));
+        return std::error_condition();
+    }
+
+    // Submits any queued entries and reaps completions, waiting for at
+    // least minComplete of them.
+    std::error_condition enter(unsigned const minComplete)
+    {
+        auto const submitted = unsubmitted_;
+        auto ret = ::syscall(__NR_io_uring_enter, ringFd_, submitted,
+                             minComplete,
+                             minComplete ? IORING_ENTER_GETEVENTS : 0,
+                             nullptr, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                return std::error_condition();
+            return std::generic_category().default_error_condition(errno);
+        }
+        unsubmitted_ -= ret;
+        reap();
+        return std::error_condition();
+    }
+
+    void reap()
+    {
+        auto head = *cqHead_;
+        auto const tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            auto const &cqe = cqes_[head & *cqMask_];
+            auto &slot = slots_[cqe.user_data];
+            if (cqe.res < 0)
+                record(
+                    std::generic_category().default_error_condition(-cqe.res));
+            else if (static_cast<std::size_t>(cqe.res) != slot.length)
+                record(make_error_condition(slot.error));
+            freeSlots_.push_back(cqe.user_data);
+            inFlight_--;
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    }
+
+    std::error_condition record(std::error_condition const err)
+    {
+        if (err && !error_)
+            error_ = err;
+        return err;
+    }
+};
+}  // namespace sparsedb
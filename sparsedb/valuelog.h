@@ -0,0 +1,669 @@
+#pragma once
+
+#include <dirent.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "crc32c.h"
+#include "file.h"
+#include "sparseindex.h"
+#include "sparsevector.h"
+#include "concurrentsparseindex.h"
+
+namespace sparsedb
+{
+// Settings for the garbage collector of a ValueLog.
+struct GcOptions
+{
+    // Collect a sealed segment once at least this fraction of its records
+    // have been overwritten.
+    double minGarbage = 0.5;
+    // Records whose liveness is checked with one batched lookup.
+    std::size_t batchRecords = 256;
+    // Bytes of segment read per second, or 0 for no limit. Keeps the
+    // collector's I/O from crowding out foreground reads and writes.
+    std::uint64_t bytesPerSecond = 64ULL << 20;
+    // How often the background collector looks for a segment to collect.
+    std::chrono::milliseconds interval{100};
+};
+
+struct GcStats
+{
+    std::size_t segments = 0;
+    std::size_t recordsScanned = 0;
+    std::size_t recordsMoved = 0;
+    // Moves lost to a concurrent put of the same position.
+    std::size_t casFailures = 0;
+    std::uint64_t bytesMoved = 0;
+};
+
+// An append-only log of values split into segment files, together with the
+// index from position to the value's address in the log. Values are
+// replaced by putting a new value for the same position, and the space of
+// the old value is reclaimed by the garbage collector, which copies the
+// live records of a mostly dead segment to a new segment, swaps their
+// addresses in the index with compare-and-set and deletes the old segment.
+//
+// Segments are named by appending a number to the filename. Each record is
+// a header of a CRC-32C, the value length, the position and a sequence
+// number, followed by the value. Records keep their sequence number when
+// moved, so that open() can rebuild the index from the segments in any
+// order, keeping the record with the highest sequence number for each
+// position.
+//
+// put() may be called from several threads, and get() concurrently with
+// put() and the collector.
+class ValueLog
+{
+   public:
+    using Index = ConcurrentSparseIndex<SparseVector<std::uint64_t>>;
+
+    enum
+    {
+        // Index entries pack the segment number above the offset.
+        OFFSET_BITS = 40,
+        // Bytes read by get() along with the header, so that smaller values
+        // take one pread.
+        READ_AHEAD = 4096,
+        // Lookups made by get() for a record that the collector keeps
+        // moving, after which the index entry is taken to be corrupt.
+        GET_RETRIES = 16,
+        // Bytes read at a time when scanning a segment.
+        SCAN_BYTES = 1 << 20
+    };
+
+   private:
+    struct Header
+    {
+        // CRC-32C of the rest of the header and the value.
+        std::uint32_t crc;
+        std::uint32_t length;
+        std::uint64_t pos;
+        std::uint64_t seq;
+    };
+    static_assert(sizeof(Header) == 24, "Header must not be padded");
+
+    struct Segment
+    {
+        File file;
+        std::uint64_t id;
+        // Bytes written, only changed by the segment's single writer.
+        std::atomic<std::uint64_t> end{0};
+        std::atomic<std::size_t> records{0};
+        std::atomic<std::size_t> live{0};
+        std::atomic<bool> sealed{false};
+        // Set once collected, to delete the file when the last reader lets
+        // go of the segment.
+        std::atomic<bool> obsolete{false};
+
+        Segment(std::string const &filename, std::uint64_t const id)
+            : file(filename), id(id)
+        {
+        }
+
+        ~Segment()
+        {
+            file.Close();
+            if (obsolete)
+                file.Delete();
+        }
+    };
+
+    // A record found by scan, with its value still in the scan buffer.
+    struct Record
+    {
+        Header header;
+        const char *value;
+        std::uint64_t offset;
+    };
+
+    std::string filename_;
+    std::uint64_t segmentBytes_;
+    Index index_;
+
+    // Guards the segment table. Readers hold a segment by shared_ptr so
+    // that it outlives its removal from the table.
+    mutable std::mutex segmentsMutex_;
+    std::map<std::uint64_t, std::shared_ptr<Segment>> segments_;
+    std::uint64_t nextId_ = 1;
+
+    // Serialises put(), which appends to active_.
+    std::mutex writeMutex_;
+    std::shared_ptr<Segment> active_;
+    std::atomic<std::uint64_t> nextSeq_{1};
+    std::vector<char> buffer_;
+
+    // Serialises collection, which appends to gcActive_.
+    std::mutex gcMutex_;
+    std::shared_ptr<Segment> gcActive_;
+    GcStats gcStats_;
+    GcOptions gcOptions_;
+    std::thread gcThread_;
+    std::mutex gcWaitMutex_;
+    std::condition_variable gcWait_;
+    bool gcStop_ = false;
+    // First error of the collector thread.
+    std::error_condition gcError_;
+
+   public:
+    ValueLog(std::string const &filename, std::size_t const size,
+             std::uint64_t const segmentBytes = 64ULL << 20)
+        : filename_(filename), segmentBytes_(segmentBytes), index_(size)
+    {
+    }
+
+    ValueLog(const ValueLog &) = delete;
+    ValueLog &operator=(const ValueLog &) = delete;
+
+    ~ValueLog() { stop_gc(); }
+
+    // Rebuilds the index from the segments on disk, cutting off any torn
+    // record at the end of a segment, and starts a new segment for puts.
+    std::error_condition open()
+    {
+        std::vector<std::uint64_t> ids;
+        if (auto err = list_segments(ids))
+            return err;
+        index_.clear();
+        SparseIndex<SparseVector<std::uint64_t>> seqs(index_.size());
+        std::uint64_t maxSeq = 0;
+        for (auto const id : ids)
+        {
+            auto seg = std::make_shared<Segment>(segment_file(id), id);
+            if (auto err = seg->file.Open())
+                return err;
+            segments_[id] = seg;
+            nextId_ = std::max(nextId_, id + 1);
+            std::uint64_t size;
+            if (auto err = seg->file.Size(size))
+                return err;
+            auto const scanned = scan(*seg, size, [&](Record const &r)
+                                      {
+                auto const &h = r.header;
+                seg->records++;
+                maxSeq = std::max(maxSeq, h.seq);
+                auto const previous = seqs.get(h.pos);
+                if (previous.second && previous.first >= h.seq)
+                    return;
+                seqs.insert(h.pos, h.seq);
+                replaced(index_.insert(h.pos, address(id, r.offset)));
+                seg->live++;
+            });
+            if (scanned)
+                return scanned;
+            if (seg->end != size)
+            {
+                if (auto err = seg->file.Truncate(seg->end))
+                    return err;
+            }
+            seg->sealed = true;
+        }
+        nextSeq_ = maxSeq + 1;
+        return new_segment(active_);
+    }
+
+    // Stops the collector and syncs and closes every segment. Returns the
+    // collector's first error unless closing fails.
+    std::error_condition close()
+    {
+        auto result = stop_gc();
+        std::lock_guard<std::mutex> lock(segmentsMutex_);
+        for (auto &s : segments_)
+        {
+            if (auto err = s.second->file.Close())
+                result = err;
+        }
+        segments_.clear();
+        active_.reset();
+        gcActive_.reset();
+        return result;
+    }
+
+    // Makes every put so far durable.
+    std::error_condition sync()
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        return active_->file.Sync();
+    }
+
+    std::error_condition put(std::size_t const pos, std::string const &value)
+    {
+        if (value.empty())
+            return make_error_condition(db_error::zero_length_value);
+        if (value.size() > segmentBytes_)
+            return make_error_condition(db_error::value_too_long);
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        auto const length = sizeof(Header) + value.size();
+        if (active_->end + length > segmentBytes_)
+        {
+            if (auto err = seal(active_))
+                return err;
+            if (auto err = new_segment(active_))
+                return err;
+        }
+        Header h{0, static_cast<std::uint32_t>(value.size()), pos,
+                 nextSeq_++};
+        buffer_.resize(length);
+        encode(h, value.data(), buffer_.data());
+        auto &seg = *active_;
+        if (auto err = seg.file.WriteAt(seg.end, buffer_.data(), length))
+            return err;
+        std::uint64_t const offset = seg.end;
+        seg.end += length;
+        seg.records++;
+        seg.live++;
+        replaced(index_.insert(pos, address(seg.id, offset)));
+        return std::error_condition();
+    }
+
+    std::error_condition get(std::size_t const pos, std::string &value) const
+    {
+        std::vector<char> buffer(READ_AHEAD);
+        for (std::size_t attempt = 0; attempt < GET_RETRIES; attempt++)
+        {
+            auto const e = index_.get(pos);
+            if (!e.second)
+                return make_error_condition(db_error::key_not_found);
+            auto const seg = segment(e.first >> OFFSET_BITS);
+            // Moved by the collector since the lookup.
+            if (!seg)
+                continue;
+            auto const offset = e.first & ((1ULL << OFFSET_BITS) - 1);
+            auto const length =
+                std::min<std::uint64_t>(READ_AHEAD, seg->end - offset);
+            if (auto err = seg->file.ReadAt(offset, buffer.data(), length))
+                return err;
+            Header h;
+            std::memcpy(&h, buffer.data(), sizeof(h));
+            if (h.pos != pos)
+                return make_error_condition(db_error::corrupt_file);
+            value.assign(buffer.data() + sizeof(Header),
+                         std::min<std::size_t>(h.length,
+                                               length - sizeof(Header)));
+            if (value.size() == h.length)
+                return std::error_condition();
+            auto const done = value.size();
+            value.resize(h.length);
+            return seg->file.ReadAt(offset + sizeof(Header) + done,
+                                    &value[done], h.length - done);
+        }
+        return make_error_condition(db_error::corrupt_file);
+    }
+
+    std::size_t num_nonempty() const { return index_.num_nonempty(); }
+
+    std::size_t num_segments() const
+    {
+        std::lock_guard<std::mutex> lock(segmentsMutex_);
+        return segments_.size();
+    }
+
+    // Bytes in every segment, live or not.
+    std::uint64_t disk_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(segmentsMutex_);
+        std::uint64_t bytes = 0;
+        for (auto const &s : segments_) bytes += s.second->end;
+        return bytes;
+    }
+
+    GcStats gc_stats()
+    {
+        std::lock_guard<std::mutex> lock(gcMutex_);
+        return gcStats_;
+    }
+
+    // Collects every sealed segment with enough garbage once, in the
+    // calling thread.
+    std::error_condition collect(GcOptions const &options = GcOptions())
+    {
+        for (;;)
+        {
+            auto const seg = victim(options);
+            if (!seg)
+                return std::error_condition();
+            if (auto err = collect(seg, options))
+                return err;
+        }
+    }
+
+    // Starts a thread that collects segments as they fill with garbage. A
+    // failed collection is retried after options.interval, and the first
+    // failure is kept for gc_error() and stop_gc().
+    void start_gc(GcOptions const &options = GcOptions())
+    {
+        stop_gc();
+        gcOptions_ = options;
+        gcStop_ = false;
+        gcError_ = std::error_condition();
+        gcThread_ = std::thread([this]()
+                                {
+            std::unique_lock<std::mutex> lock(gcWaitMutex_);
+            while (!gcStop_)
+            {
+                lock.unlock();
+                auto const seg = victim(gcOptions_);
+                std::error_condition err;
+                if (seg)
+                    err = collect(seg, gcOptions_);
+                lock.lock();
+                if (err && !gcError_)
+                    gcError_ = err;
+                if (!seg || err)
+                    gcWait_.wait_for(lock, gcOptions_.interval);
+            }
+        });
+    }
+
+    // Stops the collector thread and returns its first error, if any.
+    std::error_condition stop_gc()
+    {
+        if (gcThread_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(gcWaitMutex_);
+                gcStop_ = true;
+            }
+            gcWait_.notify_all();
+            gcThread_.join();
+        }
+        return gc_error();
+    }
+
+    // The first error of the collector thread since start_gc().
+    std::error_condition gc_error()
+    {
+        std::lock_guard<std::mutex> lock(gcWaitMutex_);
+        return gcError_;
+    }
+
+   private:
+    // The sealed segment with the most garbage, if it has enough.
+    std::shared_ptr<Segment> victim(GcOptions const &options) const
+    {
+        std::lock_guard<std::mutex> lock(segmentsMutex_);
+        std::shared_ptr<Segment> best;
+        double bestGarbage = options.minGarbage;
+        for (auto const &s : segments_)
+        {
+            auto const &seg = s.second;
+            if (!seg->sealed || !seg->records)
+                continue;
+            auto const garbage =
+                1.0 - static_cast<double>(seg->live) / seg->records;
+            if (garbage >= bestGarbage)
+            {
+                best = seg;
+                bestGarbage = garbage;
+            }
+        }
+        return best;
+    }
+
+    // Copies the live records of seg to the collector's segment, checking
+    // liveness batchRecords at a time, then deletes seg.
+    std::error_condition collect(std::shared_ptr<Segment> const &seg,
+                                 GcOptions const &options)
+    {
+        std::lock_guard<std::mutex> lock(gcMutex_);
+        if (seg->obsolete)
+            return std::error_condition();
+        if (!gcActive_)
+        {
+            if (auto err = new_segment(gcActive_))
+                return err;
+        }
+        auto const start = std::chrono::steady_clock::now();
+        std::uint64_t bytes = 0;
+        std::vector<Record> batch;
+        std::vector<std::string> values;
+        std::error_condition result;
+        auto const scanned = scan(*seg, seg->end, [&](Record const &r)
+                                  {
+            batch.push_back(r);
+            values.emplace_back(r.value, r.header.length);
+            if (batch.size() < options.batchRecords)
+                return;
+            if (!result)
+                result = move(*seg, batch, values);
+            bytes += throttle(options, start, bytes, batch, values);
+        });
+        if (!scanned && !result && !batch.empty())
+            result = move(*seg, batch, values);
+        if (scanned)
+            return scanned;
+        if (result)
+            return result;
+        // The moved records must be durable before the originals go.
+        if (auto err = gcActive_->file.Sync())
+            return err;
+        seg->obsolete = true;
+        {
+            std::lock_guard<std::mutex> lock(segmentsMutex_);
+            segments_.erase(seg->id);
+        }
+        gcStats_.segments++;
+        return std::error_condition();
+    }
+
+    // Sleeps as needed to keep the bytes of the batch, which is then
+    // cleared, within the collector's rate. Returns the batch's bytes.
+    static std::uint64_t throttle(
+        GcOptions const &options,
+        std::chrono::steady_clock::time_point const start,
+        std::uint64_t const scanned, std::vector<Record> &batch,
+        std::vector<std::string> &values)
+    {
+        std::uint64_t bytes = 0;
+        for (auto const &r : batch) bytes += sizeof(Header) + r.header.length;
+        batch.clear();
+        values.clear();
+        if (!options.bytesPerSecond)
+            return bytes;
+        auto const due =
+            start + std::chrono::microseconds((scanned + bytes) * 1000000 /
+                                              options.bytesPerSecond);
+        std::this_thread::sleep_until(due);
+        return bytes;
+    }
+
+    // Moves the records of the batch that the index still points to.
+    std::error_condition move(Segment &seg, std::vector<Record> const &batch,
+                              std::vector<std::string> const &values)
+    {
+        std::vector<std::size_t> positions;
+        positions.reserve(batch.size());
+        for (auto const &r : batch) positions.push_back(r.header.pos);
+        std::vector<Index::return_type> current(batch.size());
+        index_.get_batch(positions.data(), positions.size(), current.data());
+        gcStats_.recordsScanned += batch.size();
+        for (std::size_t i = 0; i < batch.size(); i++)
+        {
+            auto const &r = batch[i];
+            auto const from = address(seg.id, r.offset);
+            if (!current[i].second || current[i].first != from)
+                continue;
+            auto const length = sizeof(Header) + r.header.length;
+            if (gcActive_->end + length > segmentBytes_)
+            {
+                if (auto err = seal(gcActive_))
+                    return err;
+                if (auto err = new_segment(gcActive_))
+                    return err;
+            }
+            auto &out = *gcActive_;
+            std::vector<char> buffer(length);
+            encode(r.header, values[i].data(), buffer.data());
+            if (auto err = out.file.WriteAt(out.end, buffer.data(), length))
+                return err;
+            auto const to = address(out.id, out.end);
+            out.end += length;
+            out.records++;
+            // Counted live first, as a put may replace it as soon as it is
+            // in the index.
+            out.live++;
+            if (!index_.compare_and_set(r.header.pos, from, to))
+            {
+                out.live--;
+                gcStats_.casFailures++;
+                continue;
+            }
+            seg.live--;
+            gcStats_.recordsMoved++;
+            gcStats_.bytesMoved += length;
+        }
+        return std::error_condition();
+    }
+
+    // Calls fn with each complete record of seg's first size bytes in
+    // order, and sets seg's end to the end of the last one.
+    template <class Fn>
+    std::error_condition scan(Segment &seg, std::uint64_t const size, Fn fn)
+    {
+        std::vector<char> buffer;
+        std::uint64_t bufferOffset = 0;
+        std::uint64_t offset = 0;
+        for (;;)
+        {
+            if (offset + sizeof(Header) > size)
+                break;
+            auto const load = [&](std::uint64_t const length)
+            {
+                buffer.resize(std::min(length, size - offset));
+                bufferOffset = offset;
+                return seg.file.ReadAt(offset, buffer.data(), buffer.size());
+            };
+            if (offset + sizeof(Header) > bufferOffset + buffer.size())
+            {
+                if (auto err = load(SCAN_BYTES))
+                    return err;
+            }
+            Record r;
+            std::memcpy(&r.header, buffer.data() + (offset - bufferOffset),
+                        sizeof(Header));
+            auto const length = sizeof(Header) + r.header.length;
+            if (offset + length > size)
+                break;
+            if (offset + length > bufferOffset + buffer.size())
+            {
+                if (auto err = load(std::max<std::uint64_t>(SCAN_BYTES,
+                                                            length)))
+                    return err;
+            }
+            auto const record = buffer.data() + (offset - bufferOffset);
+            if (r.header.crc != checksum(record))
+                break;
+            r.value = record + sizeof(Header);
+            r.offset = offset;
+            fn(r);
+            offset += length;
+        }
+        seg.end = offset;
+        return std::error_condition();
+    }
+
+    // Called with the result of replacing an index entry, to count the
+    // replaced record as garbage in its segment.
+    void replaced(Index::return_type const &previous)
+    {
+        if (!previous.second)
+            return;
+        if (auto const seg = segment(previous.first >> OFFSET_BITS))
+            seg->live--;
+    }
+
+    std::shared_ptr<Segment> segment(std::uint64_t const id) const
+    {
+        std::lock_guard<std::mutex> lock(segmentsMutex_);
+        auto const it = segments_.find(id);
+        return it == segments_.end() ? nullptr : it->second;
+    }
+
+    std::error_condition new_segment(std::shared_ptr<Segment> &seg)
+    {
+        std::lock_guard<std::mutex> lock(segmentsMutex_);
+        auto const id = nextId_++;
+        seg = std::make_shared<Segment>(segment_file(id), id);
+        if (auto err = seg->file.Open(true))
+            return err;
+        segments_[id] = seg;
+        return std::error_condition();
+    }
+
+    // Syncs a full segment and makes it a candidate for collection.
+    static std::error_condition seal(std::shared_ptr<Segment> const &seg)
+    {
+        if (auto err = seg->file.Sync())
+            return err;
+        seg->sealed = true;
+        return std::error_condition();
+    }
+
+    // Lists the numbers of the existing segments in ascending order.
+    std::error_condition list_segments(std::vector<std::uint64_t> &ids) const
+    {
+        auto const slash = filename_.rfind('/');
+        auto const dir = slash == std::string::npos
+                             ? std::string(".")
+                             : filename_.substr(0, slash + 1);
+        auto const base = slash == std::string::npos
+                              ? filename_
+                              : filename_.substr(slash + 1);
+        auto d = ::opendir(dir.c_str());
+        if (!d)
+            return std::generic_category().default_error_condition(errno);
+        while (auto entry = ::readdir(d))
+        {
+            std::string name(entry->d_name);
+            if (name.size() <= base.size() + 1 ||
+                name.compare(0, base.size() + 1, base + ".") != 0)
+                continue;
+            auto const suffix = name.substr(base.size() + 1);
+            if (suffix.find_first_not_of("0123456789") == std::string::npos)
+                ids.push_back(std::stoull(suffix));
+        }
+        ::closedir(d);
+        std::sort(ids.begin(), ids.end());
+        return std::error_condition();
+    }
+
+    std::string segment_file(std::uint64_t const id) const
+    {
+        return filename_ + "." + std::to_string(id);
+    }
+
+    static std::uint64_t address(std::uint64_t const id,
+                                 std::uint64_t const offset)
+    {
+        return (id << OFFSET_BITS) | offset;
+    }
+
+    static void encode(Header h, const char *value, char *out)
+    {
+        std::memcpy(out, &h, sizeof(h));
+        std::memcpy(out + sizeof(h), value, h.length);
+        h.crc = checksum(out);
+        std::memcpy(out, &h, sizeof(h));
+    }
+
+    // Checksum of a record from its length field on.
+    static std::uint32_t checksum(const char *record)
+    {
+        Header h;
+        std::memcpy(&h, record, sizeof(h));
+        return crc32c(record + sizeof(std::uint32_t),
+                      sizeof(Header) - sizeof(std::uint32_t) + h.length);
+    }
+};
+}  // namespace sparsedb
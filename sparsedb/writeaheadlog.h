@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "crc32c.h"
+#include "file.h"
+
+namespace sparsedb
+{
+// An append-only log of index mutations. Mutations are buffered in memory
+// by Insert() and Erase() and written by Commit() as a batch closed by a
+// commit record, so that a batch is replayed either completely or not at
+// all. Each record carries a CRC-32C of its contents.
+//
+// Commit() calls fsync on every syncEvery'th commit, so that one fsync is
+// shared by the batches in between. A syncEvery of zero leaves flushing to
+// the operating system, and of one makes every commit durable.
+class WriteAheadLog
+{
+   public:
+    enum Op : std::uint32_t
+    {
+        INSERT = 1,
+        ERASE = 2,
+        // Closes a batch. pos holds the batch's sequence number, counting
+        // from one, and value the number of records in it.
+        COMMIT = 3
+    };
+
+    struct Record
+    {
+        std::uint64_t pos;
+        std::uint64_t value;
+        std::uint32_t op;
+        // CRC-32C of the preceding fields.
+        std::uint32_t crc;
+    };
+    static_assert(sizeof(Record) == 24, "Record must not be padded");
+
+    enum
+    {
+        // Records read at a time by Replay().
+        READ_RECORDS = 4096
+    };
+
+   private:
+    File file_;
+    std::size_t syncEvery_;
+    std::vector<Record> pending_;
+    std::uint64_t sequence_ = 0;
+    // Commits written since the last fsync.
+    std::size_t unsynced_ = 0;
+    // Set once a failed batch could not be cut off the file.
+    std::error_condition failed_;
+
+   public:
+    explicit WriteAheadLog(std::string const &filename,
+                           std::size_t const syncEvery = 1)
+        : file_(filename), syncEvery_(syncEvery)
+    {
+    }
+
+    std::error_condition Open() { return file_.OpenAppend(); }
+
+    // Commits anything pending, then syncs and closes the file.
+    std::error_condition Close()
+    {
+        if (auto err = Commit())
+            return err;
+        return file_.Close();
+    }
+
+    std::error_condition Delete() { return file_.Delete(); }
+
+    void Insert(std::uint64_t const pos, std::uint64_t const value)
+    {
+        append(INSERT, pos, value);
+    }
+
+    void Erase(std::uint64_t const pos) { append(ERASE, pos, 0); }
+
+    // Number of records waiting for Commit().
+    std::size_t Pending() const { return pending_.size(); }
+
+    // Batches written since the log was last emptied.
+    std::uint64_t Batches() const { return sequence_; }
+
+    // Writes the pending records as one batch with a single write. If the
+    // write fails the batch is dropped and any part of it that reached the
+    // file is cut off again, so that later batches replay. If that fails
+    // too, every later commit fails with the same error.
+    std::error_condition Commit()
+    {
+        if (failed_)
+        {
+            pending_.clear();
+            return failed_;
+        }
+        if (!pending_.empty())
+        {
+            std::uint64_t size;
+            auto err = file_.Size(size);
+            if (!err)
+            {
+                append(COMMIT, sequence_ + 1, pending_.size());
+                err = file_.Write(pending_);
+            }
+            pending_.clear();
+            if (err)
+            {
+                if (auto truncateErr = file_.Truncate(size))
+                    failed_ = truncateErr;
+                return err;
+            }
+            sequence_++;
+            unsynced_++;
+        }
+        if (syncEvery_ && unsynced_ >= syncEvery_)
+            return Sync();
+        return std::error_condition();
+    }
+
+    // Makes every commit so far durable.
+    std::error_condition Sync()
+    {
+        if (!unsynced_)
+            return std::error_condition();
+        unsynced_ = 0;
+        return file_.Sync();
+    }
+
+    // Discards the whole log, once its mutations are in a checkpoint.
+    std::error_condition Truncate()
+    {
+        pending_.clear();
+        sequence_ = 0;
+        unsynced_ = 0;
+        if (auto err = file_.Truncate())
+            return err;
+        failed_ = std::error_condition();
+        return file_.Sync();
+    }
+
+    // Calls fn(op, pos, value) for each INSERT and ERASE record of every
+    // complete batch in order. A batch cut short by a crash, which shows up
+    // as a short or corrupt record in the last batch of the log, is cut off
+    // the file. A corrupt record followed by a whole later batch is damage
+    // to a committed batch instead, and returns corrupt_file leaving the
+    // file as it is. A record with a valid checksum that is out of place,
+    // such as a commit record that does not match its batch, returns
+    // bad_commit.
+    template <class Fn>
+    std::error_condition Replay(Fn fn)
+    {
+        std::uint64_t size;
+        if (auto err = file_.Size(size))
+            return err;
+        std::vector<Record> records(READ_RECORDS);
+        std::vector<Record> batch;
+        std::uint64_t offset = 0;
+        // End of the last complete batch.
+        std::uint64_t valid = 0;
+        sequence_ = 0;
+        bool torn = false;
+        while (size - offset >= sizeof(Record))
+        {
+            auto const count = std::min<std::uint64_t>(
+                records.size(), (size - offset) / sizeof(Record));
+            if (auto err = file_.ReadAt(offset, records.data(),
+                                        count * sizeof(Record)))
+                return err;
+            for (std::size_t i = 0; i < count; i++)
+            {
+                auto const &r = records[i];
+                offset += sizeof(Record);
+                if (torn)
+                {
+                    // Only the rest of the torn batch may follow, not the
+                    // commit of a later one.
+                    if (r.crc == checksum(r) && r.op == COMMIT &&
+                        r.pos > sequence_ + 1)
+                        return make_error_condition(db_error::corrupt_file);
+                }
+                else if (r.crc != checksum(r))
+                {
+                    torn = true;
+                }
+                else if (r.op == INSERT || r.op == ERASE)
+                {
+                    batch.push_back(r);
+                }
+                else if (r.op == COMMIT && r.pos == sequence_ + 1 &&
+                         r.value == batch.size())
+                {
+                    for (auto const &b : batch) fn(Op(b.op), b.pos, b.value);
+                    batch.clear();
+                    sequence_++;
+                    valid = offset;
+                }
+                else
+                {
+                    return make_error_condition(db_error::bad_commit);
+                }
+            }
+        }
+        failed_ = std::error_condition();
+        if (valid != size)
+            return file_.Truncate(valid);
+        return std::error_condition();
+    }
+
+   private:
+    void append(Op const op, std::uint64_t const pos,
+                std::uint64_t const value)
+    {
+        Record r{pos, value, op, 0};
+        r.crc = checksum(r);
+        pending_.push_back(r);
+    }
+
+    static std::uint32_t checksum(Record const &r)
+    {
+        return crc32c(&r, offsetof(Record, crc));
+    }
+};
+}  // namespace sparsedb
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/concurrentsparseindex.h"
+
+TEST(ConcurrentSparseIndexTest, Uint64)
+{
+    ConcurrentSparseIndex<SparseVector<std::uint64_t>> index(1ULL << 20);
+    TestInsertAndGet(index);
+    TestRandomInsertAndGet(index, 4);
+}
+
+TEST(ConcurrentSparseIndexTest, ReadersAndWriters)
+{
+    ConcurrentSparseIndex<SparseVector<std::uint64_t>> index(1ULL << 20);
+    const std::size_t numWriters = 4;
+    const std::size_t numReaders = 4;
+    const auto N = index.size();
+    std::atomic<bool> done{false};
+    std::atomic<std::size_t> errors{0};
+    std::vector<std::thread> threads;
+    // Writers interleave on every group, each owning every numWriters'th
+    // position, and store the position as the value.
+    for (std::size_t w = 0; w < numWriters; w++)
+        threads.emplace_back([&, w]()
+                             {
+            for (std::size_t i = w; i < N; i += numWriters) index.insert(i, i);
+        });
+    for (std::size_t r = 0; r < numReaders; r++)
+        threads.emplace_back([&, r]()
+                             {
+            std::uniform_int_distribution<uint64_t> posDist(0, N - 1);
+            XORShiftEngine gen(r + 1);
+            while (!done)
+            {
+                auto pos = posDist(gen);
+                auto result = index.get(pos);
+                if (result.second && result.first != pos)
+                    errors++;
+            }
+        });
+    for (std::size_t w = 0; w < numWriters; w++) threads[w].join();
+    done = true;
+    for (std::size_t r = 0; r < numReaders; r++)
+        threads[numWriters + r].join();
+    ASSERT_EQ(0ULL, errors.load());
+    ASSERT_EQ(N, index.num_nonempty());
+    for (std::size_t i = 0; i < N; i++)
+        ASSERT_EQ(std::make_pair(std::uint64_t(i), true), index.get(i));
+}
+
+TEST(ConcurrentSparseIndexTest, CompareAndSetAndGetBatch)
+{
+    ConcurrentSparseIndex<SparseVector<std::uint64_t>> index(1ULL << 16);
+    ASSERT_FALSE(index.compare_and_set(5, 0, 1));
+    ASSERT_FALSE(index.has(5));
+    index.insert(5, 10);
+    ASSERT_FALSE(index.compare_and_set(5, 11, 12));
+    ASSERT_EQ(std::make_pair(std::uint64_t(10), true), index.get(5));
+    ASSERT_TRUE(index.compare_and_set(5, 10, 12));
+    ASSERT_EQ(std::make_pair(std::uint64_t(12), true), index.get(5));
+
+    std::vector<std::size_t> positions;
+    for (std::size_t i = 0; i < 1000; i++)
+    {
+        positions.push_back(i * 37 % index.size());
+        if (i % 3)
+            index.insert(positions.back(), i);
+    }
+    std::vector<decltype(index)::return_type> out(positions.size());
+    index.get_batch(positions.data(), positions.size(), out.data());
+    for (std::size_t i = 0; i < positions.size(); i++)
+        ASSERT_EQ(index.get(positions[i]), out[i]);
+}
+
+TEST(ConcurrentSparseIndexTest, PayloadCache)
+{
+    using Vector = SparseVector<std::uint32_t>;
+    auto const before = Vector::allocator_type::stats();
+    {
+        ConcurrentSparseIndex<Vector> index(1ULL << 16);
+        // Rewriting the same positions recycles payloads through the
+        // stripes' caches.
+        for (std::uint32_t round = 0; round < 8; round++)
+        {
+            for (std::size_t i = 0; i < index.size(); i += 3)
+                index.insert(i, static_cast<std::uint32_t>(i) + round);
+        }
+        for (std::size_t i = 0; i < index.size(); i++)
+        {
+            auto const result = index.get(i);
+            ASSERT_EQ(i % 3 == 0, result.second);
+            if (result.second)
+            {
+                ASSERT_EQ(i + 7, result.first);
+            }
+        }
+        ASSERT_LT(before.used, index.allocator_stats().used);
+    }
+    // The caches are drained back into the allocator.
+    ASSERT_EQ(before.used, Vector::allocator_type::stats().used);
+}
@@ -0,0 +1,432 @@
+#pragma once
+
+#include <csignal>
+#include <map>
+#include <vector>
+#include <sys/resource.h>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/writeaheadlog.h"
+#include "sparsedb/durablesparseindex.h"
+
+TEST(WriteAheadLogTest, TornTail)
+{
+    WriteAheadLog log("testdb.log");
+    ASSERT_TRUE(NoError(log.Open()));
+    ASSERT_TRUE(NoError(log.Truncate()));
+    log.Insert(1, 10);
+    log.Insert(2, 20);
+    ASSERT_TRUE(NoError(log.Commit()));
+    log.Erase(1);
+    ASSERT_TRUE(NoError(log.Commit()));
+    ASSERT_TRUE(NoError(log.Close()));
+    // A crash part way through writing the next record.
+    File file("testdb.log");
+    ASSERT_TRUE(NoError(file.OpenAppend()));
+    const char torn[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    ASSERT_TRUE(NoError(file.Write(torn, sizeof(torn))));
+    ASSERT_TRUE(NoError(file.Close()));
+
+    WriteAheadLog replayed("testdb.log");
+    ASSERT_TRUE(NoError(replayed.Open()));
+    std::vector<std::uint64_t> ops;
+    ASSERT_TRUE(NoError(replayed.Replay(
+        [&](WriteAheadLog::Op const op, std::uint64_t const pos,
+            std::uint64_t const value)
+        {
+            ops.insert(ops.end(), {op, pos, value});
+        })));
+    std::vector<std::uint64_t> expected{WriteAheadLog::INSERT, 1, 10,
+                                        WriteAheadLog::INSERT, 2, 20,
+                                        WriteAheadLog::ERASE,  1, 0};
+    ASSERT_EQ(expected, ops);
+    // The torn record is cut off and new batches follow the last one.
+    replayed.Insert(3, 30);
+    ASSERT_TRUE(NoError(replayed.Close()));
+    ASSERT_TRUE(NoError(file.Open()));
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Size(size)));
+    ASSERT_EQ(7 * sizeof(WriteAheadLog::Record), size);
+    WriteAheadLog again("testdb.log");
+    ASSERT_TRUE(NoError(again.Open()));
+    std::size_t count = 0;
+    ASSERT_TRUE(NoError(again.Replay(
+        [&](WriteAheadLog::Op, std::uint64_t, std::uint64_t)
+        {
+            count++;
+        })));
+    ASSERT_EQ(4U, count);
+    ASSERT_TRUE(NoError(again.Delete()));
+}
+
+TEST(WriteAheadLogTest, BadCommit)
+{
+    WriteAheadLog log("testdb.log");
+    ASSERT_TRUE(NoError(log.Open()));
+    ASSERT_TRUE(NoError(log.Truncate()));
+    log.Insert(1, 10);
+    ASSERT_TRUE(NoError(log.Close()));
+    // A second writer that did not replay the log repeats sequence one.
+    WriteAheadLog other("testdb.log");
+    ASSERT_TRUE(NoError(other.Open()));
+    other.Insert(2, 20);
+    ASSERT_TRUE(NoError(other.Close()));
+
+    WriteAheadLog replayed("testdb.log");
+    ASSERT_TRUE(NoError(replayed.Open()));
+    auto err = replayed.Replay([](WriteAheadLog::Op, std::uint64_t,
+                                  std::uint64_t)
+                               {
+    });
+    ASSERT_EQ(make_error_condition(db_error::bad_commit), err);
+    ASSERT_TRUE(NoError(replayed.Delete()));
+}
+
+// Counts the records replayed from the log called name.
+std::error_condition ReplayCount(std::string const& name, std::size_t& count)
+{
+    WriteAheadLog log(name);
+    count = 0;
+    if (auto err = log.Open())
+        return err;
+    auto err = log.Replay([&](WriteAheadLog::Op, std::uint64_t, std::uint64_t)
+                          {
+        count++;
+    });
+    log.Close();
+    return err;
+}
+
+TEST(WriteAheadLogTest, FailedCommit)
+{
+    WriteAheadLog log("testdb.log");
+    ASSERT_TRUE(NoError(log.Open()));
+    ASSERT_TRUE(NoError(log.Truncate()));
+    log.Insert(1, 10);
+    ASSERT_TRUE(NoError(log.Commit()));
+    // A file size limit cuts the next batch short, then stops the one after
+    // it altogether.
+    auto const size = 2 * sizeof(WriteAheadLog::Record);
+    rlimit old;
+    ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old));
+    auto const handler = std::signal(SIGXFSZ, SIG_IGN);
+    rlimit limit = old;
+    limit.rlim_cur = size + 10;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    log.Insert(2, 20);
+    auto const shortErr = log.Commit();
+    limit.rlim_cur = size;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    log.Insert(3, 30);
+    auto const fullErr = log.Commit();
+    setrlimit(RLIMIT_FSIZE, &old);
+    std::signal(SIGXFSZ, handler);
+    ASSERT_EQ(make_error_condition(db_error::short_write), shortErr);
+    ASSERT_TRUE(bool(fullErr));
+    // Later commits follow on from the last good batch.
+    log.Insert(4, 40);
+    ASSERT_TRUE(NoError(log.Commit()));
+    ASSERT_TRUE(NoError(log.Close()));
+    std::size_t count;
+    ASSERT_TRUE(NoError(ReplayCount("testdb.log", count)));
+    ASSERT_EQ(2U, count);
+    ASSERT_TRUE(NoError(log.Delete()));
+}
+
+TEST(WriteAheadLogTest, DamagedBatch)
+{
+    WriteAheadLog log("testdb.log");
+    ASSERT_TRUE(NoError(log.Open()));
+    ASSERT_TRUE(NoError(log.Truncate()));
+    for (std::uint64_t i = 0; i < 3; i++)
+    {
+        log.Insert(i, i);
+        ASSERT_TRUE(NoError(log.Commit()));
+    }
+    ASSERT_TRUE(NoError(log.Close()));
+    File file("testdb.log");
+    ASSERT_TRUE(NoError(file.Open()));
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Size(size)));
+    // Damage to the first batch is not taken for a torn tail.
+    const char damage = 0x55;
+    ASSERT_TRUE(NoError(file.WriteAt(1, &damage, 1)));
+    std::size_t count;
+    ASSERT_EQ(make_error_condition(db_error::corrupt_file),
+              ReplayCount("testdb.log", count));
+    std::uint64_t after;
+    ASSERT_TRUE(NoError(file.Size(after)));
+    ASSERT_EQ(size, after);
+    // Damage to the last batch is.
+    ASSERT_TRUE(NoError(file.Truncate()));
+    WriteAheadLog again("testdb.log");
+    ASSERT_TRUE(NoError(again.Open()));
+    for (std::uint64_t i = 0; i < 3; i++)
+    {
+        again.Insert(i, i);
+        ASSERT_TRUE(NoError(again.Commit()));
+    }
+    ASSERT_TRUE(NoError(again.Close()));
+    ASSERT_TRUE(NoError(file.WriteAt(size - 30, &damage, 1)));
+    ASSERT_TRUE(NoError(ReplayCount("testdb.log", count)));
+    ASSERT_EQ(2U, count);
+    ASSERT_TRUE(NoError(file.Size(after)));
+    ASSERT_EQ(size - 2 * sizeof(WriteAheadLog::Record), after);
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+// Removes a checkpoint, its deltas and its log.
+void RemoveDurable(std::string const& name)
+{
+    for (auto const& suffix : {"", ".1", ".2", ".3", ".4", ".log"})
+    {
+        File file(name + suffix);
+        if (file.Exists())
+        {
+            ASSERT_TRUE(NoError(file.Delete()));
+        }
+    }
+}
+
+TEST(DurableSparseIndexTest, DamagedDelta)
+{
+    using Index = SparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 16;
+    Index index(N);
+    for (std::size_t i = 0; i < N; i += 3) index.insert(i, i);
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index.write_delta(file, {1, 5, 900})));
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Size(size)));
+    ASSERT_TRUE(NoError(file.Close()));
+    auto const apply = [&](Index &target)
+    {
+        File delta("testdb");
+        if (auto err = delta.Open())
+            return err;
+        auto err = target.read_delta(delta);
+        delta.Close();
+        return err;
+    };
+    Index target(N);
+    ASSERT_TRUE(NoError(apply(target)));
+    for (std::size_t group : {1, 5, 900})
+    {
+        for (auto pos = group * 64; pos < (group + 1) * 64; pos++)
+            ASSERT_TRUE(index.get(pos) == target.get(pos));
+    }
+    ASSERT_FALSE(target.get(0).second);
+    // A flipped byte in a group number, in a payload or in the last
+    // checksum, then a delta cut short.
+    ASSERT_TRUE(NoError(file.Open()));
+    for (std::uint64_t at : {std::uint64_t(48 + 8), size - 100, size - 1})
+    {
+        char byte;
+        ASSERT_TRUE(NoError(file.ReadAt(at, &byte, 1)));
+        byte ^= 1;
+        ASSERT_TRUE(NoError(file.WriteAt(at, &byte, 1)));
+        Index damaged(N);
+        ASSERT_EQ(make_error_condition(db_error::corrupt_file),
+                  apply(damaged));
+        ASSERT_EQ(0U, damaged.num_nonempty());
+        byte ^= 1;
+        ASSERT_TRUE(NoError(file.WriteAt(at, &byte, 1)));
+    }
+    ASSERT_TRUE(NoError(file.Truncate(size - 1)));
+    ASSERT_EQ(make_error_condition(db_error::short_read), apply(target));
+    // A full index is not a delta.
+    ASSERT_TRUE(NoError(file.Truncate()));
+    ASSERT_TRUE(NoError(index.write(file)));
+    ASSERT_EQ(make_error_condition(db_error::bad_version), apply(target));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(DurableSparseIndexTest, Recovery)
+{
+    using Index = DurableSparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 16;
+    std::map<std::size_t, std::uint64_t> expected;
+    RemoveDurable("testdb");
+    {
+        Index index(N, "testdb", "testdb.log", 4);
+        ASSERT_TRUE(NoError(index.open()));
+        ASSERT_EQ(0U, index.num_nonempty());
+        for (std::size_t i = 0; i < N; i += 7)
+        {
+            index.insert(i, i * 3);
+            expected[i] = i * 3;
+            if (i % 64 == 0)
+            {
+                ASSERT_TRUE(NoError(index.commit()));
+            }
+        }
+        ASSERT_TRUE(NoError(index.checkpoint()));
+        ASSERT_EQ(0U, index.pending());
+        // Mutations after the checkpoint are recovered from the log.
+        for (std::size_t i = 0; i < N; i += 21)
+        {
+            index.erase(i);
+            expected.erase(i);
+        }
+        for (std::size_t i = 1; i < N; i += 100)
+        {
+            index.insert(i, i);
+            expected[i] = i;
+        }
+        ASSERT_TRUE(NoError(index.commit()));
+        ASSERT_TRUE(NoError(index.sync()));
+        // Uncommitted mutations are lost in a crash.
+        index.insert(2, 2);
+        index.erase(7);
+    }
+    {
+        Index index(N, "testdb", "testdb.log");
+        ASSERT_TRUE(NoError(index.open()));
+        ASSERT_EQ(expected.size(), index.num_nonempty());
+        for (auto const &e : expected)
+            ASSERT_EQ(std::make_pair(e.second, true), index.get(e.first));
+        ASSERT_FALSE(index.has(2));
+        // A checkpoint of the recovered index reads back the same.
+        ASSERT_TRUE(NoError(index.checkpoint()));
+        ASSERT_TRUE(NoError(index.close()));
+        Index reopened(N, "testdb", "testdb.log");
+        ASSERT_TRUE(NoError(reopened.open()));
+        ASSERT_TRUE(index.index() == reopened.index());
+        ASSERT_TRUE(NoError(reopened.close()));
+    }
+    RemoveDurable("testdb");
+}
+
+TEST(DurableSparseIndexTest, FailedCommit)
+{
+    using Index = DurableSparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 12;
+    RemoveDurable("testdb");
+    {
+        Index index(N, "testdb", "testdb.log");
+        ASSERT_TRUE(NoError(index.open()));
+        index.insert(1, 10);
+        index.insert(2, 20);
+        ASSERT_TRUE(NoError(index.commit()));
+        File log("testdb.log");
+        ASSERT_TRUE(NoError(log.Open()));
+        std::uint64_t size;
+        ASSERT_TRUE(NoError(log.Size(size)));
+        ASSERT_TRUE(NoError(log.Close()));
+        // A file size limit stops the next batch, whose mutations must
+        // leave the index again.
+        rlimit old;
+        ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old));
+        auto const handler = std::signal(SIGXFSZ, SIG_IGN);
+        rlimit limit = old;
+        limit.rlim_cur = size;
+        setrlimit(RLIMIT_FSIZE, &limit);
+        index.insert(1, 11);
+        index.insert(1, 12);
+        index.insert(3, 30);
+        index.erase(2);
+        auto const err = index.commit();
+        setrlimit(RLIMIT_FSIZE, &old);
+        std::signal(SIGXFSZ, handler);
+        ASSERT_TRUE(bool(err));
+        ASSERT_EQ(0U, index.pending());
+        ASSERT_EQ(10U, index.get(1).first);
+        ASSERT_EQ(20U, index.get(2).first);
+        ASSERT_FALSE(index.has(3));
+        // A checkpoint holds only what the log acknowledged.
+        index.insert(4, 40);
+        ASSERT_TRUE(NoError(index.checkpoint()));
+        ASSERT_TRUE(NoError(index.close()));
+    }
+    Index index(N, "testdb", "testdb.log");
+    ASSERT_TRUE(NoError(index.open()));
+    ASSERT_EQ(3U, index.num_nonempty());
+    ASSERT_EQ(10U, index.get(1).first);
+    ASSERT_EQ(20U, index.get(2).first);
+    ASSERT_EQ(40U, index.get(4).first);
+    ASSERT_TRUE(NoError(index.close()));
+    RemoveDurable("testdb");
+}
+
+TEST(DurableSparseIndexTest, IncrementalCheckpoints)
+{
+    using Index = DurableSparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 16;
+    const std::size_t maxDeltas = 3;
+    RemoveDurable("testdb");
+    SparseIndex<SparseVector<std::uint64_t>> expected(N);
+    std::vector<char> saved;
+    {
+        Index index(N, "testdb", "testdb.log", 0, maxDeltas);
+        ASSERT_TRUE(NoError(index.open()));
+        for (std::size_t i = 0; i < N; i += 3)
+        {
+            index.insert(i, i);
+            expected.insert(i, i);
+        }
+        ASSERT_EQ(N / 64, index.dirty_groups());
+        ASSERT_TRUE(NoError(index.checkpoint()));
+        ASSERT_EQ(0U, index.dirty_groups());
+        // Each later checkpoint only writes the groups modified since.
+        for (std::size_t d = 2; d <= maxDeltas; d++)
+        {
+            for (std::size_t i = 0; i < 64; i++)
+            {
+                index.insert(d * 1000 + i, d);
+                expected.insert(d * 1000 + i, d);
+            }
+            index.erase(d * 3000);
+            expected.erase(d * 3000);
+            ASSERT_EQ(3U, index.dirty_groups());
+            ASSERT_TRUE(NoError(index.checkpoint()));
+            ASSERT_EQ(d, index.num_deltas());
+            File delta("testdb." + std::to_string(d));
+            ASSERT_TRUE(NoError(delta.Open()));
+            std::uint64_t size;
+            ASSERT_TRUE(NoError(delta.Size(size)));
+            ASSERT_GT(1024U, size);
+            if (d == maxDeltas)
+            {
+                saved.resize(size);
+                ASSERT_TRUE(NoError(delta.Read(saved.data(), size)));
+            }
+            ASSERT_TRUE(NoError(delta.Close()));
+        }
+        // The base and the deltas read back as the index.
+        {
+            Index reopened(N, "testdb", "testdb.log");
+            ASSERT_TRUE(NoError(reopened.open()));
+            ASSERT_TRUE(expected == reopened.index());
+        }
+        index.erase(3);
+        expected.erase(3);
+        // A full chain compacts into a new base.
+        ASSERT_TRUE(NoError(index.checkpoint()));
+        ASSERT_EQ(0U, index.num_deltas());
+        for (std::size_t d = 1; d <= maxDeltas; d++)
+            ASSERT_FALSE(File("testdb." + std::to_string(d)).Exists());
+        ASSERT_TRUE(NoError(index.close()));
+    }
+    {
+        Index index(N, "testdb", "testdb.log", 0, maxDeltas);
+        ASSERT_TRUE(NoError(index.open()));
+        ASSERT_TRUE(expected == index.index());
+    }
+    // A crash part way through a compaction leaves the newest deltas,
+    // which must not undo anything in the new base.
+    {
+        File delta("testdb." + std::to_string(maxDeltas));
+        ASSERT_TRUE(NoError(delta.Open(true)));
+        ASSERT_TRUE(NoError(delta.Write(saved.data(), saved.size())));
+        ASSERT_TRUE(NoError(delta.Close()));
+        Index index(N, "testdb", "testdb.log", 0, maxDeltas);
+        ASSERT_TRUE(NoError(index.open()));
+        ASSERT_EQ(maxDeltas, index.num_deltas());
+        ASSERT_TRUE(expected == index.index());
+        ASSERT_TRUE(NoError(index.compact()));
+        ASSERT_FALSE(delta.Exists());
+        ASSERT_TRUE(NoError(index.close()));
+    }
+    RemoveDurable("testdb");
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/indexmerger.h"
+
+TEST(IndexMergerTest, Merge)
+{
+    using Index = SparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1 << 16;
+    const std::size_t numInputs = 3;
+    std::vector<std::unique_ptr<File>> files;
+    for (std::size_t i = 0; i < numInputs; i++)
+        files.emplace_back(new File("testdb.merge" + std::to_string(i)));
+    std::map<std::size_t, std::uint64_t> last, sum;
+    XORShiftEngine gen(5);
+    std::uniform_int_distribution<std::size_t> dist(0, N - 1);
+    for (std::size_t i = 0; i < numInputs; i++)
+    {
+        Index index(N);
+        for (std::size_t j = 0; j < N / 8; j++)
+        {
+            auto const pos = dist(gen);
+            auto const value = i * N + j;
+            index.insert(pos, value);
+            last[pos] = value;
+        }
+        for (auto const &e : index) sum[e.first] += e.second;
+        ASSERT_TRUE(NoError(files[i]->Open(true)));
+        // One input with a trailing directory, which must be skipped.
+        ASSERT_TRUE(NoError(i ? index.write(*files[i])
+                              : index.write_with_directory(*files[i])));
+    }
+    std::vector<File *> inputs;
+    for (auto &f : files) inputs.push_back(f.get());
+    File output("testdb.merged");
+    ASSERT_TRUE(NoError(output.Open(true)));
+    // Small chunks, so that groups straddle buffer refills.
+    IndexMerger<SparseVector<std::uint64_t>> merger(100);
+
+    auto check = [&](std::map<std::size_t, std::uint64_t> const &expected)
+    {
+        Index merged(N);
+        File in("testdb.merged");
+        ASSERT_TRUE(NoError(in.Open()));
+        ASSERT_TRUE(NoError(merged.read(in)));
+        ASSERT_TRUE(NoError(in.Close()));
+        ASSERT_EQ(expected.size(), merged.num_nonempty());
+        for (auto const &e : expected)
+            ASSERT_EQ(std::make_pair(e.second, true), merged.get(e.first));
+    };
+    ASSERT_TRUE(NoError(merger.merge(inputs, output)));
+    check(last);
+    ASSERT_TRUE(NoError(merger.merge(inputs, output,
+                                     [](std::uint64_t const a,
+                                        std::uint64_t const b)
+                                     {
+                                         return a + b;
+                                     })));
+    check(sum);
+
+    // A damaged input is caught by its checksums.
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(files[1]->Size(size)));
+    std::uint8_t byte;
+    ASSERT_TRUE(NoError(files[1]->ReadAt(size / 2, &byte, 1)));
+    byte ^= 1;
+    ASSERT_TRUE(NoError(files[1]->WriteAt(size / 2, &byte, 1)));
+    ASSERT_EQ(make_error_condition(db_error::corrupt_file),
+              merger.merge(inputs, output));
+    byte ^= 1;
+    ASSERT_TRUE(NoError(files[1]->WriteAt(size / 2, &byte, 1)));
+
+    // Inputs of different sizes.
+    Index other(2 * N);
+    File otherFile("testdb.merge_other");
+    ASSERT_TRUE(NoError(otherFile.Open(true)));
+    ASSERT_TRUE(NoError(other.write(otherFile)));
+    inputs.push_back(&otherFile);
+    ASSERT_EQ(make_error_condition(db_error::corrupt_file),
+              merger.merge(inputs, output));
+
+    for (auto const f : inputs) ASSERT_TRUE(NoError(f->Delete()));
+    ASSERT_TRUE(NoError(output.Delete()));
+}
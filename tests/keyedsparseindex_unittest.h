@@ -0,0 +1,92 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/keyedsparseindex.h"
+
+// A random key of length bytes.
+std::string RandomKey(XORShiftEngine& gen, std::size_t const length)
+{
+    std::string key(length, 0);
+    for (auto& c : key) c = static_cast<char>(gen());
+    return key;
+}
+
+TEST(KeyedSparseIndexTest, InsertGetErase)
+{
+    // 2^12 positions at three quarters full, so that many keys probe.
+    KeyedSparseIndex<> index(12, 32);
+    XORShiftEngine gen(5);
+    std::map<std::string, std::uint64_t> expected;
+    KeyedSparseIndex<>::return_type previous;
+    while (expected.size() < 3072)
+    {
+        auto const key = RandomKey(gen, 32);
+        auto const value = expected.size();
+        ASSERT_TRUE(NoError(index.insert(key, value, previous)));
+        ASSERT_FALSE(previous.second);
+        expected[key] = value;
+    }
+    ASSERT_EQ(expected.size(), index.num_nonempty());
+    ASSERT_GT(index.max_distance(), 0U);
+    for (auto const& e : expected)
+        ASSERT_EQ(std::make_pair(e.second, true), index.get(e.first));
+    ASSERT_FALSE(index.get(RandomKey(gen, 32)).second);
+
+    // Overwrite a key, then erase every other key and check the rest are
+    // still reachable past the gaps.
+    auto const first = expected.begin()->first;
+    ASSERT_TRUE(NoError(index.insert(first, 12345, previous)));
+    ASSERT_EQ(std::make_pair(expected[first], true), previous);
+    expected[first] = 12345;
+    bool odd = false;
+    for (auto it = expected.begin(); it != expected.end();)
+    {
+        if ((odd = !odd))
+        {
+            ASSERT_EQ(std::make_pair(it->second, true), index.erase(it->first));
+            it = expected.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    ASSERT_EQ(expected.size(), index.num_nonempty());
+    for (auto const& e : expected)
+        ASSERT_EQ(std::make_pair(e.second, true), index.get(e.first));
+
+    ASSERT_EQ(make_error_condition(db_error::key_wrong_length),
+              index.insert("short", 1, previous));
+    ASSERT_EQ(make_error_condition(db_error::value_too_long),
+              index.insert(first, KeyedSparseIndex<>::MAX_VALUE + 1,
+                           previous));
+}
+
+TEST(KeyedSparseIndexTest, FingerprintCollisions)
+{
+    KeyedSparseIndex<> index(8, 16);
+    // Keys that share prefix and fingerprint, told apart by their values.
+    std::string a(16, 'x'), b(16, 'x');
+    b[15] = 'y';
+    auto isA = [](std::uint64_t v) { return v == 1; };
+    auto isB = [](std::uint64_t v) { return v == 2; };
+    KeyedSparseIndex<>::return_type previous;
+    ASSERT_TRUE(NoError(index.insert(a, 1, previous, isA)));
+    ASSERT_TRUE(NoError(index.insert(b, 2, previous, isB)));
+    ASSERT_FALSE(previous.second);
+    ASSERT_EQ(2U, index.num_nonempty());
+    ASSERT_EQ(std::make_pair(std::uint64_t(1), true), index.get(a, isA));
+    ASSERT_EQ(std::make_pair(std::uint64_t(2), true), index.get(b, isB));
+    ASSERT_TRUE(index.erase(a, isA).second);
+    ASSERT_FALSE(index.get(a, isA).second);
+    ASSERT_EQ(std::make_pair(std::uint64_t(2), true), index.get(b, isB));
+
+    // A full neighbourhood reports index_full.
+    KeyedSparseIndex<> tiny(1, 8);
+    ASSERT_TRUE(NoError(tiny.insert(std::string(8, 'a'), 1, previous)));
+    ASSERT_TRUE(NoError(tiny.insert(std::string(8, 'b'), 2, previous)));
+    ASSERT_EQ(make_error_condition(db_error::index_full),
+              tiny.insert(std::string(8, 'c'), 3, previous));
+}
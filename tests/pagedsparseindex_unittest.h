@@ -0,0 +1,155 @@
+#pragma once
+
+#include <map>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/pagedsparseindex.h"
+
+TEST(PagedSparseIndexTest, InsertEraseAndReopen)
+{
+    using Index = PagedSparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 16;
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    std::map<std::size_t, std::uint64_t> expected;
+    {
+        // Four frames for sixteen pages, so that most faults evict.
+        Index index(4);
+        ASSERT_TRUE(NoError(index.create(file, N)));
+        ASSERT_EQ(N / (64 * Index::PAGE_GROUPS), index.num_pages());
+        XORShiftEngine gen(1);
+        std::uniform_int_distribution<std::size_t> dist(0, N - 1);
+        Index::return_type result;
+        for (std::size_t i = 0; i < N; i++)
+        {
+            auto const pos = dist(gen);
+            ASSERT_TRUE(NoError(index.insert(pos, i, result)));
+            ASSERT_EQ(expected.count(pos) != 0, result.second);
+            expected[pos] = i;
+            if (i % 3 == 0)
+            {
+                auto const victim = dist(gen);
+                ASSERT_TRUE(NoError(index.erase(victim, result)));
+                ASSERT_EQ(expected.erase(victim) != 0, result.second);
+            }
+        }
+        for (std::size_t pos = 0; pos < N; pos++)
+        {
+            ASSERT_TRUE(NoError(index.get(pos, result)));
+            auto const it = expected.find(pos);
+            ASSERT_EQ(it != expected.end(), result.second);
+            if (result.second)
+            {
+                ASSERT_EQ(it->second, result.first);
+            }
+        }
+        auto const &stats = index.stats();
+        ASSERT_GT(stats.evictions, 0U);
+        ASSERT_GT(stats.hits, stats.misses);
+        ASSERT_EQ(stats.misses, stats.evictions + 4);
+        ASSERT_TRUE(NoError(index.flush()));
+    }
+    {
+        Index index(2);
+        ASSERT_TRUE(NoError(index.open(file)));
+        ASSERT_EQ(N, index.size());
+        Index::return_type result;
+        for (std::size_t pos = 0; pos < N; pos++)
+        {
+            ASSERT_TRUE(NoError(index.get(pos, result)));
+            auto const it = expected.find(pos);
+            ASSERT_EQ(it != expected.end(), result.second);
+            if (result.second)
+            {
+                ASSERT_EQ(it->second, result.first);
+            }
+        }
+        ASSERT_EQ(index.num_pages(), index.stats().reads);
+        ASSERT_EQ(0U, index.stats().writes);
+    }
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(PagedSparseIndexTest, WriteBackWithoutFlush)
+{
+    using Index = PagedSparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 14;
+    File file("testdb");
+    File other("testdb2");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(other.Open(true)));
+    Index::return_type result;
+    {
+        // Switching files writes back the dirty pages of the first, and
+        // the destructor those of the second.
+        Index index(4);
+        ASSERT_TRUE(NoError(index.create(file, N)));
+        for (std::size_t pos = 0; pos < N; pos += 7)
+            ASSERT_TRUE(NoError(index.insert(pos, pos + 1, result)));
+        ASSERT_TRUE(NoError(index.create(other, N)));
+        for (std::size_t pos = 0; pos < N; pos += 5)
+            ASSERT_TRUE(NoError(index.insert(pos, pos + 2, result)));
+    }
+    Index index(4);
+    ASSERT_TRUE(NoError(index.open(file)));
+    for (std::size_t pos = 0; pos < N; pos++)
+    {
+        ASSERT_TRUE(NoError(index.get(pos, result)));
+        ASSERT_EQ(pos % 7 == 0, result.second);
+        if (result.second)
+        {
+            ASSERT_EQ(pos + 1, result.first);
+        }
+    }
+    ASSERT_TRUE(NoError(index.open(other)));
+    for (std::size_t pos = 0; pos < N; pos++)
+    {
+        ASSERT_TRUE(NoError(index.get(pos, result)));
+        ASSERT_EQ(pos % 5 == 0, result.second);
+        if (result.second)
+        {
+            ASSERT_EQ(pos + 2, result.first);
+        }
+    }
+    ASSERT_TRUE(NoError(index.close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+    ASSERT_TRUE(NoError(other.Delete()));
+}
+
+TEST(PagedSparseIndexTest, DamagedDirectory)
+{
+    using Index = PagedSparseIndex<SparseVector<std::uint64_t>>;
+    const std::size_t N = 1ULL << 14;
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    Index::return_type result;
+    {
+        Index index(4);
+        ASSERT_TRUE(NoError(index.create(file, N)));
+        for (std::size_t pos = 0; pos < N; pos += 3)
+            ASSERT_TRUE(NoError(index.insert(pos, pos, result)));
+        ASSERT_TRUE(NoError(index.close()));
+    }
+    // The directory follows the size and page count, an entry being the
+    // page's offset, length and capacity.
+    const std::uint64_t entry = 2 * sizeof(std::uint64_t);
+    std::uint32_t length;
+    ASSERT_TRUE(NoError(file.ReadAt(entry + 8, &length, sizeof(length))));
+    // A page shorter than its bitmaps, then one longer than its payloads.
+    for (std::uint32_t damaged : {8U, length + 8})
+    {
+        ASSERT_TRUE(NoError(file.WriteAt(entry + 8, &damaged, 4)));
+        Index index(4);
+        ASSERT_TRUE(NoError(index.open(file)));
+        ASSERT_EQ(make_error_condition(db_error::corrupt_file),
+                  index.get(0, result));
+        ASSERT_TRUE(NoError(index.get(N - 1, result)));
+    }
+    // A page past the end of the file.
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Size(size)));
+    ASSERT_TRUE(NoError(file.WriteAt(entry + 8, &length, 4)));
+    ASSERT_TRUE(NoError(file.WriteAt(entry, &size, sizeof(size))));
+    Index index(4);
+    ASSERT_EQ(make_error_condition(db_error::corrupt_file), index.open(file));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
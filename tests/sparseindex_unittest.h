@@ -1,11 +1,16 @@
 #pragma once
 
+#include <map>
 #include <random>
 #include <cstdio>
+#include <thread>
 #include "gtest/gtest.h"
 #include "sparsedb/file.h"
 #include "sparsedb/sparsevector.h"
 #include "sparsedb/sparseindex.h"
+#include "sparsedb/mappedsparseindex.h"
+#include "sparsedb/lazysparseindex.h"
+#include "sparsedb/packedvector.h"
 #include "sparsedb/xorshift.h"
 
 using namespace sparsedb;
@@ -63,6 +68,51 @@ void TestRandomInsertAndGet(T& store, std::size_t const factor)
     }
 }
 
+template <class T>
+void TestErase(T& store, std::size_t const N)
+{
+    store.clear();
+    std::uint64_t value;
+    bool exists;
+    for (std::size_t i = 0; i < N; i++) store.insert(i, i);
+    std::tie(value, exists) = store.insert(0, 42);
+    ASSERT_TRUE(exists);
+    ASSERT_EQ(0ULL, value);
+    for (std::size_t i = 0; i < N; i += 2)
+    {
+        std::tie(value, exists) = store.erase(i);
+        ASSERT_TRUE(exists);
+        ASSERT_EQ(i ? i : 42, value);
+        std::tie(value, exists) = store.erase(i);
+        ASSERT_FALSE(exists);
+    }
+    ASSERT_EQ(N / 2, store.num_nonempty());
+    for (std::size_t i = 0; i < N; i++)
+    {
+        std::tie(value, exists) = store.get(i);
+        ASSERT_EQ(i % 2 == 1, exists);
+        ASSERT_EQ(i % 2 ? i : 0, value);
+    }
+    for (std::size_t i = 1; i < N; i += 2) store.erase(i);
+    ASSERT_EQ(0ULL, store.num_nonempty());
+}
+
+template <class T>
+void TestBatchGet(T& store)
+{
+    const auto N = store.size();
+    std::uniform_int_distribution<uint64_t> posDist(0, N - 1);
+    XORShiftEngine gen;
+    gen.seed(5678);
+    std::vector<std::size_t> positions(N / 8);
+    for (auto& pos : positions) pos = posDist(gen);
+    std::vector<typename T::return_type> results;
+    store.get_batch(positions, results);
+    ASSERT_EQ(positions.size(), results.size());
+    for (std::size_t i = 0; i < positions.size(); i++)
+        ASSERT_EQ(store.get(positions[i]), results[i]);
+}
+
 TEST(SparseVectorTest, Uint64)
 {
     SparseVector<std::uint64_t> values;
@@ -71,11 +121,316 @@ TEST(SparseVectorTest, Uint64)
     // std::cout << values.to_string();
 }
 
+TEST(SparseVectorTest, Erase)
+{
+    SparseVector<std::uint64_t> values;
+    TestErase(values, values.max_size());
+
+    // Alternating inserts and erases must settle on one allocation.
+    using Allocator = SparseVector<std::uint64_t>::allocator_type;
+    for (std::size_t i = 0; i < 5; i++) values.insert(i, i);
+    auto used = Allocator::stats().used;
+    for (std::size_t i = 0; i < 100; i++)
+    {
+        values.insert(10, i);
+        values.erase(10);
+        values.erase(4);
+        values.insert(4, i);
+        ASSERT_EQ(used, Allocator::stats().used);
+    }
+    // Erasing most values shrinks the allocation.
+    for (std::size_t i = 0; i < 64; i++) values.insert(i, i);
+    used = Allocator::stats().used;
+    for (std::size_t i = 1; i < 64; i++) values.erase(i);
+    ASSERT_LT(Allocator::stats().used, used);
+    ASSERT_EQ(std::make_pair(std::uint64_t(0), true), values.get(0));
+}
+
+TEST(SparseVectorTest, Inline)
+{
+    using Vector = SparseVector<std::uint32_t>;
+    using Allocator = Vector::allocator_type;
+    ASSERT_EQ(2, Vector::INLINE_SIZE);
+    Vector values;
+    auto used = Allocator::stats().used;
+    values.insert(40, 40);
+    values.insert(20, 20);
+    ASSERT_TRUE(values.is_inline());
+    ASSERT_EQ(used, Allocator::stats().used);
+    // Spill to the heap and back again, keeping the values in order.
+    values.insert(30, 30);
+    ASSERT_FALSE(values.is_inline());
+    ASSERT_LT(used, Allocator::stats().used);
+    values.erase(20);
+    ASSERT_TRUE(values.is_inline());
+    ASSERT_EQ(used, Allocator::stats().used);
+    ASSERT_EQ(std::make_pair(std::uint32_t(30), true), values.get(30));
+    ASSERT_EQ(std::make_pair(std::uint32_t(40), true), values.get(40));
+    ASSERT_EQ(std::make_pair(std::uint32_t(0), false), values.get(20));
+    TestErase(values, values.max_size());
+    ASSERT_EQ(used, Allocator::stats().used);
+}
+
+TEST(SparseVectorTest, MallocAllocator)
+{
+    SparseVector<std::uint64_t, 64, MallocAllocator<std::uint64_t>> values;
+    TestInsertAndGet(values);
+    TestRandomInsertAndGet(values, 1);
+}
+
+TEST(SparseVectorTest, WideGroups)
+{
+    SparseVector<std::uint64_t, 256> values;
+    TestErase(values, values.max_size());
+    for (std::size_t i = 255; i < 256; i -= 3) values.insert(i, i);
+    for (std::size_t i = 0; i < 256; i++)
+    {
+        auto const exists = (255 - i) % 3 == 0;
+        ASSERT_EQ(std::make_pair(std::uint64_t(exists ? i : 0), exists),
+                  values.get(i));
+    }
+}
+
+TEST(PackedVectorTest, Uint64)
+{
+    PackedVector<std::uint64_t> values;
+    TestErase(values, values.max_size());
+
+    // Values close to a large base pack into a few bits each.
+    const std::uint64_t base = 1ULL << 40;
+    for (std::size_t i = 0; i < 64; i += 2) values.insert(i, base + i * 3);
+    ASSERT_EQ(8U, values.width());
+    ASSERT_EQ((2 + 4) * sizeof(std::uint64_t), values.size());
+    for (std::size_t i = 0; i < 64; i++)
+    {
+        auto const exists = i % 2 == 0;
+        ASSERT_EQ(std::make_pair(exists ? base + i * 3 : 0, exists),
+                  values.get(i));
+    }
+    // A value below the base moves the frame and widens it.
+    values.insert(1, 0);
+    ASSERT_EQ(41U, values.width());
+    ASSERT_EQ(std::make_pair(std::uint64_t(0), true), values.get(1));
+    ASSERT_EQ(std::make_pair(base + 186, true), values.get(62));
+    values.erase(1);
+    ASSERT_EQ(8U, values.width());
+    values.insert(63, ~0ULL);
+    ASSERT_EQ(64U, values.width());
+    ASSERT_EQ(std::make_pair(~std::uint64_t(0), true), values.get(63));
+    ASSERT_EQ(std::make_pair(base, true), values.get(0));
+}
+
+TEST(PackedVectorTest, Int32)
+{
+    PackedVector<std::int32_t, 128> values;
+    for (std::size_t i = 0; i < 128; i++)
+        values.insert(i, static_cast<std::int32_t>(i) - 64);
+    ASSERT_EQ(7U, values.width());
+    for (std::size_t i = 0; i < 128; i++)
+    {
+        ASSERT_EQ(std::make_pair(static_cast<std::int32_t>(i) - 64, true),
+                  values.get(i));
+    }
+}
+
+TEST(SparseIndexTest, AllocatorStats)
+{
+    using Vector = SparseVector<std::uint32_t>;
+    auto before = Vector::allocator_type::stats();
+    {
+        SparseIndex<Vector> index(1ULL << 16);
+        TestInsertAndGet(index);
+        auto stats = index.allocator_stats();
+        ASSERT_EQ(before.used + index.size() * sizeof(std::uint32_t),
+                  stats.used);
+        ASSERT_LE(stats.used, stats.reserved);
+    }
+    // Freed blocks are recycled rather than returned to the system.
+    auto after = Vector::allocator_type::stats();
+    ASSERT_EQ(before.used, after.used);
+    ASSERT_LE(before.reserved, after.reserved);
+}
+
+TEST(SparseIndexTest, BulkLoad)
+{
+    const std::size_t N = 1ULL << 20;
+    std::uniform_int_distribution<uint64_t> posDist(0, N - 1);
+    XORShiftEngine gen;
+    std::vector<std::pair<std::size_t, std::uint64_t>> pairs(N / 4);
+    for (std::size_t i = 0; i < pairs.size(); i++)
+        pairs[i] = std::make_pair(posDist(gen), i);
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [](std::pair<std::size_t, std::uint64_t> const& a,
+                        std::pair<std::size_t, std::uint64_t> const& b)
+                     {
+        return a.first < b.first;
+    });
+
+    SparseIndex<SparseVector<std::uint64_t>> inserted(N);
+    for (auto const& p : pairs) inserted.insert(p.first, p.second);
+    SparseIndex<SparseVector<std::uint64_t>> loaded(N);
+    loaded.bulk_load(pairs.begin(), pairs.end());
+    ASSERT_TRUE(inserted == loaded);
+    ThreadPool pool(4);
+    loaded.bulk_load(pairs.begin(), pairs.end(), pool);
+    ASSERT_TRUE(inserted == loaded);
+}
+
+TEST(SparseIndexTest, Iterate)
+{
+    SparseIndex<SparseVector<std::uint64_t>> index(1ULL << 20);
+    ASSERT_TRUE(index.begin() == index.end());
+    TestRandomInsertAndGet(index, 100);
+
+    std::vector<std::pair<std::size_t, std::uint64_t>> expected;
+    for (std::size_t i = 0; i < index.size(); i++)
+        if (index.has(i))
+            expected.emplace_back(i, index.get(i).first);
+    std::vector<std::pair<std::size_t, std::uint64_t>> actual(index.begin(),
+                                                              index.end());
+    ASSERT_TRUE(expected == actual);
+
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> posDist(0, index.size());
+    for (std::size_t i = 0; i < 100; i++)
+    {
+        auto lo = posDist(gen), hi = posDist(gen);
+        actual.clear();
+        index.for_each_in_range(lo, hi, [&](std::size_t pos, std::uint64_t v)
+                                {
+            actual.emplace_back(pos, v);
+        });
+        auto first = std::lower_bound(
+            expected.begin(), expected.end(),
+            std::make_pair(std::size_t(lo), std::uint64_t(0)));
+        auto last = std::lower_bound(
+            expected.begin(), expected.end(),
+            std::make_pair(std::size_t(std::max(lo, hi)), std::uint64_t(0)));
+        ASSERT_TRUE(std::equal(first, last, actual.begin(), actual.end()));
+        auto it = index.lower_bound(lo);
+        if (first == expected.end())
+        {
+            ASSERT_TRUE(it == index.end());
+        }
+        else
+        {
+            ASSERT_EQ(*first, *it);
+        }
+    }
+}
+
+template <class T>
+void TestRankSelect(T const& index)
+{
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < index.size(); i++)
+    {
+        ASSERT_EQ(count, index.rank(i));
+        if (index.has(i))
+        {
+            ASSERT_EQ(i, index.select(count++));
+        }
+    }
+    ASSERT_EQ(count, index.rank(index.size()));
+    ASSERT_EQ(count, index.num_nonempty());
+    ASSERT_EQ(index.size(), index.select(count));
+}
+
+TEST(SparseIndexTest, RankSelect)
+{
+    SparseIndex<SparseVector<std::uint64_t>> index(1ULL << 18);
+    TestRankSelect(index);
+    TestRandomInsertAndGet(index, 20);
+    TestRankSelect(index);
+    // The directory must follow inserts and erases.
+    for (std::size_t i = 0; i < index.size(); i += 3) index.erase(i);
+    TestRankSelect(index);
+    for (std::size_t i = 0; i < index.size(); i += 7) index.insert(i, i);
+    TestRankSelect(index);
+}
+
+// Checks every set operation and its count against std::map, with a and b
+// overlapping on every sixth position.
+template <class T>
+void TestSetOperations()
+{
+    const std::size_t N = 1 << 16;
+    SparseIndex<T> a(N), b(N), out(N);
+    std::map<std::size_t, std::uint64_t> ma, mb;
+    for (std::size_t i = 0; i < N; i += 2)
+    {
+        a.insert(i, i);
+        ma[i] = i;
+    }
+    for (std::size_t i = 0; i < N / 2; i += 3)
+    {
+        b.insert(i, i + 1);
+        mb[i] = i + 1;
+    }
+    auto sum = [](std::uint64_t const x, std::uint64_t const y)
+    {
+        return x + y;
+    };
+    auto check = [&](std::map<std::size_t, std::uint64_t> const &expected)
+    {
+        ASSERT_EQ(expected.size(), out.num_nonempty());
+        for (auto const &e : expected)
+            ASSERT_EQ(std::make_pair(e.second, true), out.get(e.first));
+    };
+
+    std::map<std::size_t, std::uint64_t> expected;
+    for (auto const &e : ma)
+        if (mb.count(e.first))
+            expected[e.first] = e.second + mb[e.first];
+    ASSERT_EQ(expected.size(), SparseIndex<T>::intersect_count(a, b));
+    out.intersect(a, b, sum);
+    check(expected);
+
+    expected = mb;
+    for (auto const &e : ma) expected[e.first] += e.second;
+    ASSERT_EQ(expected.size(), SparseIndex<T>::unite_count(a, b));
+    out.unite(a, b, sum);
+    check(expected);
+
+    expected.clear();
+    for (auto const &e : ma)
+        if (!mb.count(e.first))
+            expected[e.first] = e.second;
+    ASSERT_EQ(expected.size(), SparseIndex<T>::subtract_count(a, b));
+    out.subtract(a, b);
+    check(expected);
+    // In place, leaving b untouched.
+    a.subtract(a, b);
+    ASSERT_TRUE(a == out);
+    ASSERT_EQ(mb.size(), b.num_nonempty());
+}
+
+TEST(SparseIndexTest, SetOperations)
+{
+    TestSetOperations<SparseVector<std::uint64_t>>();
+    TestSetOperations<SparseVector<std::uint64_t, 256>>();
+    TestSetOperations<PackedVector<std::uint64_t>>();
+
+    // The vector and scalar kernels agree, including on a partial vector.
+    std::vector<std::uint64_t> a(37), b(37), out1(37), out2(37);
+    XORShiftEngine gen(3);
+    for (auto &w : a) w = gen();
+    for (auto &w : b) w = gen();
+    ASSERT_EQ(detail::combine_scalar<SetOp::UNITE>(a.data(), b.data(),
+                                                   out1.data(), a.size()),
+              bitmap_combine<SetOp::UNITE>(a.data(), b.data(), out2.data(),
+                                           a.size()));
+    ASSERT_EQ(out1, out2);
+}
+
 TEST(SparseIndexTest, Uint64)
 {
     SparseIndex<SparseVector<std::uint64_t>> index1(1ULL << 24);
     TestInsertAndGet(index1);
     TestRandomInsertAndGet(index1, 4);
+    TestBatchGet(index1);
+    TestErase(index1, index1.size());
+    TestRandomInsertAndGet(index1, 4);
 
     File file("testdb");
     ASSERT_TRUE(NoError(file.Open()));
@@ -88,4 +443,492 @@ TEST(SparseIndexTest, Uint64)
     ASSERT_TRUE(index1 == index2);
     ASSERT_TRUE(NoError(file.Delete()));
     // std::cout << index2;
-}
\ No newline at end of file
+}
+
+TEST(SparseIndexTest, ParallelReadWrite)
+{
+    SparseIndex<SparseVector<std::uint64_t>> index1(1ULL << 22);
+    TestRandomInsertAndGet(index1, 8);
+    ThreadPool pool(4);
+
+    File serial("testdb");
+    ASSERT_TRUE(NoError(serial.Open(true)));
+    ASSERT_TRUE(NoError(index1.write(serial)));
+    File parallel("testdb.parallel");
+    ASSERT_TRUE(NoError(parallel.Open(true)));
+    ASSERT_TRUE(NoError(index1.write(parallel, pool)));
+
+    // Both writers must produce the same bytes.
+    std::uint64_t serialSize, parallelSize;
+    ASSERT_TRUE(NoError(serial.Size(serialSize)));
+    ASSERT_TRUE(NoError(parallel.Size(parallelSize)));
+    ASSERT_EQ(serialSize, parallelSize);
+    std::vector<char> serialBytes(serialSize), parallelBytes(parallelSize);
+    ASSERT_TRUE(NoError(serial.ReadAt(0, serialBytes.data(), serialSize)));
+    ASSERT_TRUE(
+        NoError(parallel.ReadAt(0, parallelBytes.data(), parallelSize)));
+    ASSERT_TRUE(serialBytes == parallelBytes);
+
+    SparseIndex<SparseVector<std::uint64_t>> index2(0);
+    ASSERT_TRUE(NoError(index2.read(serial, pool)));
+    ASSERT_TRUE(index1 == index2);
+    ASSERT_TRUE(NoError(serial.Close()));
+    ASSERT_TRUE(NoError(serial.Delete()));
+    ASSERT_TRUE(NoError(parallel.Close()));
+    ASSERT_TRUE(NoError(parallel.Delete()));
+}
+
+#if SPARSEDB_URING
+void TestUringReadWrite(std::size_t const queueDepth)
+{
+    SparseIndex<SparseVector<std::uint64_t>> index1(1ULL << 22);
+    TestRandomInsertAndGet(index1, 8);
+
+    UringFile file("testdb", queueDepth);
+    if (!queueDepth)
+    {
+        ASSERT_FALSE(file.Async());
+    }
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index1.write(file)));
+
+    // The file must be readable by both the plain and io_uring readers.
+    SparseIndex<SparseVector<std::uint64_t>> index2(0);
+    ASSERT_TRUE(NoError(index2.read(static_cast<File&>(file))));
+    ASSERT_TRUE(index1 == index2);
+    SparseIndex<SparseVector<std::uint64_t>> index3(0);
+    ASSERT_TRUE(NoError(index3.read(file)));
+    ASSERT_TRUE(index1 == index3);
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(SparseIndexTest, UringReadWrite)
+{
+    TestUringReadWrite(32);
+    TestUringReadWrite(0);
+}
+#endif
+
+TEST(SparseIndexTest, WideGroups)
+{
+    // Not a multiple of any group width, so that the last group is partial.
+    const std::size_t N = (1ULL << 20) - 100;
+    SparseIndex<SparseVector<std::uint64_t, 512>> index1(N);
+    TestInsertAndGet(index1);
+    TestErase(index1, N);
+    TestRandomInsertAndGet(index1, 4);
+    TestBatchGet(index1);
+    TestRankSelect(index1);
+
+    // Iteration must match an index of 64 wide groups with the same values.
+    SparseIndex<SparseVector<std::uint64_t>> narrow(N);
+    for (auto const& p : index1) narrow.insert(p.first, p.second);
+    ASSERT_EQ(index1.num_nonempty(), narrow.num_nonempty());
+    ASSERT_TRUE(std::equal(index1.begin(), index1.end(), narrow.begin(),
+                           narrow.end()));
+    std::vector<std::pair<std::size_t, std::uint64_t>> wide, expected;
+    auto collect = [](std::vector<std::pair<std::size_t, std::uint64_t>>& v)
+    {
+        return [&v](std::size_t pos, std::uint64_t value)
+        {
+            v.emplace_back(pos, value);
+        };
+    };
+    index1.for_each_in_range(1000, N - 1000, collect(wide));
+    narrow.for_each_in_range(1000, N - 1000, collect(expected));
+    ASSERT_TRUE(wide == expected);
+    ASSERT_EQ(*narrow.lower_bound(777), *index1.lower_bound(777));
+
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index1.write(file)));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Open()));
+    SparseIndex<SparseVector<std::uint64_t, 512>> index2(0);
+    ASSERT_TRUE(NoError(index2.read(file)));
+    ASSERT_TRUE(index1 == index2);
+    MappedSparseIndex<SparseVector<std::uint64_t, 512>> mapped;
+    ASSERT_TRUE(NoError(mapped.open(file)));
+    ASSERT_EQ(index1.num_nonempty(), mapped.num_nonempty());
+    for (std::size_t i = 0; i < N; i++)
+    {
+        ASSERT_EQ(index1.get(i), mapped.get(i));
+    }
+    ASSERT_TRUE(NoError(mapped.close()));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(SparseIndexTest, PackedVector)
+{
+    const std::size_t N = 1ULL << 20;
+    SparseIndex<PackedVector<std::uint64_t>> index(N);
+    TestInsertAndGet(index);
+    TestErase(index, N);
+    TestRandomInsertAndGet(index, 4);
+    TestBatchGet(index);
+    TestRankSelect(index);
+
+    // The same contents as a plain index, however they were built.
+    SparseIndex<SparseVector<std::uint64_t>> plain(N);
+    std::vector<std::pair<std::size_t, std::uint64_t>> pairs(index.begin(),
+                                                             index.end());
+    for (auto const& p : pairs) plain.insert(p.first, p.second);
+    ASSERT_EQ(index.num_nonempty(), plain.num_nonempty());
+    ASSERT_TRUE(std::equal(index.begin(), index.end(), plain.begin(),
+                           plain.end()));
+    SparseIndex<PackedVector<std::uint64_t>> loaded(N);
+    loaded.bulk_load(pairs.begin(), pairs.end());
+    ASSERT_TRUE(index == loaded);
+}
+
+TEST(SparseIndexTest, Snapshot)
+{
+    using Index = SparseIndex<SparseVector<std::uint64_t>>;
+    using Pairs = std::vector<std::pair<std::size_t, std::uint64_t>>;
+    auto const used = Index(0).allocator_stats().used;
+    {
+        Index index(1ULL << 20);
+        TestRandomInsertAndGet(index, 4);
+        Pairs const expected(index.begin(), index.end());
+        auto snapshot = index.snapshot();
+
+        // Write the snapshot in the background while the index changes.
+        File file("testdb");
+        ASSERT_TRUE(NoError(file.Open(true)));
+        std::error_condition err;
+        std::thread writer([&]()
+                           {
+            err = snapshot->write(file);
+        });
+        for (std::size_t i = 0; i < index.size(); i += 3) index.erase(i);
+        for (std::size_t i = 0; i < index.size(); i += 5) index.insert(i, 0);
+        writer.join();
+        ASSERT_TRUE(NoError(err));
+        ASSERT_TRUE(Pairs(snapshot->begin(), snapshot->end()) == expected);
+        ASSERT_EQ(expected.size(), snapshot->num_nonempty());
+        ASSERT_FALSE(*snapshot == index);
+
+        ASSERT_TRUE(NoError(file.Close()));
+        ASSERT_TRUE(NoError(file.Open()));
+        Index loaded(0);
+        ASSERT_TRUE(NoError(loaded.read(file)));
+        ASSERT_TRUE(loaded == *snapshot);
+        ASSERT_TRUE(NoError(file.Close()));
+        ASSERT_TRUE(NoError(file.Delete()));
+
+        // A second snapshot while the first is alive, then clearing and
+        // dropping the index before the snapshots.
+        Pairs const changed(index.begin(), index.end());
+        auto second = index.snapshot();
+        index.insert(1, 1);
+        index.clear();
+        ASSERT_TRUE(Pairs(second->begin(), second->end()) == changed);
+        ASSERT_TRUE(Pairs(snapshot->begin(), snapshot->end()) == expected);
+        index.insert(2, 2);
+        auto third = index.snapshot();
+        snapshot.reset();
+        index.insert(2, 3);
+        ASSERT_EQ(std::make_pair(std::uint64_t(2), true), third->get(2));
+        ASSERT_EQ(std::make_pair(std::uint64_t(3), true), index.get(2));
+    }
+    // Every payload has been freed exactly once.
+    ASSERT_EQ(used, Index(0).allocator_stats().used);
+}
+
+TEST(SparseIndexTest, Checksums)
+{
+    // Both implementations against the standard check value.
+    const std::string digits("123456789");
+    ASSERT_EQ(0xE3069283U, crc32c(digits.data(), digits.size()));
+    std::vector<std::uint8_t> data(1000);
+    XORShiftEngine gen(9);
+    for (auto &b : data) b = static_cast<std::uint8_t>(gen());
+    for (std::size_t length : {0, 1, 7, 8, 9, 63, 1000})
+    {
+        ASSERT_EQ(detail::crc32c_sw(data.data(), length, 0x12345678U),
+                  detail::crc32c_hw(data.data(), length, 0x12345678U));
+    }
+    ASSERT_EQ(crc32c(data.data() + 100, 900, crc32c(data.data(), 100)),
+              crc32c(data.data(), 1000));
+
+    using Index = SparseIndex<SparseVector<std::uint64_t>>;
+    Index index(1ULL << 22);
+    TestRandomInsertAndGet(index, 8);
+    ThreadPool pool(4);
+    auto damage = [](std::uint64_t const offset, void const *data,
+                     std::size_t const length)
+    {
+        File file("testdb");
+        ASSERT_TRUE(NoError(file.Open()));
+        ASSERT_TRUE(NoError(file.WriteAt(offset, data, length)));
+        ASSERT_TRUE(NoError(file.Close()));
+    };
+    auto read = [&](bool const parallel)
+    {
+        File file("testdb");
+        Index loaded(0);
+        auto err = file.Open();
+        if (!err)
+            err = parallel ? loaded.read(file, pool) : loaded.read(file);
+        file.Close();
+        return err;
+    };
+    auto corrupt = make_error_condition(db_error::corrupt_file);
+
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index.write(file)));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(read(false)));
+    ASSERT_TRUE(NoError(read(true)));
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Open()));
+    ASSERT_TRUE(NoError(file.Size(size)));
+    ASSERT_TRUE(NoError(file.Close()));
+
+    // A flipped byte in the payloads, as left by a torn write.
+    std::uint8_t byte;
+    ASSERT_TRUE(NoError(file.Open()));
+    ASSERT_TRUE(NoError(file.ReadAt(size / 2, &byte, 1)));
+    ASSERT_TRUE(NoError(file.Close()));
+    byte ^= 0x10;
+    damage(size / 2, &byte, 1);
+    ASSERT_EQ(corrupt, read(false));
+    ASSERT_EQ(corrupt, read(true));
+    MappedSparseIndex<SparseVector<std::uint64_t>> mapped;
+    ASSERT_TRUE(NoError(file.Open()));
+    ASSERT_TRUE(NoError(mapped.open(file)));
+    ASSERT_EQ(corrupt, mapped.verify());
+    ASSERT_TRUE(NoError(mapped.close()));
+    ASSERT_TRUE(NoError(file.Close()));
+    byte ^= 0x10;
+    damage(size / 2, &byte, 1);
+    ASSERT_TRUE(NoError(read(true)));
+
+    // A damaged header, and one from a later version.
+    IndexHeader header;
+    ASSERT_TRUE(NoError(file.Open()));
+    ASSERT_TRUE(NoError(file.ReadAt(0, &header, sizeof(header))));
+    ASSERT_TRUE(NoError(file.Close()));
+    auto damaged = header;
+    damaged.size++;
+    damage(0, &damaged, sizeof(damaged));
+    ASSERT_EQ(corrupt, read(false));
+    damaged = header;
+    damaged.version++;
+    damaged.crc = damaged.checksum();
+    damage(0, &damaged, sizeof(damaged));
+    ASSERT_EQ(make_error_condition(db_error::bad_version), read(true));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(SparseIndexTest, Compression)
+{
+    // The codec on random, repetitive and empty input, and overlapping runs.
+    XORShiftEngine gen(3);
+    std::vector<std::uint8_t> random(100000), repeated(100000);
+    for (auto &b : random) b = static_cast<std::uint8_t>(gen());
+    for (std::size_t i = 0; i < repeated.size(); i++)
+        repeated[i] = static_cast<std::uint8_t>(i % 1000 < 600 ? 7 : i % 37);
+    for (auto const *input : {&random, &repeated})
+    {
+        for (std::size_t length : {0, 1, 5, 16, 1000, 100000})
+        {
+            std::vector<std::uint8_t> compressed(lz_bound(length));
+            std::vector<std::uint8_t> output(length);
+            auto const size =
+                lz_compress(input->data(), length, compressed.data());
+            ASSERT_LE(size, compressed.size());
+            ASSERT_TRUE(
+                lz_decompress(compressed.data(), size, output.data(), length));
+            ASSERT_TRUE(std::equal(output.begin(), output.end(),
+                                   input->begin()));
+            if (length > 16)
+            {
+                ASSERT_FALSE(lz_decompress(compressed.data(), size - 1,
+                                           output.data(), length));
+                ASSERT_FALSE(lz_decompress(compressed.data(), size,
+                                           output.data(), length - 1));
+            }
+            if (input == &repeated && length == 100000)
+            {
+                ASSERT_LT(size, length / 10);
+            }
+        }
+    }
+    std::vector<std::int32_t> ints = {0, -1, 1, INT32_MIN, INT32_MAX, 5};
+    std::vector<std::uint64_t> longs = {~0ULL, 0, 1ULL << 63, 12, 11};
+    std::vector<std::uint8_t> encoded(delta_bound<std::uint64_t>(8));
+    std::int32_t previousInt = 0;
+    auto end = delta_encode(ints.data(), ints.size(), previousInt,
+                            encoded.data());
+    std::vector<std::int32_t> decodedInts(ints.size());
+    previousInt = 0;
+    ASSERT_EQ(end, delta_decode(encoded.data(), end, decodedInts.data(),
+                                decodedInts.size(), previousInt));
+    ASSERT_TRUE(ints == decodedInts);
+    std::uint64_t previousLong = 0;
+    end = delta_encode(longs.data(), longs.size(), previousLong,
+                       encoded.data());
+    std::vector<std::uint64_t> decodedLongs(longs.size());
+    previousLong = 0;
+    ASSERT_EQ(end, delta_decode(encoded.data(), end, decodedLongs.data(),
+                                decodedLongs.size(), previousLong));
+    ASSERT_TRUE(longs == decodedLongs);
+    previousLong = 0;
+    ASSERT_EQ(nullptr, delta_decode(encoded.data(), end - 1,
+                                    decodedLongs.data(), decodedLongs.size(),
+                                    previousLong));
+
+    // A sparse index, read back by every reader from either writer.
+    using Index = SparseIndex<SparseVector<std::uint64_t>>;
+    Index index(1ULL << 22);
+    TestRandomInsertAndGet(index, 64);
+    ThreadPool pool(4);
+    std::uint64_t plainSize, serialSize, parallelSize;
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index.write(file)));
+    ASSERT_TRUE(NoError(file.Size(plainSize)));
+    ASSERT_TRUE(NoError(file.Truncate()));
+    ASSERT_TRUE(NoError(index.write_compressed(file)));
+    ASSERT_TRUE(NoError(file.Size(serialSize)));
+    ASSERT_LT(serialSize, plainSize / 2);
+    std::vector<char> serialBytes(serialSize);
+    ASSERT_TRUE(NoError(file.ReadAt(0, serialBytes.data(), serialSize)));
+    ASSERT_TRUE(NoError(file.Truncate()));
+    ASSERT_TRUE(NoError(index.write_compressed(file, pool)));
+    ASSERT_TRUE(NoError(file.Size(parallelSize)));
+    ASSERT_EQ(serialSize, parallelSize);
+    std::vector<char> parallelBytes(parallelSize);
+    ASSERT_TRUE(NoError(file.ReadAt(0, parallelBytes.data(), parallelSize)));
+    ASSERT_TRUE(serialBytes == parallelBytes);
+    ASSERT_TRUE(NoError(file.Close()));
+    {
+        Index loaded(0);
+        ASSERT_TRUE(NoError(file.Open()));
+        ASSERT_TRUE(NoError(loaded.read(file)));
+        ASSERT_TRUE(index == loaded);
+        ASSERT_TRUE(NoError(loaded.read(file, pool)));
+        ASSERT_TRUE(index == loaded);
+        ASSERT_TRUE(NoError(file.Close()));
+#if SPARSEDB_URING
+        UringFile uring("testdb", 32);
+        ASSERT_TRUE(NoError(uring.Open()));
+        ASSERT_TRUE(NoError(loaded.read(uring)));
+        ASSERT_TRUE(index == loaded);
+        ASSERT_TRUE(NoError(uring.Close()));
+#endif
+    }
+
+    // Damage to a block, and readers that do not know the format.
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(file.WriteAt(0, serialBytes.data(), serialSize)));
+    serialBytes[serialSize / 2] ^= 0x10;
+    ASSERT_TRUE(NoError(
+        file.WriteAt(serialSize / 2, &serialBytes[serialSize / 2], 1)));
+    Index loaded(0);
+    auto corrupt = make_error_condition(db_error::corrupt_file);
+    ASSERT_EQ(corrupt, loaded.read(file, pool));
+    MappedSparseIndex<SparseVector<std::uint64_t>> mapped;
+    ASSERT_EQ(make_error_condition(db_error::bad_version), mapped.open(file));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(MappedSparseIndexTest, Uint64)
+{
+    SparseIndex<SparseVector<std::uint64_t>> index(1ULL << 20);
+    TestRandomInsertAndGet(index, 4);
+
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index.write(file)));
+
+    MappedSparseIndex<SparseVector<std::uint64_t>> mapped;
+    ASSERT_TRUE(NoError(mapped.open(file)));
+    ASSERT_EQ(index.size(), mapped.size());
+    ASSERT_EQ(index.num_nonempty(), mapped.num_nonempty());
+    ASSERT_TRUE(NoError(mapped.verify()));
+    for (std::size_t i = 0; i < index.size(); i++)
+    {
+        ASSERT_EQ(index.has(i), mapped.has(i));
+        ASSERT_EQ(index.get(i), mapped.get(i));
+    }
+    ASSERT_TRUE(NoError(mapped.close()));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(LazySparseIndexTest, Uint64)
+{
+    using Vector = SparseVector<std::uint64_t>;
+    SparseIndex<Vector> index(1ULL << 20);
+    TestRandomInsertAndGet(index, 4);
+
+    File file("testdb");
+    ASSERT_TRUE(NoError(file.Open(true)));
+    ASSERT_TRUE(NoError(index.write_with_directory(file, 16)));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Open()));
+
+    // The other readers skip the directory.
+    SparseIndex<Vector> loaded(0);
+    ASSERT_TRUE(NoError(loaded.read(file)));
+    ASSERT_TRUE(index == loaded);
+    MappedSparseIndex<Vector> mapped;
+    ASSERT_TRUE(NoError(mapped.open(file)));
+    ASSERT_TRUE(NoError(mapped.verify()));
+    ASSERT_TRUE(NoError(mapped.close()));
+
+    // At most two reads for each uncached lookup, and none for a cached
+    // group.
+    for (std::size_t cacheGroups : {0, 8})
+    {
+        LazySparseIndex<Vector> lazy(cacheGroups);
+        ASSERT_TRUE(NoError(lazy.open(file)));
+        ASSERT_EQ(index.size(), lazy.size());
+        XORShiftEngine gen(7);
+        for (std::size_t i = 0; i < 10000; i++)
+        {
+            auto const pos = gen() % index.size();
+            auto const reads = lazy.stats().reads;
+            Vector::return_type result;
+            ASSERT_TRUE(NoError(lazy.get(pos, result)));
+            ASSERT_EQ(index.get(pos), result);
+            ASSERT_LE(lazy.stats().reads, reads + 2);
+            ASSERT_TRUE(NoError(lazy.get(pos ^ 1, result)));
+            ASSERT_EQ(index.get(pos ^ 1), result);
+            if (cacheGroups)
+            {
+                ASSERT_LE(lazy.stats().reads, reads + 2);
+            }
+        }
+        if (cacheGroups)
+        {
+            ASSERT_LE(10000U, lazy.stats().hits);
+        }
+        else
+        {
+            ASSERT_EQ(0U, lazy.stats().hits);
+        }
+    }
+
+    // A file without a directory, and a damaged directory.
+    LazySparseIndex<Vector> lazy;
+    File plain("testdb.plain");
+    ASSERT_TRUE(NoError(plain.Open(true)));
+    ASSERT_TRUE(NoError(index.write(plain)));
+    ASSERT_EQ(make_error_condition(db_error::bad_version), lazy.open(plain));
+    ASSERT_TRUE(NoError(plain.Close()));
+    ASSERT_TRUE(NoError(plain.Delete()));
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Size(size)));
+    std::uint64_t const offset = 12345;
+    ASSERT_TRUE(NoError(file.WriteAt(size - 12, &offset, sizeof(offset))));
+    ASSERT_EQ(make_error_condition(db_error::corrupt_file), lazy.open(file));
+    ASSERT_TRUE(NoError(file.Close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
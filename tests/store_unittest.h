@@ -0,0 +1,133 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/store.h"
+
+TEST(StoreTest, PutGetErase)
+{
+    Store store("testdb.store", 3);
+    ASSERT_TRUE(NoError(store.open()));
+    std::string value;
+    ASSERT_EQ(make_error_condition(db_error::key_wrong_length),
+              store.put("ab", "x"));
+    ASSERT_EQ(make_error_condition(db_error::zero_length_value),
+              store.put("abc", ""));
+    ASSERT_EQ(make_error_condition(db_error::value_too_long),
+              store.put("abc", std::string(Store::MAX_VALUE_LENGTH + 1, 'x')));
+    ASSERT_EQ(make_error_condition(db_error::key_not_found),
+              store.get("abc", value));
+    ASSERT_EQ(make_error_condition(db_error::key_not_found),
+              store.erase("abc"));
+
+    ASSERT_TRUE(NoError(store.put("abc", "first")));
+    ASSERT_TRUE(NoError(store.put("abd", std::string(100000, 'y'))));
+    ASSERT_TRUE(NoError(store.get("abc", value)));
+    ASSERT_EQ("first", value);
+    ASSERT_TRUE(NoError(store.put("abc", "second")));
+    ASSERT_TRUE(NoError(store.get("abc", value)));
+    ASSERT_EQ("second", value);
+    ASSERT_TRUE(NoError(store.get("abd", value)));
+    ASSERT_EQ(std::string(100000, 'y'), value);
+    ASSERT_EQ(2U, store.num_keys());
+    ASSERT_TRUE(NoError(store.erase("abc")));
+    ASSERT_EQ(make_error_condition(db_error::key_not_found),
+              store.get("abc", value));
+    ASSERT_EQ(1U, store.num_keys());
+    ASSERT_TRUE(NoError(store.close()));
+    File file("testdb.store");
+    ASSERT_TRUE(NoError(file.Delete()));
+    ASSERT_EQ(16ULL << 10, Store::index_bytes(2));
+    ASSERT_EQ(4ULL << 20, Store::index_bytes(3));
+    ASSERT_EQ(1ULL << 30, Store::index_bytes(4));
+}
+
+TEST(StoreTest, Recovery)
+{
+    std::map<std::string, std::string> expected;
+    std::uint64_t logSize;
+    {
+        Store store("testdb.store", 2);
+        ASSERT_TRUE(NoError(store.open()));
+        XORShiftEngine gen(7);
+        std::uniform_int_distribution<std::size_t> dist(0, 0xFFFF);
+        for (std::size_t i = 0; i < 5000; i++)
+        {
+            auto const pos = dist(gen);
+            std::string key{static_cast<char>(pos >> 8),
+                            static_cast<char>(pos & 0xFF)};
+            if (i % 5 == 4 && expected.count(key))
+            {
+                ASSERT_TRUE(NoError(store.erase(key)));
+                expected.erase(key);
+                continue;
+            }
+            std::string value(1 + i % 3000, static_cast<char>('a' + i % 26));
+            ASSERT_TRUE(NoError(store.put(key, value)));
+            expected[key] = value;
+        }
+        logSize = store.log_size();
+        ASSERT_TRUE(NoError(store.close()));
+    }
+    // A crash part way through appending a record.
+    File file("testdb.store");
+    ASSERT_TRUE(NoError(file.OpenAppend()));
+    std::string torn(100, 'z');
+    ASSERT_TRUE(NoError(file.Write(torn.data(), torn.size())));
+    ASSERT_TRUE(NoError(file.Close()));
+
+    Store store("testdb.store", 2);
+    ASSERT_TRUE(NoError(store.open()));
+    ASSERT_EQ(logSize, store.log_size());
+    ASSERT_EQ(expected.size(), store.num_keys());
+    std::string value;
+    for (auto const &e : expected)
+    {
+        ASSERT_TRUE(NoError(store.get(e.first, value)));
+        ASSERT_EQ(e.second, value);
+    }
+    ASSERT_TRUE(NoError(store.put("zz", "after")));
+    ASSERT_TRUE(NoError(store.close()));
+    Store reopened("testdb.store", 2);
+    ASSERT_TRUE(NoError(reopened.open()));
+    ASSERT_TRUE(NoError(reopened.get("zz", value)));
+    ASSERT_EQ("after", value);
+    ASSERT_TRUE(NoError(reopened.close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
+
+TEST(StoreTest, DamagedRecord)
+{
+    const std::size_t valueLength = 100;
+    const std::size_t recordLength = 8 + 2 + valueLength;
+    {
+        Store store("testdb.store", 2);
+        ASSERT_TRUE(NoError(store.open()));
+        for (char k = 'a'; k < 'k'; k++)
+            ASSERT_TRUE(NoError(store.put(std::string(2, k),
+                                          std::string(valueLength, k))));
+        ASSERT_EQ(10 * recordLength, store.log_size());
+        ASSERT_TRUE(NoError(store.close()));
+    }
+    // A flipped byte in the value of the fourth of ten records.
+    File file("testdb.store");
+    ASSERT_TRUE(NoError(file.Open()));
+    ASSERT_TRUE(NoError(file.WriteAt(3 * recordLength + 50, "!", 1)));
+    {
+        Store store("testdb.store", 2);
+        ASSERT_EQ(make_error_condition(db_error::corrupt_file), store.open());
+        ASSERT_TRUE(NoError(store.close()));
+    }
+    std::uint64_t size;
+    ASSERT_TRUE(NoError(file.Size(size)));
+    ASSERT_EQ(10 * recordLength, size);
+    // The same damage in the last record is a torn write and is cut off.
+    ASSERT_TRUE(NoError(file.Truncate(4 * recordLength)));
+    Store store("testdb.store", 2);
+    ASSERT_TRUE(NoError(store.open()));
+    ASSERT_EQ(3 * recordLength, store.log_size());
+    ASSERT_EQ(3U, store.num_keys());
+    ASSERT_TRUE(NoError(store.close()));
+    ASSERT_TRUE(NoError(file.Delete()));
+}
@@ -1,5 +1,12 @@
 #include "gtest/gtest.h"
 #include "tests/sparseindex_unittest.h"
+#include "tests/concurrentsparseindex_unittest.h"
+#include "tests/durablesparseindex_unittest.h"
+#include "tests/pagedsparseindex_unittest.h"
+#include "tests/store_unittest.h"
+#include "tests/keyedsparseindex_unittest.h"
+#include "tests/valuelog_unittest.h"
+#include "tests/indexmerger_unittest.h"
 
 GTEST_API_ int main(int argc, char **argv)
 {
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tests/sparseindex_unittest.h"
+#include "sparsedb/valuelog.h"
+
+// Deletes the segments of a ValueLog left by a previous run.
+static void RemoveValueLog(std::string const &name)
+{
+    for (std::size_t i = 1; i < 1000; i++)
+    {
+        File segment(name + "." + std::to_string(i));
+        if (segment.Exists())
+            segment.Delete();
+    }
+}
+
+static std::string LogValue(std::size_t const pos, std::size_t const round)
+{
+    return std::string(1 + (pos * 7 + round) % 500,
+                       static_cast<char>('a' + (pos + round) % 26));
+}
+
+TEST(ValueLogTest, CollectAndRecover)
+{
+    RemoveValueLog("testdb.vlog");
+    std::map<std::size_t, std::string> expected;
+    std::size_t segments;
+    {
+        ValueLog log("testdb.vlog", 1 << 16, 64 << 10);
+        ASSERT_TRUE(NoError(log.open()));
+        std::string value;
+        ASSERT_EQ(make_error_condition(db_error::key_not_found),
+                  log.get(1, value));
+        ASSERT_EQ(make_error_condition(db_error::zero_length_value),
+                  log.put(1, ""));
+        ASSERT_TRUE(NoError(log.put(1, std::string(10000, 'q'))));
+        ASSERT_TRUE(NoError(log.get(1, value)));
+        ASSERT_EQ(std::string(10000, 'q'), value);
+        expected[1] = value;
+        // Each round overwrites every position, leaving the segments of
+        // earlier rounds all garbage.
+        for (std::size_t round = 0; round < 4; round++)
+        {
+            for (std::size_t pos = 100; pos < 1100; pos++)
+            {
+                expected[pos] = LogValue(pos, round);
+                ASSERT_TRUE(NoError(log.put(pos, expected[pos])));
+            }
+        }
+        segments = log.num_segments();
+        auto const bytes = log.disk_bytes();
+        GcOptions options;
+        options.bytesPerSecond = 0;
+        ASSERT_TRUE(NoError(log.collect(options)));
+        auto const stats = log.gc_stats();
+        ASSERT_LT(0U, stats.segments);
+        ASSERT_LT(0U, stats.recordsMoved);
+        ASSERT_GT(segments, log.num_segments());
+        ASSERT_GT(bytes, log.disk_bytes());
+        segments = log.num_segments();
+        ASSERT_EQ(expected.size(), log.num_nonempty());
+        for (auto const &e : expected)
+        {
+            ASSERT_TRUE(NoError(log.get(e.first, value)));
+            ASSERT_EQ(e.second, value);
+        }
+        ASSERT_TRUE(NoError(log.close()));
+    }
+    // A crash part way through appending a record to the newest segment.
+    std::size_t newest = 0;
+    for (std::size_t i = 1; i < 1000; i++)
+    {
+        if (File("testdb.vlog." + std::to_string(i)).Exists())
+            newest = i;
+    }
+    File file("testdb.vlog." + std::to_string(newest));
+    ASSERT_TRUE(NoError(file.OpenAppend()));
+    std::string torn(100, 'z');
+    ASSERT_TRUE(NoError(file.Write(torn.data(), torn.size())));
+    ASSERT_TRUE(NoError(file.Close()));
+
+    ValueLog log("testdb.vlog", 1 << 16, 64 << 10);
+    ASSERT_TRUE(NoError(log.open()));
+    // The reopened log adds a new segment for puts.
+    ASSERT_EQ(segments + 1, log.num_segments());
+    ASSERT_EQ(expected.size(), log.num_nonempty());
+    std::string value;
+    for (auto const &e : expected)
+    {
+        ASSERT_TRUE(NoError(log.get(e.first, value)));
+        ASSERT_EQ(e.second, value);
+    }
+    ASSERT_TRUE(NoError(log.close()));
+    RemoveValueLog("testdb.vlog");
+}
+
+TEST(ValueLogTest, BackgroundCollection)
+{
+    RemoveValueLog("testdb.vlog");
+    const std::size_t numWriters = 2;
+    const std::size_t numReaders = 2;
+    const std::size_t rounds = 20;
+    const std::size_t perWriter = 500;
+    ValueLog log("testdb.vlog", 1 << 16, 32 << 10);
+    ASSERT_TRUE(NoError(log.open()));
+    GcOptions options;
+    options.minGarbage = 0.3;
+    options.interval = std::chrono::milliseconds(1);
+    log.start_gc(options);
+    std::atomic<bool> done{false};
+    std::atomic<std::size_t> errors{0};
+    std::vector<std::thread> threads;
+    // Writers own every numWriters'th position and readers check that a
+    // value, whichever round it is from, belongs to its position.
+    for (std::size_t w = 0; w < numWriters; w++)
+        threads.emplace_back([&, w]()
+                             {
+            for (std::size_t round = 0; round < rounds; round++)
+            {
+                for (std::size_t i = 0; i < perWriter; i++)
+                {
+                    auto const pos = i * numWriters + w;
+                    if (log.put(pos, LogValue(pos, round)))
+                        errors++;
+                }
+            }
+        });
+    for (std::size_t r = 0; r < numReaders; r++)
+        threads.emplace_back([&, r]()
+                             {
+            std::uniform_int_distribution<std::size_t> posDist(
+                0, perWriter * numWriters - 1);
+            XORShiftEngine gen(r + 1);
+            std::string value;
+            while (!done)
+            {
+                auto const pos = posDist(gen);
+                auto const err = log.get(pos, value);
+                if (err == make_error_condition(db_error::key_not_found))
+                    continue;
+                bool found = false;
+                for (std::size_t round = 0; round < rounds; round++)
+                    found |= value == LogValue(pos, round);
+                if (err || !found)
+                    errors++;
+            }
+        });
+    for (std::size_t w = 0; w < numWriters; w++) threads[w].join();
+    done = true;
+    for (std::size_t r = 0; r < numReaders; r++)
+        threads[numWriters + r].join();
+    ASSERT_TRUE(NoError(log.stop_gc()));
+    ASSERT_EQ(0U, errors.load());
+    ASSERT_TRUE(NoError(log.collect()));
+    ASSERT_LT(0U, log.gc_stats().segments);
+    std::string value;
+    for (std::size_t pos = 0; pos < perWriter * numWriters; pos++)
+    {
+        ASSERT_TRUE(NoError(log.get(pos, value)));
+        ASSERT_EQ(LogValue(pos, rounds - 1), value);
+    }
+    ASSERT_TRUE(NoError(log.close()));
+    RemoveValueLog("testdb.vlog");
+}
@@ -2,10 +2,28 @@
 #include <cstdint>
 #include <cstdio>
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <sparsedb/stopwatch.h>
 #include <sparsedb/xorshift.h>
 #include <sparsedb/sparsevector.h>
+#include <sparsedb/packedvector.h>
 #include <sparsedb/sparseindex.h>
+#include <sparsedb/mappedsparseindex.h>
+#include <sparsedb/concurrentsparseindex.h>
+#include <sparsedb/durablesparseindex.h>
+#include <sparsedb/pagedsparseindex.h>
+#include <sparsedb/store.h>
+#include <sparsedb/keyedsparseindex.h>
+#include <sparsedb/valuelog.h>
+#include <sparsedb/indexmerger.h>
+#include <sparsedb/lazysparseindex.h>
+#include <sparsedb/threadpool.h>
 
 using namespace sparsedb;
 
@@ -18,24 +36,551 @@ void checkError(std::error_condition err)
     }
 }
 
-// Pass the filename as the argument
-int main(int argc, char* argv[])
+// Splits N operations across threads, calling op(i, pos) with positions
+// drawn from [0, width). Returns the number of ops that returned true.
+template <class Op>
+std::size_t runThreads(std::size_t const threads, std::uint64_t const width,
+                       std::size_t const N, Op op)
 {
-    if (argc != 4)
+    std::atomic<std::size_t> total{0};
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < threads; t++)
+        workers.emplace_back([&, t]()
+                             {
+            XORShiftEngine gen(t + 1);
+            std::uniform_int_distribution<uint64_t> dist(0, width - 1);
+            std::size_t count = 0;
+            for (std::size_t i = t; i < N; i += threads)
+                count += op(i, dist(gen));
+            total += count;
+        });
+    for (auto& w : workers) w.join();
+    return total;
+}
+
+// Inserts N values that grow with their position, as file offsets would,
+// into an index with groups of type Vector. Reports insert and get
+// throughput and the memory used per key by the groups and their payloads.
+template <class Vector>
+void benchValues(std::string const& name, std::uint64_t const width,
+                 std::size_t const N)
+{
+    SparseIndex<Vector> index(width);
+    XORShiftEngine gen;
+    gen.seed(1234);
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    auto const before = index.allocator_stats().used;
+
+    StopWatch<std::chrono::steady_clock> t;
+    for (size_t i = 0; i < N; i++)
     {
-        std::cout << "usage: " << argv[0] << " <filename> <width> <factor>"
+        auto const pos = prefixDist(gen);
+        index.insert(pos, pos * 100);
+    }
+    std::cout << name << "Insert\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    t.reset();
+    gen.seed(1234);
+    std::size_t found = 0;
+    for (size_t i = 0; i < N; i++) found += index.get(prefixDist(gen)).second;
+    std::cout << name << "Get\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    if (found != N)
+        std::cerr << name << "Get mismatch: " << found << std::endl;
+    auto const groups = (width + Vector::SIZE - 1) / Vector::SIZE;
+    auto const used = index.allocator_stats().used - before +
+                      groups * sizeof(Vector);
+    std::cout << name << "Memory\t"
+              << static_cast<double>(used) / index.num_nonempty()
+              << " bytes per key" << std::endl;
+}
+
+// Inserts through a DurableSparseIndex, committing a batch every BATCH
+// inserts, under fsync policies from never to every commit. Capped so that
+// the fsync per commit policy finishes in reasonable time.
+template <class Vector>
+void benchWal(std::string const& filename, std::uint64_t const width,
+              std::size_t const N)
+{
+    const std::size_t BATCH = 64;
+    const auto ops = std::min<std::size_t>(N, 1ULL << 18);
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    for (std::size_t syncEvery : {0, 64, 1})
+    {
+        auto const checkpointFile = filename + ".checkpoint";
+        auto const logFile = filename + ".log";
+        {
+            File log(logFile);
+            checkError(log.Open(true));
+            checkError(log.Close());
+        }
+        DurableSparseIndex<Vector> index(width, checkpointFile, logFile,
+                                         syncEvery);
+        checkError(index.open());
+        gen.seed(1234);
+        StopWatch<std::chrono::steady_clock> t;
+        for (std::size_t i = 0; i < ops; i++)
+        {
+            index.insert(prefixDist(gen), i);
+            if (i % BATCH == BATCH - 1)
+                checkError(index.commit());
+        }
+        checkError(index.close());
+        std::cout << "WalSync" << syncEvery << "Insert\t" << ops
+                  << " keys in " << t << " seconds" << std::endl;
+        checkError(File(checkpointFile).Delete());
+        checkError(File(logFile).Delete());
+    }
+}
+
+// Writes a full checkpoint of N keys, then a delta checkpoint after
+// changing one key in a hundred, reporting the time and bytes written.
+template <class Vector>
+void benchCheckpoint(std::string const& filename, std::uint64_t const width,
+                     std::size_t const N)
+{
+    auto const checkpointFile = filename + ".checkpoint";
+    auto const logFile = filename + ".log";
+    for (auto const& name : {checkpointFile, checkpointFile + ".1", logFile})
+    {
+        File file(name);
+        if (file.Exists())
+            checkError(file.Delete());
+    }
+    DurableSparseIndex<Vector> index(width, checkpointFile, logFile, 0);
+    checkError(index.open());
+    XORShiftEngine gen;
+    gen.seed(1234);
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    for (std::size_t i = 0; i < N; i++) index.insert(prefixDist(gen), i);
+    auto fileSize = [](std::string const& name)
+    {
+        File file(name);
+        checkError(file.Open());
+        std::uint64_t size;
+        checkError(file.Size(size));
+        checkError(file.Close());
+        return size;
+    };
+    StopWatch<std::chrono::steady_clock> t;
+    checkError(index.compact());
+    std::cout << "FullCheckpoint\t" << N << " keys in " << t << " seconds "
+              << fileSize(checkpointFile) << " bytes" << std::endl;
+    for (std::size_t i = 0; i < N / 100; i++)
+        index.insert(prefixDist(gen), i);
+    auto const dirty = index.dirty_groups();
+    t.reset();
+    checkError(index.checkpoint());
+    std::cout << "DeltaCheckpoint\t" << dirty << " groups in " << t
+              << " seconds " << fileSize(checkpointFile + ".1") << " bytes"
+              << std::endl;
+    checkError(index.close());
+    checkError(File(checkpointFile).Delete());
+    checkError(File(checkpointFile + ".1").Delete());
+    checkError(File(logFile).Delete());
+}
+
+// Random inserts and then gets against a PagedSparseIndex whose buffer pool
+// holds an eighth of the pages, reporting the pool's hit rate, evictions
+// and mean I/O latency. Capped as most operations fault a page.
+template <class Vector>
+void benchPaged(std::string const& filename, std::uint64_t const width,
+                std::size_t const N)
+{
+    using Index = PagedSparseIndex<Vector>;
+    const auto ops = std::min<std::size_t>(N, 1ULL << 18);
+    auto const pages = (width + Vector::SIZE * Index::PAGE_GROUPS - 1) /
+                       (Vector::SIZE * Index::PAGE_GROUPS);
+    File file(filename + ".paged");
+    Index index(std::max<std::size_t>(1, pages / 8));
+    checkError(file.Open(true));
+    checkError(index.create(file, width));
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    using Clock = StopWatch<std::chrono::steady_clock>;
+    auto report = [&](std::string const& name, Clock const& t)
+    {
+        auto const& stats = index.stats();
+        std::cout << name << "\t" << ops << " keys in " << t << " seconds "
+                  << 100.0 * stats.hits / (stats.hits + stats.misses)
+                  << "% hits " << stats.evictions << " evictions "
+                  << stats.readNanos / 1000.0 / std::max<std::size_t>(
+                                                    1, stats.reads)
+                  << " us/read "
+                  << stats.writeNanos / 1000.0 / std::max<std::size_t>(
+                                                     1, stats.writes)
+                  << " us/write" << std::endl;
+    };
+    typename Index::return_type result;
+    gen.seed(1234);
+    Clock t;
+    for (std::size_t i = 0; i < ops; i++)
+        checkError(index.insert(prefixDist(gen), i, result));
+    checkError(index.flush());
+    report("PagedInsert", t);
+    checkError(index.open(file));
+    gen.seed(1234);
+    t.reset();
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < ops; i++)
+    {
+        checkError(index.get(prefixDist(gen), result));
+        found += result.second;
+    }
+    report("PagedGet", t);
+    if (found != ops)
+        std::cerr << "PagedGet mismatch: " << found << std::endl;
+    checkError(index.close());
+    checkError(file.Delete());
+}
+
+// Overlap of two indexes of N random positions each, by iterating one and
+// probing the other against the bitmap set operations.
+template <class Vector>
+void benchSetOps(std::uint64_t const width, std::size_t const N)
+{
+    SparseIndex<Vector> a(width), b(width), out(width);
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    gen.seed(1);
+    for (std::size_t i = 0; i < N; i++) a.insert(prefixDist(gen), i);
+    gen.seed(2);
+    for (std::size_t i = 0; i < N; i++) b.insert(prefixDist(gen), i);
+    StopWatch<std::chrono::steady_clock> t;
+    std::size_t probed = 0;
+    for (auto const& e : a) probed += b.has(e.first);
+    std::cout << "ProbeOverlap\t" << probed << " common in " << t
+              << " seconds" << std::endl;
+    t.reset();
+    auto const counted = SparseIndex<Vector>::intersect_count(a, b);
+    std::cout << "IntersectCount\t" << counted << " common in " << t
+              << " seconds" << std::endl;
+    if (counted != probed)
+        std::cerr << "IntersectCount mismatch: " << counted << std::endl;
+    t.reset();
+    out.intersect(a, b);
+    std::cout << "Intersect\t" << out.num_nonempty() << " keys in " << t
+              << " seconds" << std::endl;
+    t.reset();
+    out.unite(a, b);
+    std::cout << "Unite\t" << out.num_nonempty() << " keys in " << t
+              << " seconds" << std::endl;
+    t.reset();
+    out.subtract(a, b);
+    std::cout << "Subtract\t" << out.num_nonempty() << " keys in " << t
+              << " seconds" << std::endl;
+}
+
+// Merges shards of N random positions between them through IndexMerger,
+// against reading every shard into memory and uniting them.
+template <class Vector>
+void benchMerge(std::string const& filename, std::uint64_t const width,
+                std::size_t const N)
+{
+    const std::size_t shards = 4;
+    std::vector<std::unique_ptr<File>> files;
+    std::vector<File*> inputs;
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    gen.seed(1234);
+    for (std::size_t s = 0; s < shards; s++)
+    {
+        SparseIndex<Vector> shard(width);
+        for (std::size_t i = 0; i < N / shards; i++)
+            shard.insert(prefixDist(gen), i);
+        files.emplace_back(
+            new File(filename + ".shard" + std::to_string(s)));
+        checkError(files.back()->Open(true));
+        checkError(shard.write(*files.back()));
+        inputs.push_back(files.back().get());
+    }
+    File output(filename + ".merged");
+    checkError(output.Open(true));
+    StopWatch<std::chrono::steady_clock> t;
+    checkError(IndexMerger<Vector>().merge(inputs, output));
+    checkError(output.Sync());
+    std::cout << "StreamMerge\t" << shards << " shards in " << t
+              << " seconds" << std::endl;
+    t.reset();
+    SparseIndex<Vector> merged(width), shard(width);
+    for (std::size_t s = 0; s < shards; s++)
+    {
+        File in(filename + ".shard" + std::to_string(s));
+        checkError(in.Open());
+        checkError(shard.read(in));
+        checkError(in.Close());
+        merged.unite(merged, shard, KeepLast());
+    }
+    std::cout << "LoadMerge\t" << shards << " shards in " << t << " seconds"
+              << std::endl;
+    for (auto const& f : files) checkError(f->Delete());
+    checkError(output.Delete());
+}
+
+// Writes and reads back N random positions, then a sparser index of N / 64
+// whose bitmaps are mostly empty, as plain and as compressed files.
+template <class Vector>
+void benchCompression(std::string const& filename, std::uint64_t const width,
+                      std::size_t const N, ThreadPool& pool)
+{
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    File file(filename + ".compressed");
+    for (std::size_t factor : {1, 64})
+    {
+        SparseIndex<Vector> index(width), loaded(width);
+        gen.seed(1234);
+        for (std::size_t i = 0; i < N / factor; i++)
+            index.insert(prefixDist(gen), i);
+        for (bool compressed : {false, true})
+        {
+            auto const name = std::string(factor == 1 ? "" : "Sparse") +
+                              (compressed ? "Compressed" : "Plain");
+            checkError(file.Open(true));
+            StopWatch<std::chrono::steady_clock> t;
+            checkError(compressed ? index.write_compressed(file, pool)
+                                  : index.write(file, pool));
+            std::uint64_t size;
+            checkError(file.Size(size));
+            std::cout << name << "Write\t" << N / factor << " keys in " << t
+                      << " seconds, " << size << " bytes" << std::endl;
+            t.reset();
+            checkError(loaded.read(file));
+            std::cout << name << "Read\t" << N / factor << " keys in " << t
+                      << " seconds" << std::endl;
+            t.reset();
+            checkError(loaded.read(file, pool));
+            std::cout << name << "ParallelRead\t" << N / factor
+                      << " keys in " << t << " seconds" << std::endl;
+            if (!(loaded == index))
+                std::cerr << name << " mismatch" << std::endl;
+            checkError(file.Close());
+        }
+    }
+    checkError(file.Delete());
+}
+
+// Looks up a few random positions straight from a file with a directory,
+// then the same positions with a cache of groups and after loading the
+// whole file instead.
+template <class Vector>
+void benchLazy(std::string const& filename, std::uint64_t const width,
+               std::size_t const N)
+{
+    const std::size_t lookups = 1000;
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
+    File file(filename + ".lazy");
+    {
+        SparseIndex<Vector> index(width);
+        gen.seed(1234);
+        for (std::size_t i = 0; i < N; i++) index.insert(prefixDist(gen), i);
+        checkError(file.Open(true));
+        checkError(index.write_with_directory(file));
+        checkError(file.Close());
+    }
+    typename Vector::return_type result;
+    std::size_t found = 0;
+    for (std::size_t cacheGroups : {0, 64})
+    {
+        StopWatch<std::chrono::steady_clock> t;
+        checkError(file.Open());
+        LazySparseIndex<Vector> lazy(cacheGroups);
+        checkError(lazy.open(file));
+        gen.seed(1234);
+        for (std::size_t i = 0; i < lookups; i++)
+        {
+            checkError(lazy.get(prefixDist(gen), result));
+            found += result.second;
+        }
+        std::cout << (cacheGroups ? "CachedLazyGet\t" : "LazyGet\t") << lookups
+                  << " keys in " << t << " seconds, "
+                  << double(lazy.stats().reads) / lookups << " reads per key"
                   << std::endl;
-        std::exit(1);
+        checkError(file.Close());
     }
-    const std::string filename(argv[1]);
-    const auto width = 1ULL << strtoul(argv[2], 0, 10);
-    const auto factor = strtoul(argv[3], 0, 10);
+    StopWatch<std::chrono::steady_clock> t;
+    checkError(file.Open());
+    SparseIndex<Vector> loaded(width);
+    checkError(loaded.read(file));
+    gen.seed(1234);
+    for (std::size_t i = 0; i < lookups; i++)
+        found -= 2 * loaded.get(prefixDist(gen)).second;
+    std::cout << "LoadGet\t" << lookups << " keys in " << t << " seconds"
+              << std::endl;
+    if (found)
+        std::cerr << "LazyGet mismatch: " << found << std::endl;
+    checkError(file.Close());
+    checkError(file.Delete());
+}
+
+// Puts and then gets random three byte keys with values of valueLength
+// bytes through a Store. Capped to keep the log to a few hundred MB.
+void benchStore(std::string const& filename, std::size_t const valueLength,
+                std::size_t const N)
+{
+    const auto ops =
+        std::min<std::size_t>(N, (256ULL << 20) / (valueLength + 16));
+    File file(filename + ".store");
+    checkError(file.Open(true));
+    checkError(file.Close());
+    Store store(filename + ".store", 3);
+    checkError(store.open());
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> keyDist(0, (1 << 24) - 1);
+    auto key = [&]()
+    {
+        auto const k = keyDist(gen);
+        return std::string{static_cast<char>(k >> 16),
+                           static_cast<char>(k >> 8), static_cast<char>(k)};
+    };
+    std::string value(valueLength, 'v');
+    auto const name = "Store" + std::to_string(valueLength);
+    gen.seed(1234);
+    StopWatch<std::chrono::steady_clock> t;
+    for (std::size_t i = 0; i < ops; i++) checkError(store.put(key(), value));
+    std::cout << name << "Put\t" << ops << " keys in " << t << " seconds"
+              << std::endl;
+    gen.seed(1234);
+    t.reset();
+    for (std::size_t i = 0; i < ops; i++) checkError(store.get(key(), value));
+    std::cout << name << "Get\t" << ops << " keys in " << t << " seconds"
+              << std::endl;
+    checkError(store.close());
+    t.reset();
+    checkError(store.open());
+    std::cout << name << "Open\t" << store.num_keys() << " keys in " << t
+              << " seconds" << std::endl;
+    checkError(store.close());
+    checkError(file.Delete());
+}
+
+// Foreground put and get latency of a ValueLog holding mostly garbage,
+// without collection, with unthrottled collection and with collection
+// limited to bytesPerSecond. Each phase first overwrites every key so that
+// the collector has the same garbage to work through.
+void benchValueLog(std::string const& filename, std::size_t const N)
+{
+    const std::size_t keys = std::min<std::size_t>(N, 1 << 16);
+    const std::size_t ops = std::min<std::size_t>(N, 1 << 18);
+    const std::string value(256, 'v');
+    ValueLog log(filename + ".vlog", keys, 4 << 20);
+    checkError(log.open());
+    XORShiftEngine gen;
+    std::uniform_int_distribution<uint64_t> keyDist(0, keys - 1);
+    using Clock = std::chrono::steady_clock;
+    auto phase = [&](std::string const& name, bool const gc,
+                     std::uint64_t const bytesPerSecond)
+    {
+        for (std::size_t round = 0; round < 4; round++)
+        {
+            for (std::size_t k = 0; k < keys; k++)
+                checkError(log.put(k, value));
+        }
+        auto const before = log.gc_stats();
+        GcOptions options;
+        options.bytesPerSecond = bytesPerSecond;
+        options.interval = std::chrono::milliseconds(1);
+        if (gc)
+            log.start_gc(options);
+        std::vector<std::uint64_t> nanos(ops);
+        std::string result;
+        StopWatch<Clock> t;
+        for (std::size_t i = 0; i < ops; i++)
+        {
+            auto const start = Clock::now();
+            if (i % 2)
+                checkError(log.put(keyDist(gen), value));
+            else
+                checkError(log.get(keyDist(gen), result));
+            nanos[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           Clock::now() - start)
+                           .count();
+        }
+        std::cout << name << "\t" << ops << " ops in " << t << " seconds ";
+        checkError(log.stop_gc());
+        auto const after = log.gc_stats();
+        std::sort(nanos.begin(), nanos.end());
+        std::cout << nanos[ops / 2] / 1000.0 << " us p50 "
+                  << nanos[ops * 99 / 100] / 1000.0 << " us p99 "
+                  << after.segments - before.segments << " segments "
+                  << after.recordsMoved - before.recordsMoved << " moved"
+                  << std::endl;
+    };
+    phase("ValueLogNoGC", false, 0);
+    phase("ValueLogGC", true, 0);
+    phase("ValueLogGCThrottled", true, 16ULL << 20);
+    checkError(log.close());
+    // Segment numbers have gaps where segments were collected.
+    for (std::size_t i = 1; i < 10000; i++)
+    {
+        File segment(filename + ".vlog." + std::to_string(i));
+        if (segment.Exists())
+            checkError(segment.Delete());
+    }
+}
+
+// Inserts and gets random 32 byte keys through a KeyedSparseIndex of width
+// positions, against a std::unordered_map holding the same keys. Capped at
+// three quarters full, as probes grow quickly beyond that.
+template <class Vector>
+void benchKeyed(std::uint64_t const width, std::size_t const ops)
+{
+    const auto N = std::min<std::size_t>(ops, width / 4 * 3);
+    KeyedSparseIndex<Vector> index(__builtin_ctzll(width), 32);
+    std::vector<std::string> keys(N);
+    XORShiftEngine gen;
+    gen.seed(1234);
+    for (auto& key : keys)
+    {
+        key.resize(32);
+        for (auto& c : key) c = static_cast<char>(gen());
+    }
+    auto const before = index.index().allocator_stats().used;
+    typename KeyedSparseIndex<Vector>::return_type previous;
+    StopWatch<std::chrono::steady_clock> t;
+    for (std::size_t i = 0; i < N; i++)
+        checkError(index.insert(keys[i], i, previous));
+    std::cout << "KeyedInsert\t" << N << " keys in " << t << " seconds "
+              << index.max_distance() << " max distance" << std::endl;
+    t.reset();
+    std::size_t found = 0;
+    for (auto const& key : keys) found += index.get(key).second;
+    std::cout << "KeyedGet\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    if (found != N)
+        std::cerr << "KeyedGet mismatch: " << found << std::endl;
+    auto const used = index.index().allocator_stats().used - before +
+                      width / Vector::SIZE * sizeof(Vector);
+    std::cout << "KeyedMemory\t" << static_cast<double>(used) / N
+              << " bytes per key" << std::endl;
+
+    std::unordered_map<std::string, std::uint64_t> map;
+    t.reset();
+    for (std::size_t i = 0; i < N; i++) map[keys[i]] = i;
+    std::cout << "HashMapInsert\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    t.reset();
+    found = 0;
+    for (auto const& key : keys) found += map.count(key);
+    std::cout << "HashMapGet\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+}
+
+// Runs every benchmark against an index of GROUP wide groups.
+template <std::size_t GROUP>
+int run(std::string const& filename, std::uint64_t const width,
+        std::uint64_t const factor, std::size_t const threads)
+{
+    using Vector = SparseVector<std::uint64_t, GROUP>;
     const auto N = width / factor;
 
     std::cout << "SparseIndex size: " << width << " factor: " << factor
+              << " threads: " << threads << " group: " << GROUP
               << std::endl;
 
-    SparseIndex<SparseVector<std::uint64_t>> index(width);
+    SparseIndex<Vector> index(width);
     XORShiftEngine gen;
     gen.seed(1234);
     std::uniform_int_distribution<uint64_t> prefixDist(0, width - 1);
@@ -48,18 +593,130 @@ int main(int argc, char* argv[])
     // Fill the table
     for (size_t i = 0; i < N; i++) index.insert(prefixDist(gen), i);
     std::cout << "Add\t" << N << " keys in " << t << " seconds" << std::endl;
+    auto stats = index.allocator_stats();
+    std::cout << "Memory\t" << stats.used << " bytes used of " << stats.reserved
+              << " bytes reserved" << std::endl;
+
+    // Build the same table from sorted input
+    std::vector<std::pair<std::size_t, std::uint64_t>> pairs(N);
+    gen.seed(1234);
+    for (size_t i = 0; i < N; i++)
+        pairs[i] = std::make_pair(prefixDist(gen), i);
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [](std::pair<std::size_t, std::uint64_t> const& a,
+                        std::pair<std::size_t, std::uint64_t> const& b)
+                     {
+        return a.first < b.first;
+    });
+    ThreadPool pool(threads);
+    {
+        SparseIndex<Vector> bulk(width);
+        t.reset();
+        bulk.bulk_load(pairs.begin(), pairs.end());
+        std::cout << "BulkLoad\t" << N << " keys in " << t << " seconds"
+                  << std::endl;
+        t.reset();
+        bulk.bulk_load(pairs.begin(), pairs.end(), pool);
+        std::cout << "ParallelBulkLoad\t" << N << " keys in " << t
+                  << " seconds" << std::endl;
+        if (!(bulk == index))
+            std::cerr << "BulkLoad mismatch" << std::endl;
+    }
+    pairs.clear();
+    pairs.shrink_to_fit();
 
     // Read the table
     t.reset();
     gen.seed(1234);
-    for (size_t i = 0; i < N; i++) index.get(prefixDist(gen));
+    std::size_t found = 0;
+    for (size_t i = 0; i < N; i++) found += index.get(prefixDist(gen)).second;
     std::cout << "Get\t" << N << " keys in " << t << " seconds" << std::endl;
 
+    // Read the table in batches
+    std::vector<std::size_t> positions(1024);
+    std::vector<typename Vector::return_type> results;
+    t.reset();
+    gen.seed(1234);
+    for (size_t i = 0; i < N; i += positions.size())
+    {
+        positions.resize(std::min<std::size_t>(positions.capacity(), N - i));
+        for (auto& pos : positions) pos = prefixDist(gen);
+        index.get_batch(positions, results);
+        for (auto const& r : results) found -= r.second;
+    }
+    std::cout << "BatchGet\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    if (found)
+        std::cerr << "BatchGet mismatch: " << found << std::endl;
+
+    // Scan the occupied positions in order
+    t.reset();
+    std::size_t scanned = 0;
+    for (auto const& entry : index) scanned += entry.second != ~0ULL;
+    std::cout << "Scan\t" << scanned << " keys in " << t << " seconds"
+              << std::endl;
+    t.reset();
+    index.for_each_in_range(0, width, [&](std::size_t, std::uint64_t value)
+                            {
+        scanned -= value != ~0ULL;
+    });
+    std::cout << "RangeScan\t" << index.num_nonempty() << " keys in " << t
+              << " seconds" << std::endl;
+    if (scanned)
+        std::cerr << "Scan mismatch: " << scanned << std::endl;
+
+    // Rank and select random positions
+    t.reset();
+    index.build_rank();
+    std::cout << "BuildRank\t" << index.num_nonempty() << " keys in " << t
+              << " seconds" << std::endl;
+    t.reset();
+    gen.seed(1234);
+    std::size_t ranks = 0;
+    for (size_t i = 0; i < N; i++) ranks += index.rank(prefixDist(gen));
+    std::cout << "Rank\t" << N << " keys in " << t << " seconds" << std::endl;
+    std::uniform_int_distribution<uint64_t> rankDist(0, index.num_nonempty());
+    t.reset();
+    for (size_t i = 0; i < N; i++) ranks += index.select(rankDist(gen));
+    std::cout << "Select\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    if (!ranks)
+        std::cerr << "Rank mismatch" << std::endl;
+
     // Write the file
     t.reset();
     index.write(file);
     std::cout << "Write\t" << N << " keys in " << t << " seconds" << std::endl;
 
+    t.reset();
+    checkError(index.write(file, pool));
+    std::cout << "ParallelWrite\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+
+    // Checkpoint a snapshot in the background while inserting.
+    {
+        t.reset();
+        auto snapshot = index.snapshot();
+        std::cout << "Snapshot\t" << N << " keys in " << t << " seconds"
+                  << std::endl;
+        File checkpoint(filename + ".snapshot");
+        checkError(checkpoint.Open(true));
+        t.reset();
+        std::thread writer([&]()
+                           {
+            checkError(snapshot->write(checkpoint, pool));
+            std::cout << "SnapshotWrite\t" << N << " keys in " << t
+                      << " seconds" << std::endl;
+        });
+        gen.seed(5678);
+        for (size_t i = 0; i < N; i++) index.insert(prefixDist(gen), i);
+        std::cout << "InsertDuringWrite\t" << N << " keys in " << t
+                  << " seconds" << std::endl;
+        writer.join();
+        checkError(checkpoint.Close());
+        checkError(checkpoint.Delete());
+    }
+
     t.reset();
     index.clear();
     std::cout << "Clear\t" << N << " keys in " << t << " seconds" << std::endl;
@@ -72,6 +729,155 @@ int main(int argc, char* argv[])
     index.read(file);
     std::cout << "Read\t" << N << " keys in " << t << " seconds" << std::endl;
 
+    t.reset();
+    checkError(index.read(file, pool));
+    std::cout << "ParallelRead\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+
+    // Map the file
+    t.reset();
+    MappedSparseIndex<Vector> mapped;
+    checkError(mapped.open(file));
+    std::cout << "Map\t" << N << " keys in " << t << " seconds" << std::endl;
+
+    t.reset();
+    gen.seed(1234);
+    for (size_t i = 0; i < N; i++) found += mapped.get(prefixDist(gen)).second;
+    std::cout << "MapGet\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    if (found != N)
+        std::cerr << "MapGet mismatch: " << found << std::endl;
+
+    // Checksums alone, once the mapping is faulted in, to set against Read.
+    checkError(mapped.verify());
+    t.reset();
+    checkError(mapped.verify());
+    std::cout << "MapVerify\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    checkError(mapped.close());
+
+#if SPARSEDB_URING
+    // Queued io_uring transfers against the synchronous fallback.
+    for (std::size_t depth : {64, 0})
+    {
+        UringFile uring(filename, depth);
+        auto const name = uring.Async() ? "Uring" : "Sync";
+        checkError(uring.Open(true));
+        t.reset();
+        checkError(index.write(uring));
+        std::cout << name << "Write\t" << N << " keys in " << t
+                  << " seconds" << std::endl;
+        t.reset();
+        checkError(index.read(uring));
+        std::cout << name << "Read\t" << N << " keys in " << t
+                  << " seconds" << std::endl;
+        checkError(uring.Close());
+    }
+#endif
+
+    // Mixed workload of one insert for every three gets, first through a
+    // single mutex and then with the concurrent index, which only supports
+    // 64 wide groups.
+    {
+        SparseIndex<Vector> locked(width);
+        std::mutex mutex;
+        t.reset();
+        runThreads(threads, width, N, [&](std::size_t i, std::size_t pos)
+                   {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (i % 4 == 0)
+                return locked.insert(pos, i).second;
+            return locked.get(pos).second;
+        });
+        std::cout << "LockedMixed\t" << N << " ops in " << t << " seconds"
+                  << std::endl;
+    }
+    {
+        ConcurrentSparseIndex<SparseVector<std::uint64_t>> concurrent(width);
+        t.reset();
+        runThreads(threads, width, N, [&](std::size_t i, std::size_t pos)
+                   {
+            if (i % 4 == 0)
+                return concurrent.insert(pos, i).second;
+            return concurrent.get(pos).second;
+        });
+        std::cout << "ConcurrentMixed\t" << N << " ops in " << t
+                  << " seconds" << std::endl;
+    }
+
+    // Plain against frame of reference packed values.
+    benchValues<Vector>("Plain", width, N);
+    benchValues<PackedVector<std::uint64_t, GROUP>>("Packed", width, N);
+
+    benchSetOps<Vector>(width, N);
+    benchMerge<Vector>(filename, width, N);
+    benchCompression<Vector>(filename, width, N, pool);
+    benchLazy<Vector>(filename, width, N);
+    benchWal<Vector>(filename, width, N);
+    benchCheckpoint<Vector>(filename, width, N);
+    benchPaged<Vector>(filename, width, N);
+    benchStore(filename, 16, N);
+    benchStore(filename, 4096, N);
+    benchKeyed<Vector>(width, N);
+    benchValueLog(filename, N);
+
+    // Delete heavy workloads: erase every other key, then churn with one
+    // erase for every insert.
+    t.reset();
+    gen.seed(1234);
+    for (size_t i = 0; i < N; i++)
+    {
+        auto pos = prefixDist(gen);
+        if (i % 2)
+            index.erase(pos);
+    }
+    std::cout << "Erase\t" << N / 2 << " keys in " << t << " seconds"
+              << std::endl;
+    t.reset();
+    for (size_t i = 0; i < N; i++)
+    {
+        index.insert(prefixDist(gen), i);
+        index.erase(prefixDist(gen));
+    }
+    std::cout << "Churn\t" << N << " keys in " << t << " seconds"
+              << std::endl;
+    stats = index.allocator_stats();
+    std::cout << "Memory\t" << stats.used << " bytes used of " << stats.reserved
+              << " bytes reserved" << std::endl;
+
     checkError(file.Close());
     return 0;
+}
+
+// Pass the filename as the argument
+int main(int argc, char* argv[])
+{
+    if (argc < 4 || argc > 6)
+    {
+        std::cout << "usage: " << argv[0]
+                  << " <filename> <width> <factor> [threads] [group]"
+                  << std::endl;
+        std::exit(1);
+    }
+    const std::string filename(argv[1]);
+    const auto width = 1ULL << strtoul(argv[2], 0, 10);
+    const auto factor = strtoul(argv[3], 0, 10);
+    const std::size_t threads =
+        argc >= 5 ? strtoul(argv[4], 0, 10)
+                  : std::max(1U, std::thread::hardware_concurrency());
+    const auto group = argc == 6 ? strtoul(argv[5], 0, 10) : 64;
+
+    switch (group)
+    {
+        case 64:
+            return run<64>(filename, width, factor, threads);
+        case 128:
+            return run<128>(filename, width, factor, threads);
+        case 256:
+            return run<256>(filename, width, factor, threads);
+        case 512:
+            return run<512>(filename, width, factor, threads);
+    }
+    std::cerr << "group must be one of 64, 128, 256 or 512" << std::endl;
+    return 1;
 }
\ No newline at end of file